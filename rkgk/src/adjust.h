@@ -0,0 +1,216 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "blend.h"
+#include "mathstuff.h"
+
+// per channel color adjustments baked into lookup tables. they compose into a single table, so any
+// stack of them costs one lookup per channel
+struct color_lut
+{
+	uint8_t table[4][256]; // r, g, b, a
+
+	color_lut()
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			for (int v = 0; v < 256; v++)
+			{
+				table[c][v] = (uint8_t)v;
+			}
+		}
+	}
+
+	// the same mapping for r, g and b, alpha is left alone
+	template <typename Fn>
+	static color_lut from(const Fn& fn)
+	{
+		color_lut lut;
+		for (int v = 0; v < 256; v++)
+		{
+			const uint8_t mapped = (uint8_t)std::max(0, std::min(255, (int)lround(fn(v / 255.0f) * 255)));
+			lut.table[0][v] = lut.table[1][v] = lut.table[2][v] = mapped;
+		}
+		return lut;
+	}
+
+	static color_lut levels(const int in_black, const int in_white, const float gamma, const int out_black, const int out_white)
+	{
+		return from([=](const float v)
+		{
+			const float in = std::max(0.0f, std::min(1.0f, (v * 255 - in_black) / std::max(1, in_white - in_black)));
+			return (out_black + std::pow(in, 1 / gamma) * (out_white - out_black)) / 255;
+		});
+	}
+
+	static color_lut curves(const float* points, const int count)
+	{
+		return from([=](const float v) { return curve_at(points, count, v); });
+	}
+
+	static color_lut posterize(const int levels)
+	{
+		const int steps = std::max(1, levels - 1);
+		return from([=](const float v) { return std::round(v * steps) / steps; });
+	}
+
+	static color_lut invert()
+	{
+		return from([](const float v) { return 1 - v; });
+	}
+
+	// this one first, then next
+	color_lut then(const color_lut& next) const
+	{
+		color_lut lut;
+		for (int c = 0; c < 4; c++)
+		{
+			for (int v = 0; v < 256; v++)
+			{
+				lut.table[c][v] = next.table[c][table[c][v]];
+			}
+		}
+		return lut;
+	}
+
+	// plain loads from the table, four pixels at a time. without pshufb (and with 256 entry tables
+	// even with it) there's nothing in sse2 that beats them
+	void apply(uint8_t* pixels, const int count) const
+	{
+		int i = 0;
+		for (; i + 4 <= count; i += 4, pixels += 16)
+		{
+			for (int p = 0; p < 16; p += 4)
+			{
+				pixels[p] = table[0][pixels[p]];
+				pixels[p + 1] = table[1][pixels[p + 1]];
+				pixels[p + 2] = table[2][pixels[p + 2]];
+				pixels[p + 3] = table[3][pixels[p + 3]];
+			}
+		}
+		for (; i < count; i++, pixels += 4)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				pixels[c] = table[c][pixels[c]];
+			}
+		}
+	}
+};
+
+struct hsl_shift
+{
+	float hue = 0; // degrees
+	float saturation = 0, lightness = 0; // -1 to 1, 0 leaves it as is
+};
+
+// one channel of hsl back to rgb, n is 0 for red, 8 for green and 4 for blue
+inline float hsl_channel(const float n, const float h, const float s, const float l)
+{
+	float k = n + h * 2;
+	k -= 12 * std::floor(k / 12);
+	const float a = s * std::min(l, 1 - l);
+	return l - a * std::max(-1.0f, std::min(std::min(k - 3, 9 - k), 1.0f));
+}
+
+inline void hsl_pixel(uint8_t* p, const hsl_shift& shift)
+{
+	const float r = p[0] / 255.0f, g = p[1] / 255.0f, b = p[2] / 255.0f;
+	const float max = std::max(r, std::max(g, b)), min = std::min(r, std::min(g, b));
+	const float chroma = max - min;
+	float l = (max + min) / 2;
+	float s = chroma > 0 ? chroma / (1 - std::abs(2 * l - 1)) : 0;
+	// hue in sixths of the circle
+	float h = 0;
+	if (chroma > 0) h = max == r ? (g - b) / chroma : max == g ? (b - r) / chroma + 2 : (r - g) / chroma + 4;
+	h += shift.hue / 60;
+
+	s = std::max(0.0f, std::min(1.0f, s * (1 + shift.saturation)));
+	l = shift.lightness > 0 ? l + (1 - l) * shift.lightness : l * (1 + shift.lightness);
+	p[0] = (uint8_t)lround(hsl_channel(0, h, s, l) * 255);
+	p[1] = (uint8_t)lround(hsl_channel(8, h, s, l) * 255);
+	p[2] = (uint8_t)lround(hsl_channel(4, h, s, l) * 255);
+}
+
+#ifdef RKGK_SSE2
+inline __m128 floor_sse2(const __m128 v)
+{
+	const __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+	return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, v), _mm_set1_ps(1)));
+}
+
+inline __m128 select_sse2(const __m128 mask, const __m128 a, const __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+inline __m128 hsl_channel_sse2(const float n, const __m128 h2, const __m128 a, const __m128 l)
+{
+	__m128 k = _mm_add_ps(_mm_set1_ps(n), h2);
+	k = _mm_sub_ps(k, _mm_mul_ps(_mm_set1_ps(12), floor_sse2(_mm_mul_ps(k, _mm_set1_ps(1 / 12.0f)))));
+	const __m128 f = _mm_max_ps(_mm_set1_ps(-1), _mm_min_ps(_mm_min_ps(_mm_sub_ps(k, _mm_set1_ps(3)), _mm_sub_ps(_mm_set1_ps(9), k)), _mm_set1_ps(1)));
+	return _mm_sub_ps(l, _mm_mul_ps(a, f));
+}
+#endif
+
+// hue, saturation and lightness shifts, four pixels at a time as r, g and b registers
+inline void hsl_span(uint8_t* pixels, const int count, const hsl_shift& shift)
+{
+	int i = 0;
+#ifdef RKGK_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 one = _mm_set1_ps(1), inv_255 = _mm_set1_ps(1 / 255.0f);
+	const __m128 hue = _mm_set1_ps(shift.hue / 60), saturation = _mm_set1_ps(1 + shift.saturation);
+	for (; i + 4 <= count; i += 4)
+	{
+		uint8_t* p = pixels + i * 4;
+		const __m128i packed = _mm_loadu_si128((const __m128i*)p);
+		const __m128i lo = _mm_unpacklo_epi8(packed, zero), hi = _mm_unpackhi_epi8(packed, zero);
+		__m128 r = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+		__m128 g = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+		__m128 b = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+		__m128 a = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+		// pixels to channels
+		_MM_TRANSPOSE4_PS(r, g, b, a);
+		r = _mm_mul_ps(r, inv_255);
+		g = _mm_mul_ps(g, inv_255);
+		b = _mm_mul_ps(b, inv_255);
+
+		const __m128 max = _mm_max_ps(r, _mm_max_ps(g, b)), min = _mm_min_ps(r, _mm_min_ps(g, b));
+		const __m128 chroma = _mm_sub_ps(max, min);
+		const __m128 gray = _mm_cmple_ps(chroma, _mm_setzero_ps());
+		// dividing by 1 where there's no chroma, those get masked out below anyway
+		const __m128 inv_chroma = _mm_div_ps(one, select_sse2(gray, one, chroma));
+		__m128 l = _mm_mul_ps(_mm_add_ps(max, min), _mm_set1_ps(.5f));
+		const __m128 spread = _mm_sub_ps(one, _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(_mm_add_ps(l, l), one)));
+		__m128 s = _mm_andnot_ps(gray, _mm_div_ps(chroma, _mm_max_ps(spread, _mm_set1_ps(1e-6f))));
+
+		__m128 h = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(r, g), inv_chroma), _mm_set1_ps(4));
+		h = select_sse2(_mm_cmpeq_ps(max, g), _mm_add_ps(_mm_mul_ps(_mm_sub_ps(b, r), inv_chroma), _mm_set1_ps(2)), h);
+		h = select_sse2(_mm_cmpeq_ps(max, r), _mm_mul_ps(_mm_sub_ps(g, b), inv_chroma), h);
+		h = _mm_add_ps(_mm_andnot_ps(gray, h), hue);
+
+		s = _mm_min_ps(one, _mm_max_ps(_mm_setzero_ps(), _mm_mul_ps(s, saturation)));
+		l = shift.lightness > 0 ? _mm_add_ps(l, _mm_mul_ps(_mm_sub_ps(one, l), _mm_set1_ps(shift.lightness)))
+			: _mm_mul_ps(l, _mm_set1_ps(1 + shift.lightness));
+
+		const __m128 h2 = _mm_add_ps(h, h);
+		const __m128 amount = _mm_mul_ps(s, _mm_min_ps(l, _mm_sub_ps(one, l)));
+		const __m128 scale = _mm_set1_ps(255);
+		r = _mm_mul_ps(hsl_channel_sse2(0, h2, amount, l), scale);
+		g = _mm_mul_ps(hsl_channel_sse2(8, h2, amount, l), scale);
+		b = _mm_mul_ps(hsl_channel_sse2(4, h2, amount, l), scale);
+
+		_MM_TRANSPOSE4_PS(r, g, b, a);
+		const __m128i out_lo = _mm_packs_epi32(_mm_cvtps_epi32(r), _mm_cvtps_epi32(g));
+		const __m128i out_hi = _mm_packs_epi32(_mm_cvtps_epi32(b), _mm_cvtps_epi32(a));
+		_mm_storeu_si128((__m128i*)p, _mm_packus_epi16(out_lo, out_hi));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		hsl_pixel(pixels + i * 4, shift);
+	}
+}
@@ -0,0 +1,352 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "imgui/imgui.h"
+#include "document.h"
+#include "layer.h"
+
+// a layer as it was when the autosave was taken. only the tiles that changed since the one before are
+// copied, the rest are already in the autosave file
+struct snapshot_layer
+{
+	int id = 0;
+	std::vector<uint8_t> settings;
+	bool has_pixels = false, has_mask = false;
+	int pixel_size = 4;
+	// by tile, its pixels and then the mask's. empty for the ones that weren't copied
+	std::vector<std::vector<uint8_t>> tiles;
+};
+
+struct document_snapshot
+{
+	int width = 0, height = 0, cur_layer = 0;
+	uint64_t journal = 0;
+	std::vector<snapshot_layer> layers;
+};
+
+// copies a tile's pixels out of a layer sized width * height, its rows one after another
+inline void copy_tile(uint8_t* tile, const uint8_t* pixels, const int width, const int height, const int tx, const int ty, const int size)
+{
+	const int x0 = tx * document_tile, y0 = ty * document_tile;
+	const int w = std::min(document_tile, width - x0), h = std::min(document_tile, height - y0);
+	for (int y = 0; y < h; y++)
+	{
+		memcpy(tile + (size_t)y * w * size, pixels + ((size_t)(y0 + y) * width + x0) * size, (size_t)w * size);
+	}
+}
+
+inline size_t tile_bytes(const int width, const int height, const int tile, const int size)
+{
+	const int tiles_x = (width + document_tile - 1) / document_tile;
+	return (size_t)std::min(document_tile, width - tile % tiles_x * document_tile)
+		* std::min(document_tile, height - tile / tiles_x * document_tile) * size;
+}
+
+// what the autosave (.autosave) and stroke journal (.journal) of a document are named after
+inline std::string autosave_base(const std::string& document_path)
+{
+	return document_path.empty() ? std::string("untitled.rkgk") : document_path;
+}
+
+// keeps a copy of the document in a file next to it (or untitled.rkgk.autosave) every few minutes without ever
+// holding up a stroke. the snapshot is taken between strokes and only copies the tiles that changed since the
+// last one, a thread then encodes them and adds them to the autosave file the way saving adds to a document,
+// at a limited rate so painting keeps the disk (and the cores) to itself. the file is a document like any
+// other and opens as one
+struct autosaver
+{
+	bool enabled = true;
+	int interval = 120; // seconds between them
+	int rate = 16 << 20; // bytes per second written at most
+
+	autosaver() = default;
+	autosaver(const autosaver&) = delete;
+	autosaver& operator=(const autosaver&) = delete;
+	~autosaver()
+	{
+		// finishes what it was writing without the rate limit, quitting shouldn't lose it
+		unlimited_ = true;
+		if (writer_.joinable()) writer_.join();
+	}
+
+	// takes the snapshot and starts writing it if it's time. idle says whether nothing's halfway done with
+	// the pixels, like a stroke, journal is the last stroke journal record they have in them. true if the
+	// journal can start over from here, the snapshot was taken and the autosave on the disk is no older than
+	// the last one
+	bool update(ImVector<layer>& layers, const int cur_layer, const int width, const int height, const std::string& document_path,
+		const uint64_t journal, const bool idle)
+	{
+		if (writer_.joinable() && written_) writer_.join();
+		const std::string path = autosave_base(document_path) + ".autosave";
+		if (!copying_.empty() && (path != next_path_ || width != next_width_ || height != next_height_))
+		{
+			// saved somewhere else halfway through, the tiles copied so far already lost their bits so the
+			// next one starts over
+			copying_.clear();
+			appendable_ = false;
+		}
+		if (copying_.empty())
+		{
+			const double now = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+			if (last_ == 0) last_ = now;
+			if (!enabled || !idle || writer_.joinable() || now - last_ < (soon_ ? std::min(interval, 2) : interval)) return false;
+			last_ = now;
+			soon_ = false;
+			next_path_ = path;
+			next_width_ = width;
+			next_height_ = height;
+			// when the old file is no good to build on everything goes into a new one
+			fresh_ = path != path_ || width != width_ || height != height_ || !appendable_ || file_size(path) != size_;
+			if (fresh_) refs_.clear();
+		}
+		// a big document takes a while to copy, it's done a bit at a time between strokes so the ui never
+		// waits on it. tiles painted after they were copied get their bit back and are copied again, so once
+		// none are left the copy is all of the layers as they are now
+		if (!idle || !copy(layers, width, height)) return false;
+
+		// when the last one didn't make it the journal has to keep reaching back to the one before
+		const bool rotate = path != path_ || appendable_;
+		path_ = path;
+		width_ = width;
+		height_ = height;
+
+		auto snapshot = std::make_shared<document_snapshot>();
+		snapshot->width = width;
+		snapshot->height = height;
+		snapshot->cur_layer = cur_layer;
+		snapshot->journal = journal;
+		std::unordered_map<int, std::vector<tile_ref>> kept;
+		for (const layer& l : layers)
+		{
+			snapshot->layers.emplace_back();
+			snapshot_layer& s = snapshot->layers.back();
+			if (stores_pixels(l))
+			{
+				s = std::move(copying_[l.id]);
+				const auto found = refs_.find(l.id);
+				if (found != refs_.end()) kept[l.id].swap(found->second);
+			}
+			s.id = l.id;
+			index_writer settings;
+			write_layer_settings(settings, l);
+			s.settings.swap(settings.bytes);
+		}
+		copying_.clear();
+		// and the layers that are gone are forgotten
+		refs_.swap(kept);
+
+		written_ = false;
+		const bool fresh = fresh_;
+		writer_ = std::thread([this, snapshot, fresh]
+		{
+			appendable_ = write(*snapshot, fresh);
+			written_ = true;
+		});
+		return rotate;
+	}
+
+	// something happened that the journal can't paint again, the next autosave comes in a couple of seconds
+	void soon()
+	{
+		soon_ = true;
+	}
+
+	// the layers were replaced, the next autosave writes all of them
+	void restart()
+	{
+		unlimited_ = true;
+		if (writer_.joinable()) writer_.join();
+		unlimited_ = false;
+		refs_.clear();
+		copying_.clear();
+		appendable_ = false;
+	}
+
+private:
+	std::thread writer_;
+	std::atomic<bool> written_ { false }, unlimited_ { false };
+	double last_ = 0;
+	bool soon_ = false;
+	// the snapshot being copied, by layer id, and where it goes
+	std::unordered_map<int, snapshot_layer> copying_;
+	std::string next_path_;
+	int next_width_ = 0, next_height_ = 0;
+	bool fresh_ = false;
+	// everything from here on belongs to the writer while it's running
+	std::string path_;
+	int width_ = 0, height_ = 0;
+	uint64_t size_ = 0;
+	bool appendable_ = false;
+	// where each layer's pixel tiles and then mask tiles are in the file, by id
+	std::unordered_map<int, std::vector<tile_ref>> refs_;
+	// for the rate limit
+	std::chrono::steady_clock::time_point started_;
+	uint64_t written_bytes_ = 0;
+
+	// copies the tiles that changed since the last autosave, a few megabytes of them at most. true once
+	// there are none left
+	bool copy(ImVector<layer>& layers, const int width, const int height)
+	{
+		const int count = tile_count(width, height);
+		const int tiles_x = (width + document_tile - 1) / document_tile;
+		size_t budget = 4 << 20;
+		bool done = true;
+		for (layer& l : layers)
+		{
+			if (!stores_pixels(l)) continue;
+			const auto found = copying_.find(l.id);
+			if (found == copying_.end() || l.unsaved == nullptr || found->second.pixel_size != l.pixel_size()
+				|| found->second.has_mask != (l.mask != nullptr))
+			{
+				// a layer that's new to this snapshot, or that changed format halfway through it
+				const bool all = found != copying_.end() || refs_.find(l.id) == refs_.end() || l.unsaved == nullptr;
+				snapshot_layer& s = copying_[l.id];
+				s = snapshot_layer();
+				s.has_pixels = true;
+				s.has_mask = l.mask != nullptr;
+				s.pixel_size = l.pixel_size();
+				s.tiles.resize(count);
+				if (l.unsaved == nullptr)
+				{
+					l.unsaved = new unsigned char[count];
+					memset(l.unsaved, 0, count);
+				}
+				if (all)
+				{
+					for (int i = 0; i < count; i++) l.unsaved[i] |= unsaved_autosave;
+				}
+			}
+			snapshot_layer& s = copying_[l.id];
+			for (int i = 0; i < count; i++)
+			{
+				if (!(l.unsaved[i] & unsaved_autosave)) continue;
+				const size_t pixels = tile_bytes(width, height, i, s.pixel_size), mask = s.has_mask ? tile_bytes(width, height, i, 1) : 0;
+				if (pixels + mask > budget)
+				{
+					done = false;
+					break;
+				}
+				budget -= pixels + mask;
+				std::vector<uint8_t>& tile = s.tiles[i];
+				tile.resize(pixels + mask);
+				copy_tile(tile.data(), l.pixels, width, height, i % tiles_x, i / tiles_x, s.pixel_size);
+				if (s.has_mask) copy_tile(tile.data() + pixels, l.mask, width, height, i % tiles_x, i / tiles_x, 1);
+				l.unsaved[i] &= ~unsaved_autosave;
+			}
+			if (!done) break;
+		}
+		return done;
+	}
+
+	bool throttled_write(FILE* file, const void* data, const size_t size)
+	{
+		if (fwrite(data, 1, size, file) != size) return false;
+		written_bytes_ += size;
+		if (unlimited_) return true;
+		const auto due = started_ + std::chrono::microseconds(written_bytes_ * 1000000 / std::max(1, rate));
+		if (due > std::chrono::steady_clock::now()) std::this_thread::sleep_until(due);
+		return true;
+	}
+
+	// like document_file::save, a fresh file goes somewhere else first and replaces the old one once it's all there
+	bool write(const document_snapshot& snapshot, const bool fresh)
+	{
+		started_ = std::chrono::steady_clock::now();
+		written_bytes_ = 0;
+		const std::string target = fresh ? path_ + ".tmp" : path_;
+		FILE* file = fopen(target.c_str(), fresh ? "wb" : "r+b");
+		if (file == nullptr) return false;
+		document_header header;
+		uint64_t offset = fresh ? sizeof(header) : size_;
+		bool ok = fresh ? fwrite(&header, sizeof(header), 1, file) == 1 : fseek(file, 0, SEEK_END) == 0;
+
+		index_writer index;
+		index.put((int32_t)snapshot.width);
+		index.put((int32_t)snapshot.height);
+		index.put((int32_t)document_tile);
+		index.put((int32_t)snapshot.layers.size());
+		index.put((int32_t)snapshot.cur_layer);
+		index.put(snapshot.journal);
+		const int count = tile_count(snapshot.width, snapshot.height);
+		const int tiles_x = (snapshot.width + document_tile - 1) / document_tile;
+		std::vector<uint8_t> blob;
+		for (const snapshot_layer& s : snapshot.layers)
+		{
+			index.bytes.insert(index.bytes.end(), s.settings.begin(), s.settings.end());
+			if (!s.has_pixels || !ok) continue;
+			std::vector<tile_ref>& refs = refs_[s.id];
+			refs.resize((size_t)count * (s.has_mask ? 2 : 1));
+			for (int part = 0; part < (s.has_mask ? 2 : 1) && ok; part++)
+			{
+				const int size = part == 0 ? s.pixel_size : 1;
+				for (int tile = 0; tile < count; tile++)
+				{
+					if (s.tiles[tile].empty()) continue;
+					const int tx = tile % tiles_x, ty = tile / tiles_x;
+					const int w = std::min(document_tile, snapshot.width - tx * document_tile), h = std::min(document_tile, snapshot.height - ty * document_tile);
+					tile_ref& ref = refs[(size_t)part * count + tile];
+					encode_tile(s.tiles[tile].data() + (part == 0 ? 0 : (size_t)w * h * s.pixel_size), w, h, 0, 0, size, blob, ref);
+					if (ref.size == 0) continue;
+					ok = throttled_write(file, blob.data(), blob.size());
+					if (!ok) break;
+					ref.offset = offset;
+					offset += blob.size();
+				}
+			}
+			index.bytes.insert(index.bytes.end(), (const uint8_t*)refs.data(), (const uint8_t*)(refs.data() + refs.size()));
+		}
+		header.index_offset = offset;
+		header.index_size = index.bytes.size();
+		ok = ok && fwrite(index.bytes.data(), 1, index.bytes.size(), file) == index.bytes.size() && flush_file(file);
+		ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 && flush_file(file);
+		ok = fclose(file) == 0 && ok;
+		if (ok && fresh) ok = replace_file(target, path_);
+		if (!ok)
+		{
+			if (fresh) remove(target.c_str());
+			return false;
+		}
+		size_ = offset + index.bytes.size();
+		compact(header.index_size);
+		return true;
+	}
+
+	// same as documents, once it's half dead space what's still used goes to a new file
+	void compact(const uint64_t index_size)
+	{
+		uint64_t used = sizeof(document_header) + index_size;
+		for (const auto& layer_refs : refs_)
+		{
+			for (const tile_ref& ref : layer_refs.second) used += ref.size;
+		}
+		if (size_ < ((uint64_t)64 << 20) || size_ < used * 2) return;
+		std::vector<std::pair<uint64_t, uint64_t>> moved;
+		uint64_t size;
+		const std::string temp = path_ + ".compact";
+		if (!compact_document(path_, temp, moved, size) || !replace_file(temp, path_))
+		{
+			remove(temp.c_str());
+			return;
+		}
+		std::sort(moved.begin(), moved.end());
+		for (auto& layer_refs : refs_)
+		{
+			for (tile_ref& ref : layer_refs.second)
+			{
+				if (ref.size == 0) continue;
+				const auto to = std::lower_bound(moved.begin(), moved.end(), std::make_pair(ref.offset, (uint64_t)0));
+				if (to != moved.end() && to->first == ref.offset) ref.offset = to->second;
+			}
+		}
+		size_ = size;
+	}
+};
@@ -0,0 +1,84 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "brush.h"
+#include "engine.h"
+
+struct dab_benchmark_row
+{
+	std::string config;
+	double generic_ms = 0, kernel_ms = 0, linear_ms = 0;
+};
+
+// times the plain dab() against the specialized kernel for every brush feature combination, and the
+// kernel blending in linear light against the plain srgb one
+inline std::vector<dab_benchmark_row> run_dab_benchmark()
+{
+	constexpr int width = 1024, height = 1024;
+	std::vector<uint8_t> pixels((size_t)width * height * 4, 255);
+	const color paint(40, 80, 160, 255);
+
+	struct size_case
+	{
+		float size;
+		int dabs;
+	};
+	// keep the pixel count per case in the same ballpark
+	const size_case sizes[] = { { 1.5f, 200000 }, { 24, 20000 }, { 256, 400 } };
+
+	std::vector<dab_benchmark_row> rows;
+	for (const auto& size_case : sizes)
+	{
+		for (int features = 0; features < 8; features++)
+		{
+			brush b("benchmark");
+			b.size = size_case.size;
+			b.min_size = size_case.size / 4;
+			b.size_pressure = features & 1;
+			b.opacity_pressure = features & 2;
+			b.min_opacity = 64;
+			b.mode = features & 4 ? blend_mode::erase : blend_mode::normal;
+			const dab_context ctx = make_dab_context(b, paint);
+			const dab_context linear_ctx = make_dab_context(b, paint, nullptr, pixel_format::rgba8, true);
+
+			// the plain dab() without a context
+			const auto run = [&](const dab_context* kernel)
+			{
+				const auto start = std::chrono::high_resolution_clock::now();
+				for (int i = 0; i < size_case.dabs; i++)
+				{
+					// wander around the canvas so we're not just hitting the cache
+					const float x = (float)(i * 37 % width) + .3f;
+					const float y = (float)(i * 91 % height) + .7f;
+					const float pressure = .2f + .8f * (i % 64) / 63.0f;
+					if (kernel)
+					{
+						kernel->dab(x, y, pressure, width, height, pixels.data());
+					}
+					else
+					{
+						dab(x, y, pressure, b, paint, width, height, pixels.data());
+					}
+				}
+				return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+			};
+
+			dab_benchmark_row row;
+			char config[64];
+			snprintf(config, sizeof config, "%gpx%s%s%s", size_case.size,
+				b.size_pressure ? " size-p" : "", b.opacity_pressure ? " opacity-p" : "",
+				b.mode == blend_mode::erase ? " erase" : "");
+			row.config = config;
+			// best of a few runs, single runs are at the mercy of whatever else the machine is doing
+			row.generic_ms = std::min(run(nullptr), std::min(run(nullptr), run(nullptr)));
+			row.kernel_ms = std::min(run(&ctx), std::min(run(&ctx), run(&ctx)));
+			row.linear_ms = std::min(run(&linear_ctx), std::min(run(&linear_ctx), run(&linear_ctx)));
+			rows.push_back(row);
+		}
+	}
+	return rows;
+}
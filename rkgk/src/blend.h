@@ -0,0 +1,859 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "brush.h"
+#include "color.h"
+#include "srgb.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define RKGK_SSE2
+#include <emmintrin.h>
+#endif
+
+// what a layer's pixels are made of
+enum class pixel_format
+{
+	rgba8,
+	alpha8, // coverage only, colored when composited
+	rgba16 // 0 to 65535 per channel, 8-bit v is v * 257
+};
+
+inline int pixel_size(const pixel_format format)
+{
+	return format == pixel_format::alpha8 ? 1 : format == pixel_format::rgba16 ? 8 : 4;
+}
+
+inline void alpha_blend(uint8_t* dst, const uint8_t* src, const uint8_t alpha)
+{
+	uint8_t inv_alpha = 255 - alpha;
+	dst[0] = (src[0] * alpha + dst[0] * inv_alpha) / 255;
+	dst[1] = (src[1] * alpha + dst[1] * inv_alpha) / 255;
+	dst[2] = (src[2] * alpha + dst[2] * inv_alpha) / 255;
+	dst[3] = (src[3] * alpha + dst[3] * inv_alpha) / 255;
+}
+
+inline void erase_blend(uint8_t* dst, const uint8_t alpha)
+{
+	dst[3] = dst[3] * (255 - alpha) / 255;
+}
+
+// a dab's alpha limited by a selection (or any other) mask
+inline uint8_t mask_alpha(const uint8_t alpha, const uint8_t mask)
+{
+	return (uint8_t)((alpha * mask + 127) / 255);
+}
+
+#ifdef RKGK_SSE2
+// v / 255 == (v + 1 + (v >> 8)) >> 8 for every v a blend can produce
+inline __m128i div255_epu16(const __m128i v)
+{
+	return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(v, _mm_set1_epi16(1)), _mm_srli_epi16(v, 8)), 8);
+}
+
+// 4 per pixel weights, each repeated for the 4 channels of its pixel, as 16 bit lanes for pixels 0-1 and 2-3
+inline void expand_weights_sse2(const uint8_t* weights, __m128i& lo, __m128i& hi)
+{
+	int packed;
+	memcpy(&packed, weights, 4);
+	__m128i w = _mm_cvtsi32_si128(packed);
+	w = _mm_unpacklo_epi8(w, w);
+	w = _mm_unpacklo_epi16(w, w);
+	lo = _mm_unpacklo_epi8(w, _mm_setzero_si128());
+	hi = _mm_unpackhi_epi8(w, _mm_setzero_si128());
+}
+
+// dst = (dst * mul + add) / 255 per channel, 4 pixels at a time, the division is exact
+inline int muladd_span_sse2(uint8_t* dst, const int count, const __m128i mul, const __m128i add)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+		const __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), mul), add);
+		const __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), mul), add);
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(div255_epu16(lo), div255_epu16(hi)));
+	}
+	return i;
+}
+#endif
+
+// blends one color with a constant alpha over a run of pixels, same results as alpha_blend
+inline void blend_span(uint8_t* dst, const int count, const color new_color, const uint8_t alpha)
+{
+	int i = 0;
+	if (alpha == 255)
+	{
+		const uint32_t packed = new_color.r | new_color.g << 8 | new_color.b << 16 | 0xffu << 24;
+#ifdef RKGK_SSE2
+		const __m128i fill = _mm_set1_epi32((int)packed);
+		for (; i + 4 <= count; i += 4)
+		{
+			_mm_storeu_si128((__m128i*)(dst + i * 4), fill);
+		}
+#endif
+		for (; i < count; i++)
+		{
+			memcpy(dst + i * 4, &packed, 4);
+		}
+		return;
+	}
+
+	const uint8_t src[4] = { new_color.r, new_color.g, new_color.b, 255 };
+#ifdef RKGK_SSE2
+	const short r = src[0] * alpha, g = src[1] * alpha, b = src[2] * alpha, a = src[3] * alpha;
+	i = muladd_span_sse2(dst, count, _mm_set1_epi16(255 - alpha), _mm_setr_epi16(r, g, b, a, r, g, b, a));
+#endif
+	for (; i < count; i++)
+	{
+		alpha_blend(dst + i * 4, src, alpha);
+	}
+}
+
+// same results as erase_blend
+inline void erase_span(uint8_t* dst, const int count, const uint8_t alpha)
+{
+	int i = 0;
+	if (alpha == 255)
+	{
+		for (; i < count; i++)
+		{
+			dst[i * 4 + 3] = 0;
+		}
+		return;
+	}
+
+#ifdef RKGK_SSE2
+	const short inv = 255 - alpha;
+	i = muladd_span_sse2(dst, count, _mm_setr_epi16(255, 255, 255, inv, 255, 255, 255, inv), _mm_setzero_si128());
+#endif
+	for (; i < count; i++)
+	{
+		erase_blend(dst + i * 4, alpha);
+	}
+}
+
+// blend_span with the alpha limited per pixel by a mask, same results as alpha_blend with mask_alpha
+inline void blend_span_masked(uint8_t* dst, const int count, const color new_color, const uint8_t alpha, const uint8_t* mask)
+{
+	const uint8_t src[4] = { new_color.r, new_color.g, new_color.b, 255 };
+	int i = 0;
+#ifdef RKGK_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi16(255);
+	const __m128i a = _mm_set1_epi16(alpha), round = _mm_set1_epi16(127);
+	const __m128i s = _mm_setr_epi16(src[0], src[1], src[2], src[3], src[0], src[1], src[2], src[3]);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i w_lo, w_hi;
+		expand_weights_sse2(mask + i, w_lo, w_hi);
+		w_lo = div255_epu16(_mm_add_epi16(_mm_mullo_epi16(w_lo, a), round));
+		w_hi = div255_epu16(_mm_add_epi16(_mm_mullo_epi16(w_hi, a), round));
+		const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+		const __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, w_lo)), _mm_mullo_epi16(s, w_lo));
+		const __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, w_hi)), _mm_mullo_epi16(s, w_hi));
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(div255_epu16(lo), div255_epu16(hi)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		alpha_blend(dst + i * 4, src, mask_alpha(alpha, mask[i]));
+	}
+}
+
+inline void erase_span_masked(uint8_t* dst, const int count, const uint8_t alpha, const uint8_t* mask)
+{
+	int i = 0;
+#ifdef RKGK_SSE2
+	const __m128i full = _mm_set1_epi16(255);
+	const __m128i a = _mm_set1_epi16(alpha), round = _mm_set1_epi16(127);
+	// only the alpha channel gets anything taken away
+	const __m128i alpha_lanes = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i w_lo, w_hi;
+		expand_weights_sse2(mask + i, w_lo, w_hi);
+		w_lo = _mm_and_si128(div255_epu16(_mm_add_epi16(_mm_mullo_epi16(w_lo, a), round)), alpha_lanes);
+		w_hi = _mm_and_si128(div255_epu16(_mm_add_epi16(_mm_mullo_epi16(w_hi, a), round)), alpha_lanes);
+		const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+		const __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, w_lo));
+		const __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, w_hi));
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(div255_epu16(lo), div255_epu16(hi)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		erase_blend(dst + i * 4, mask_alpha(alpha, mask[i]));
+	}
+}
+
+// dst = lerp(dst, src, weight / 255) with a weight per pixel, same results as alpha_blend
+inline void lerp_span(uint8_t* dst, const uint8_t* src, const uint8_t* weights, const int count)
+{
+	int i = 0;
+#ifdef RKGK_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi16(255);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i w_lo, w_hi;
+		expand_weights_sse2(weights + i, w_lo, w_hi);
+		const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+		const __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+		const __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, w_lo)),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), w_lo));
+		const __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, w_hi)),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), w_hi));
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(div255_epu16(lo), div255_epu16(hi)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		alpha_blend(dst + i * 4, src + i * 4, weights[i]);
+	}
+}
+
+// adds up every channel of a run of pixels times its weight, and the weights themselves
+inline void weighted_sum_span(const uint8_t* src, const uint8_t* weights, const int count, uint64_t sum[4], uint64_t& weight_sum)
+{
+	int i = 0;
+#ifdef RKGK_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	// two pixels per accumulator, a single row can't overflow 32 bits
+	__m128i acc0 = zero, acc1 = zero;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i w_lo, w_hi;
+		expand_weights_sse2(weights + i, w_lo, w_hi);
+		const __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+		const __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), w_lo);
+		const __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), w_hi);
+		acc0 = _mm_add_epi32(acc0, _mm_add_epi32(_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero)));
+		acc1 = _mm_add_epi32(acc1, _mm_add_epi32(_mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)));
+		weight_sum += weights[i] + weights[i + 1] + weights[i + 2] + weights[i + 3];
+	}
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i*)lanes, _mm_add_epi32(acc0, acc1));
+	for (int c = 0; c < 4; c++)
+	{
+		sum[c] += lanes[c];
+	}
+#endif
+	for (; i < count; i++)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			sum[c] += src[i * 4 + c] * weights[i];
+		}
+		weight_sum += weights[i];
+	}
+}
+
+// straight alpha "over" of a run of pixels, the source faded by opacity and, if there are any, by a
+// weight per pixel. opaque sources and empty destinations (most of a painting) skip the division
+inline void over_span(uint8_t* dst, const uint8_t* src, const int count, const uint8_t opacity, const uint8_t* weights = nullptr,
+	const bool linear = false)
+{
+	const srgb_tables& t = srgb();
+	for (int i = 0; i < count; i++, dst += 4, src += 4)
+	{
+		int src_a = src[3] * opacity / 255;
+		if (weights) src_a = mask_alpha((uint8_t)src_a, weights[i]);
+		if (src_a == 0) continue;
+		if (src_a == 255 || dst[3] == 0)
+		{
+			memcpy(dst, src, 3);
+			dst[3] = (uint8_t)src_a;
+			continue;
+		}
+		const int dst_a = dst[3] * (255 - src_a) / 255;
+		const int out_a = src_a + dst_a;
+		if (linear)
+		{
+			// the source's share of the mix in 16.16, one division instead of one per channel
+			const uint32_t share = ((uint32_t)src_a << 16) / out_a;
+			for (int c = 0; c < 3; c++)
+			{
+				dst[c] = t.from_linear[(t.to_linear[src[c]] * share + t.to_linear[dst[c]] * (65536 - share)) >> 20];
+			}
+		}
+		else
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				dst[c] = (uint8_t)((src[c] * src_a + dst[c] * dst_a) / out_a);
+			}
+		}
+		dst[3] = (uint8_t)out_a;
+	}
+}
+
+// alpha only layers keep one byte of coverage per pixel and get their color when they're composited.
+// painting on them is the alpha channel of alpha_blend and erase_blend on its own
+inline void alpha_over(uint8_t* dst, const uint8_t alpha)
+{
+	*dst = (uint8_t)((255 * alpha + *dst * (255 - alpha)) / 255);
+}
+
+// same results as alpha_over over a run, 16 pixels at a time. muladd_span_sse2 doesn't care that its
+// "pixels" are really four of these
+inline void alpha_over_span(uint8_t* dst, const int count, const uint8_t alpha)
+{
+	int i = 0;
+	if (alpha == 255)
+	{
+		memset(dst, 255, count);
+		return;
+	}
+#ifdef RKGK_SSE2
+	i = muladd_span_sse2(dst, count / 4, _mm_set1_epi16(255 - alpha), _mm_set1_epi16((short)(255 * alpha))) * 4;
+#endif
+	for (; i < count; i++)
+	{
+		alpha_over(dst + i, alpha);
+	}
+}
+
+inline void alpha_erase_span(uint8_t* dst, const int count, const uint8_t alpha)
+{
+	int i = 0;
+	if (alpha == 255)
+	{
+		memset(dst, 0, count);
+		return;
+	}
+#ifdef RKGK_SSE2
+	i = muladd_span_sse2(dst, count / 4, _mm_set1_epi16(255 - alpha), _mm_setzero_si128()) * 4;
+#endif
+	for (; i < count; i++)
+	{
+		dst[i] = (uint8_t)(dst[i] * (255 - alpha) / 255);
+	}
+}
+
+#ifdef RKGK_SSE2
+// 16 alphas limited by a mask like mask_alpha, as 16 bit lanes for pixels 0-7 and 8-15
+inline void masked_alphas_sse2(const uint8_t* mask, const __m128i alpha, __m128i& lo, __m128i& hi)
+{
+	const __m128i m = _mm_loadu_si128((const __m128i*)mask), round = _mm_set1_epi16(127);
+	lo = div255_epu16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(m, _mm_setzero_si128()), alpha), round));
+	hi = div255_epu16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(m, _mm_setzero_si128()), alpha), round));
+}
+#endif
+
+// alpha_over_span with the alpha limited per pixel by a mask, same results as alpha_over with mask_alpha
+inline void alpha_over_span_masked(uint8_t* dst, const int count, const uint8_t alpha, const uint8_t* mask)
+{
+	int i = 0;
+#ifdef RKGK_SSE2
+	const __m128i zero = _mm_setzero_si128(), full = _mm_set1_epi16(255), a = _mm_set1_epi16(alpha);
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i w_lo, w_hi;
+		masked_alphas_sse2(mask + i, a, w_lo, w_hi);
+		const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		const __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, w_lo)), _mm_mullo_epi16(full, w_lo));
+		const __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, w_hi)), _mm_mullo_epi16(full, w_hi));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(div255_epu16(lo), div255_epu16(hi)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		alpha_over(dst + i, mask_alpha(alpha, mask[i]));
+	}
+}
+
+inline void alpha_erase_span_masked(uint8_t* dst, const int count, const uint8_t alpha, const uint8_t* mask)
+{
+	int i = 0;
+#ifdef RKGK_SSE2
+	const __m128i zero = _mm_setzero_si128(), full = _mm_set1_epi16(255), a = _mm_set1_epi16(alpha);
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i w_lo, w_hi;
+		masked_alphas_sse2(mask + i, a, w_lo, w_hi);
+		const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		const __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, w_lo));
+		const __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, w_hi));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(div255_epu16(lo), div255_epu16(hi)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		const uint8_t w = mask_alpha(alpha, mask[i]);
+		dst[i] = (uint8_t)(dst[i] * (255 - w) / 255);
+	}
+}
+
+// lerp_span for alpha only pixels
+inline void alpha_lerp_span(uint8_t* dst, const uint8_t* src, const uint8_t* weights, const int count)
+{
+	int i = 0;
+#ifdef RKGK_SSE2
+	const __m128i zero = _mm_setzero_si128(), full = _mm_set1_epi16(255);
+	for (; i + 16 <= count; i += 16)
+	{
+		const __m128i w = _mm_loadu_si128((const __m128i*)(weights + i));
+		const __m128i w_lo = _mm_unpacklo_epi8(w, zero), w_hi = _mm_unpackhi_epi8(w, zero);
+		const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+		const __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, w_lo)), _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), w_lo));
+		const __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, w_hi)), _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), w_hi));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(div255_epu16(lo), div255_epu16(hi)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		dst[i] = (uint8_t)((src[i] * weights[i] + dst[i] * (255 - weights[i])) / 255);
+	}
+}
+
+// straight alpha "over" of one color with an alpha per pixel, for compositing alpha only layers. the
+// alphas are faded by opacity and, if there are any, by a weight per pixel like over_span
+inline void over_tint_span(uint8_t* dst, const uint8_t* alphas, const color tint, const int count, const uint8_t opacity, const uint8_t* weights = nullptr,
+	const bool linear = false)
+{
+	const srgb_tables& t = srgb();
+	const uint8_t src[3] = { tint.r, tint.g, tint.b };
+	const uint32_t src_linear[3] = { t.to_linear[tint.r], t.to_linear[tint.g], t.to_linear[tint.b] };
+	for (int i = 0; i < count; i++, dst += 4)
+	{
+		int src_a = alphas[i] * opacity / 255;
+		if (weights) src_a = mask_alpha((uint8_t)src_a, weights[i]);
+		if (src_a == 0) continue;
+		if (src_a == 255 || dst[3] == 0)
+		{
+			memcpy(dst, src, 3);
+			dst[3] = (uint8_t)src_a;
+			continue;
+		}
+		const int dst_a = dst[3] * (255 - src_a) / 255;
+		const int out_a = src_a + dst_a;
+		if (linear)
+		{
+			const uint32_t share = ((uint32_t)src_a << 16) / out_a;
+			for (int c = 0; c < 3; c++)
+			{
+				dst[c] = t.from_linear[(src_linear[c] * share + t.to_linear[dst[c]] * (65536 - share)) >> 20];
+			}
+		}
+		else
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				dst[c] = (uint8_t)((src[c] * src_a + dst[c] * dst_a) / out_a);
+			}
+		}
+		dst[3] = (uint8_t)out_a;
+	}
+}
+
+// 16-bit layers blend like alpha_blend, dst * (255 - alpha) / 255 + src * alpha / 255, with the first
+// half as a 16.16 fixed point multiply so sse2 can do it with mulhi. the steps are fine enough that
+// glazing with a low alpha keeps creeping towards the color instead of getting stuck a few levels off
+inline uint32_t deep_keep(const uint8_t alpha)
+{
+	return ((255 - alpha) * 65536u + 127) / 255;
+}
+
+inline void deep_blend(uint16_t* dst, const color c, const uint8_t alpha)
+{
+	const uint32_t keep = deep_keep(alpha);
+	const uint32_t src[4] = { c.r * 257u, c.g * 257u, c.b * 257u, 65535 };
+	for (int i = 0; i < 4; i++)
+	{
+		dst[i] = (uint16_t)std::min(65535u, (dst[i] * keep >> 16) + (src[i] * alpha + 127) / 255);
+	}
+}
+
+inline void deep_erase(uint16_t* dst, const uint8_t alpha)
+{
+	dst[3] = (uint16_t)(dst[3] * deep_keep(alpha) >> 16);
+}
+
+// same results as deep_blend over a run, two pixels at a time
+inline void deep_blend_span(uint16_t* dst, const int count, const color c, const uint8_t alpha)
+{
+	if (alpha == 0) return;
+	int i = 0;
+#ifdef RKGK_SSE2
+	const __m128i keep = _mm_set1_epi16((short)deep_keep(alpha));
+	const auto part = [&](const int v) { return (short)((v * 257u * alpha + 127) / 255); };
+	const __m128i add = _mm_setr_epi16(part(c.r), part(c.g), part(c.b), part(255), part(c.r), part(c.g), part(c.b), part(255));
+	for (; i + 2 <= count; i += 2)
+	{
+		const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_adds_epu16(_mm_mulhi_epu16(d, keep), add));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		deep_blend(dst + i * 4, c, alpha);
+	}
+}
+
+inline void deep_erase_span(uint16_t* dst, const int count, const uint8_t alpha)
+{
+	if (alpha == 0) return;
+	int i = 0;
+#ifdef RKGK_SSE2
+	const __m128i keep = _mm_set1_epi16((short)deep_keep(alpha));
+	const __m128i alpha_lanes = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+	for (; i + 2 <= count; i += 2)
+	{
+		const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+		const __m128i erased = _mm_mulhi_epu16(d, keep);
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_and_si128(alpha_lanes, erased), _mm_andnot_si128(alpha_lanes, d)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		deep_erase(dst + i * 4, alpha);
+	}
+}
+
+// 16-bit pixels down to 8-bit for compositing, x and y say where the run starts on the canvas. with
+// dither the rounding follows a 4x4 bayer pattern instead of always going to the nearest value, which
+// keeps smooth 16-bit gradients from turning into visible bands. 8-bit values widened with * 257 come
+// back exactly either way
+inline void narrow_span(const uint16_t* src, uint8_t* dst, const int count, const int x, const int y, const bool dither)
+{
+	static const uint8_t bayer[4][4] = { { 0, 8, 2, 10 }, { 12, 4, 14, 6 }, { 3, 11, 1, 9 }, { 15, 7, 13, 5 } };
+	uint8_t thresholds[4];
+	for (int i = 0; i < 4; i++)
+	{
+		thresholds[i] = dither ? (uint8_t)(bayer[y & 3][(x + i) & 3] * 16 + 8) : 128;
+	}
+	// v * 255 / 256 lands 8-bit values on multiples of 256, the threshold decides where the rest go
+	const auto narrow = [](const unsigned v, const unsigned t) { return (uint8_t)((v - (v >> 8) + t) >> 8); };
+	int i = 0;
+#ifdef RKGK_SSE2
+	const __m128i t_lo = _mm_setr_epi16(thresholds[0], thresholds[0], thresholds[0], thresholds[0], thresholds[1], thresholds[1], thresholds[1], thresholds[1]);
+	const __m128i t_hi = _mm_setr_epi16(thresholds[2], thresholds[2], thresholds[2], thresholds[2], thresholds[3], thresholds[3], thresholds[3], thresholds[3]);
+	for (; i + 4 <= count; i += 4)
+	{
+		const __m128i lo = _mm_loadu_si128((const __m128i*)(src + i * 4));
+		const __m128i hi = _mm_loadu_si128((const __m128i*)(src + i * 4 + 8));
+		const __m128i n_lo = _mm_srli_epi16(_mm_add_epi16(_mm_sub_epi16(lo, _mm_srli_epi16(lo, 8)), t_lo), 8);
+		const __m128i n_hi = _mm_srli_epi16(_mm_add_epi16(_mm_sub_epi16(hi, _mm_srli_epi16(hi, 8)), t_hi), 8);
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(n_lo, n_hi));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			dst[i * 4 + c] = narrow(src[i * 4 + c], thresholds[i & 3]);
+		}
+	}
+}
+
+// lets the kernels pick their blend at compile time, and the kind of layer it goes onto
+template <blend_mode Mode>
+struct blend_op;
+
+template <blend_mode Mode>
+struct alpha_op;
+
+template <blend_mode Mode>
+struct deep_op;
+
+template <>
+struct deep_op<blend_mode::normal>
+{
+	static constexpr int pixel_size = 8;
+
+	static void pixel(uint8_t* dst, const color c, const uint8_t alpha)
+	{
+		deep_blend((uint16_t*)dst, c, alpha);
+	}
+
+	static void span(uint8_t* dst, const int count, const color c, const uint8_t alpha)
+	{
+		deep_blend_span((uint16_t*)dst, count, c, alpha);
+	}
+
+	static void span_masked(uint8_t* dst, const int count, const color c, const uint8_t alpha, const uint8_t* mask)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			deep_blend((uint16_t*)dst + i * 4, c, mask_alpha(alpha, mask[i]));
+		}
+	}
+};
+
+template <>
+struct deep_op<blend_mode::erase>
+{
+	static constexpr int pixel_size = 8;
+
+	static void pixel(uint8_t* dst, const color, const uint8_t alpha)
+	{
+		deep_erase((uint16_t*)dst, alpha);
+	}
+
+	static void span(uint8_t* dst, const int count, const color, const uint8_t alpha)
+	{
+		deep_erase_span((uint16_t*)dst, count, alpha);
+	}
+
+	static void span_masked(uint8_t* dst, const int count, const color, const uint8_t alpha, const uint8_t* mask)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			deep_erase((uint16_t*)dst + i * 4, mask_alpha(alpha, mask[i]));
+		}
+	}
+};
+
+template <>
+struct alpha_op<blend_mode::normal>
+{
+	static constexpr int pixel_size = 1;
+
+	static void pixel(uint8_t* dst, const color, const uint8_t alpha)
+	{
+		alpha_over(dst, alpha);
+	}
+
+	static void span(uint8_t* dst, const int count, const color, const uint8_t alpha)
+	{
+		alpha_over_span(dst, count, alpha);
+	}
+
+	static void span_masked(uint8_t* dst, const int count, const color, const uint8_t alpha, const uint8_t* mask)
+	{
+		alpha_over_span_masked(dst, count, alpha, mask);
+	}
+};
+
+template <>
+struct alpha_op<blend_mode::erase>
+{
+	static constexpr int pixel_size = 1;
+
+	static void pixel(uint8_t* dst, const color, const uint8_t alpha)
+	{
+		*dst = (uint8_t)(*dst * (255 - alpha) / 255);
+	}
+
+	static void span(uint8_t* dst, const int count, const color, const uint8_t alpha)
+	{
+		alpha_erase_span(dst, count, alpha);
+	}
+
+	static void span_masked(uint8_t* dst, const int count, const color, const uint8_t alpha, const uint8_t* mask)
+	{
+		alpha_erase_span_masked(dst, count, alpha, mask);
+	}
+};
+
+template <>
+struct blend_op<blend_mode::normal>
+{
+	static constexpr int pixel_size = 4;
+
+	static void pixel(uint8_t* dst, const color c, const uint8_t alpha)
+	{
+		const uint8_t src[4] = { c.r, c.g, c.b, 255 };
+		alpha_blend(dst, src, alpha);
+	}
+
+	static void span(uint8_t* dst, const int count, const color c, const uint8_t alpha)
+	{
+		blend_span(dst, count, c, alpha);
+	}
+
+	static void span_masked(uint8_t* dst, const int count, const color c, const uint8_t alpha, const uint8_t* mask)
+	{
+		blend_span_masked(dst, count, c, alpha, mask);
+	}
+};
+
+template <>
+struct blend_op<blend_mode::erase>
+{
+	static constexpr int pixel_size = 4;
+
+	static void pixel(uint8_t* dst, const color, const uint8_t alpha)
+	{
+		erase_blend(dst, alpha);
+	}
+
+	static void span(uint8_t* dst, const int count, const color, const uint8_t alpha)
+	{
+		erase_span(dst, count, alpha);
+	}
+
+	static void span_masked(uint8_t* dst, const int count, const color, const uint8_t alpha, const uint8_t* mask)
+	{
+		erase_span_masked(dst, count, alpha, mask);
+	}
+};
+
+// alpha_blend in linear light, the brush color and what's under it mixed as amounts of light and then
+// encoded back. soft edges and strokes of different colors crossing don't go dark and muddy where they
+// mix. alpha mixes the same as ever. x / 255 >> 4 is x / 4080
+inline void linear_blend(uint8_t* dst, const color c, const uint8_t alpha)
+{
+	const srgb_tables& t = srgb();
+	const int inv_alpha = 255 - alpha;
+	dst[0] = t.from_linear[(t.to_linear[c.r] * alpha + t.to_linear[dst[0]] * inv_alpha) / 4080];
+	dst[1] = t.from_linear[(t.to_linear[c.g] * alpha + t.to_linear[dst[1]] * inv_alpha) / 4080];
+	dst[2] = t.from_linear[(t.to_linear[c.b] * alpha + t.to_linear[dst[2]] * inv_alpha) / 4080];
+	dst[3] = (uint8_t)((255 * alpha + dst[3] * inv_alpha) / 255);
+}
+
+// one color blended with one alpha only depends on the byte underneath, per channel, so that's looked
+// up in tables instead of decoding and encoding every pixel. a stroke is one color and gets to a few
+// hundred alphas at most, the table for each is built the first time it comes up
+struct linear_blend_tables
+{
+	uint32_t key = 0;
+	bool built[256] = {};
+	std::vector<uint8_t> tables; // r, g, b and a tables of 256 entries for every alpha
+
+	const uint8_t* get(const color c, const uint8_t alpha)
+	{
+		// the top bit tells a key from the empty one
+		const uint32_t color_key = c.r | c.g << 8 | c.b << 16 | 1u << 24;
+		if (color_key != key)
+		{
+			key = color_key;
+			memset(built, 0, sizeof built);
+			tables.resize(256 * 1024);
+		}
+		uint8_t* table = tables.data() + alpha * 1024;
+		if (!built[alpha])
+		{
+			const srgb_tables& t = srgb();
+			const int inv_alpha = 255 - alpha;
+			const int src[3] = { t.to_linear[c.r] * alpha, t.to_linear[c.g] * alpha, t.to_linear[c.b] * alpha };
+			for (int v = 0; v < 256; v++)
+			{
+				for (int ch = 0; ch < 3; ch++)
+				{
+					table[ch * 256 + v] = t.from_linear[(src[ch] + t.to_linear[v] * inv_alpha) / 4080];
+				}
+				table[768 + v] = (uint8_t)((255 * alpha + v * inv_alpha) / 255);
+			}
+			built[alpha] = true;
+		}
+		return table;
+	}
+};
+
+inline linear_blend_tables& linear_tables()
+{
+	static thread_local linear_blend_tables tables;
+	return tables;
+}
+
+// same results as linear_blend
+inline void linear_blend_table(uint8_t* dst, const uint8_t* table)
+{
+	dst[0] = table[dst[0]];
+	dst[1] = table[256 + dst[1]];
+	dst[2] = table[512 + dst[2]];
+	dst[3] = table[768 + dst[3]];
+}
+
+// same results as linear_blend over a run
+inline void linear_blend_span(uint8_t* dst, const int count, const color c, const uint8_t alpha)
+{
+	if (alpha == 0) return;
+	if (alpha == 255)
+	{
+		blend_span(dst, count, c, alpha);
+		return;
+	}
+	const uint8_t* table = linear_tables().get(c, alpha);
+	int i = 0;
+#ifdef RKGK_SSE2
+	// four lookups a pixel is what makes this slower than blend_span, but paint mostly goes over a flat
+	// fill or over itself. four of the same pixel in a row are looked up once and stored as one
+	__m128i run_in = _mm_setzero_si128(), run_out = _mm_setzero_si128();
+	bool have_run = false;
+	for (; i + 4 <= count; i += 4)
+	{
+		uint8_t* px = dst + i * 4;
+		const __m128i four = _mm_loadu_si128((const __m128i*)px);
+		const __m128i first = _mm_shuffle_epi32(four, 0);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(four, first)) != 0xffff)
+		{
+			for (int k = 0; k < 4; k++)
+			{
+				linear_blend_table(px + k * 4, table);
+			}
+			continue;
+		}
+		if (!have_run || _mm_movemask_epi8(_mm_cmpeq_epi32(first, run_in)) != 0xffff)
+		{
+			// blended in a register, reading it back right after byte stores would stall
+			uint8_t one[4];
+			memcpy(one, px, 4);
+			linear_blend_table(one, table);
+			uint32_t packed;
+			memcpy(&packed, one, 4);
+			run_in = first;
+			run_out = _mm_set1_epi32((int)packed);
+			have_run = true;
+		}
+		_mm_storeu_si128((__m128i*)px, run_out);
+	}
+#endif
+	for (; i < count; i++)
+	{
+		linear_blend_table(dst + i * 4, table);
+	}
+}
+
+// blend_op for painting in linear light. there's only normal, erasing doesn't touch the color
+template <blend_mode Mode>
+struct linear_op;
+
+template <>
+struct linear_op<blend_mode::normal>
+{
+	static constexpr int pixel_size = 4;
+
+	static void pixel(uint8_t* dst, const color c, const uint8_t alpha)
+	{
+		linear_blend_table(dst, linear_tables().get(c, alpha));
+	}
+
+	static void span(uint8_t* dst, const int count, const color c, const uint8_t alpha)
+	{
+		linear_blend_span(dst, count, c, alpha);
+	}
+
+	static void span_masked(uint8_t* dst, const int count, const color c, const uint8_t alpha, const uint8_t* mask)
+	{
+		linear_blend_tables& tables = linear_tables();
+		for (int i = 0; i < count; i++)
+		{
+			linear_blend_table(dst + i * 4, tables.get(c, mask_alpha(alpha, mask[i])));
+		}
+	}
+};
+
+inline void blend_pixel(const blend_mode mode, uint8_t* dst, const color c, const uint8_t alpha)
+{
+	switch (mode)
+	{
+	case blend_mode::normal:
+		blend_op<blend_mode::normal>::pixel(dst, c, alpha);
+		break;
+	case blend_mode::erase:
+		blend_op<blend_mode::erase>::pixel(dst, c, alpha);
+		break;
+	case blend_mode::smudge:
+	case blend_mode::blend:
+		// these need the whole dab at once, see smudge_dab_kernel
+		break;
+	}
+}
@@ -1,7 +1,32 @@
 ﻿#pragma once
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include "mathstuff.h"
 
+enum class blend_mode
+{
+	normal,
+	erase,
+	smudge, // drags the pixels under the dab along
+	blend // picks up the average color under the dab and mixes it in
+};
+
+enum class falloff_curve
+{
+	hard, // just the anti-aliased edge
+	hardness,
+	gaussian,
+	custom
+};
+
+enum class tip_rotation
+{
+	fixed,
+	direction, // follows the stroke
+	pressure // a full turn from no to full pressure
+};
+
 struct brush
 {
 	std::string name;
@@ -9,6 +34,18 @@ struct brush
 	int opacity = 255, min_opacity = 0;
 	bool size_pressure = false, opacity_pressure = false;
 	float spacing = 0.05f, aa = 0.5f;
+	blend_mode mode = blend_mode::normal;
+	falloff_curve falloff = falloff_curve::hard;
+	float hardness = 0.5f;
+	// custom falloff, evenly spaced from the center (first) to the edge (last) of the dab
+	static constexpr int curve_points = 6;
+	float curve[curve_points] = { 1, 1, .85f, .55f, .2f, 0 };
+	// index into brush_tips, -1 for the plain round tip
+	int tip = -1;
+	tip_rotation rotation = tip_rotation::fixed;
+	float angle = 0; // degrees
+	// smudge/blend, how much of the carried paint survives each dab
+	float smudge_length = .5f;
 
 	explicit brush(const std::string& name)
 	{
@@ -24,4 +61,29 @@ struct brush
 	{
 		return opacity_pressure ? (int)lerp(min_opacity, opacity, pressure) : opacity;
 	}
+
+	// coverage at a distance from the center, u = 0 at the center and 1 at the edge
+	float falloff_at(const float u) const
+	{
+		switch (falloff)
+		{
+		case falloff_curve::hard:
+			return 1;
+		case falloff_curve::hardness:
+		{
+			if (u <= hardness) return 1;
+			const float t = (u - hardness) / (1 - hardness);
+			return 1 - t * t * (3 - 2 * t);
+		}
+		case falloff_curve::gaussian:
+		{
+			// sigma of a third of the radius, shifted and scaled so it reaches 0 at the edge
+			const float edge = std::exp(-4.5f);
+			return (std::exp(-4.5f * u * u) - edge) / (1 - edge);
+		}
+		case falloff_curve::custom:
+			return curve_at(curve, curve_points, u);
+		}
+		return 1;
+	}
 };
@@ -1,28 +1,97 @@
 #pragma once
+#include <functional>
 #include <vector>
 
 #include "imgui/imgui.h"
 #include <GL/glew.h>
 
 #include "brush.h"
+#include "autosave.h"
+#include "compositor.h"
+#include "document.h"
+#include "fill.h"
+#include "filter.h"
+#include "icc.h"
+#include "journal.h"
 #include "mathstuff.h"
 #include "layer.h"
+#include "png.h"
+#include "predictor.h"
+#include "selection.h"
+#include "transform.h"
 
 #include "portable-file-dialogs.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
+#undef STB_IMAGE_IMPLEMENTATION // other headers include it for the declarations
 #include <GLFW/glfw3.h>
 
-#include "stb_image_write.h"
 #include "engine.h"
 
+enum class tool
+{
+	brush,
+	fill,
+	select_rect,
+	select_ellipse,
+	lasso,
+	magic_wand,
+	transform
+};
+
 struct canvas
 {
 private:
 	// rendering
 	ImVec2 render_quad_[4];
+	// all the layers composited together, what the canvas texture shows. only dirty tiles get redone
 	GLuint texture_ = 0;
+	std::vector<uint8_t> composite_, composite_dirty_;
+	composite_options options_;
+	// document colors (srgb) to the monitor's, converted on the way to the textures. empty without a
+	// display profile, then the composite goes up as is
+	color_transform display_transform_;
+	std::vector<uint8_t> display_pixels_;
+	// and to what saving writes
+	color_transform export_transform_;
+	// predicted stroke tail, drawn over the canvas and thrown away every frame
+	GLuint overlay_texture_ = 0;
+	std::vector<unsigned char> overlay_pixels_;
+	int overlay_x_ = 0, overlay_y_ = 0, overlay_w_ = 0, overlay_h_ = 0;
+	// unselected parts tinted, at a lower resolution for big canvases
+	GLuint selection_texture_ = 0;
+	std::vector<unsigned char> selection_pixels_;
+	int selection_version_ = -1, selection_scale_ = 1;
+	// selection being dragged out
+	bool selecting_ = false;
+	ImVec2 select_from_, select_to_;
+	std::vector<ImVec2> lasso_;
+	// free transform: the lifted box of pixels (or just the selection mask) and where it's going. the
+	// preview is the lifted pixels as a texture drawn through the transform, only applying resamples
+	bool transforming_ = false, transform_dragging_ = false, transform_mask_only_ = false;
+	GLuint transform_texture_ = 0;
+	std::vector<uint8_t> transform_pixels_, transform_mask_, transform_original_;
+	int transform_x_ = 0, transform_y_ = 0, transform_w_ = 0, transform_h_ = 0;
+	matrix3x2 transform_, transform_start_;
+	ImVec2 transform_drag_;
+	// filter being previewed on the layer. while its settings are being dragged around it only runs on a
+	// downscaled copy shown instead of the layer (or just the part on screen, for filters that work pixel
+	// by pixel), the full size result comes once they settle
+	bool filtering_ = false, filter_dirty_ = false, filter_rough_ = false, filter_partial_ = false;
+	std::function<void(const uint8_t* src, uint8_t* dst, int width, int height, int scale)> filter_;
+	std::function<void(uint8_t* pixels, int count)> point_filter_;
+	std::vector<uint8_t> filter_original_, filter_mip_, filter_preview_;
+	int filter_scale_ = 1, filter_mip_w_ = 0, filter_mip_h_ = 0;
+	// the .rkgk the document was last saved to or opened from
+	document_file document_;
+	// strokes since the last autosave, to paint them again after a crash. the stroke being painted is kept
+	// here until it's done
+	stroke_journal journal_;
+	std::vector<journal_sample> stroke_samples_;
+	brush stroke_brush_ = brush(std::string());
+	color stroke_color_;
+	bool stroke_linear_ = false, stroke_journaled_ = false, replaying_ = false;
+	double stroke_start_ = 0;
 	// ..
 	int width_, height_;
 public:
@@ -32,6 +101,14 @@ public:
 	matrix3x2 matrix = matrix3x2();
 	ImVector<layer> layers;
 	int cur_layer = -1;
+	stroke_predictor predictor;
+	autosaver autosave;
+	tool cur_tool = tool::brush;
+	fill_options fill;
+	selection sel;
+	selection_op select_op = selection_op::replace;
+	resample_filter transform_filter = resample_filter::bicubic;
+	bool transform_selection_only = false;
 	// debug
 	float p1 = 0, p2 = 0, p3 = 1, p4 = 1, p5 = 0;
 	int p6 = 1;
@@ -43,6 +120,9 @@ public:
 		invalidate_render_quad();
 
 		this->name = name;
+		sel.resize(width, height);
+		composite_.resize(byte_count());
+		composite_dirty_.assign(tile_count(width, height), 1);
 
 		add_layer();
 		layers[0].clear(color_white, byte_count());
@@ -64,19 +144,332 @@ public:
 		glGenTextures(1, &texture_);
 		glBindTexture(GL_TEXTURE_2D, texture_);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+		glGenTextures(1, &overlay_texture_);
+		glBindTexture(GL_TEXTURE_2D, overlay_texture_);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+		glGenTextures(1, &selection_texture_);
+		glBindTexture(GL_TEXTURE_2D, selection_texture_);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+		glGenTextures(1, &transform_texture_);
+		glBindTexture(GL_TEXTURE_2D, transform_texture_);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
 		invalidate_opengl_texture();
 	}
 
 	void invalidate_opengl_texture()
 	{
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width_, height_, 0, GL_RGBA, GL_UNSIGNED_BYTE, layers[0].pixels);
+		glBindTexture(GL_TEXTURE_2D, texture_);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width_, height_, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		invalidate_opengl_region(0, 0, width_, height_);
+	}
+
+	// uploads just a box of the composite, through the display profile if there is one. that only ever
+	// converts what changed
+	void invalidate_opengl_region(const int x, const int y, const int w, const int h)
+	{
+		glBindTexture(GL_TEXTURE_2D, texture_);
+		if (!display_transform_.empty())
+		{
+			display_pixels_.resize((size_t)w * h * 4);
+			parallel_for_rows(h, composite_tile, [&](const int y0, const int y1)
+			{
+				for (int row = y0; row < y1; row++)
+				{
+					uint8_t* dst = display_pixels_.data() + (size_t)row * w * 4;
+					memcpy(dst, composite_.data() + ((size_t)(y + row) * width_ + x) * 4, (size_t)w * 4);
+					display_transform_.apply(dst, w);
+				}
+			});
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, display_pixels_.data());
+			return;
+		}
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, width_);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, composite_.data() + ((size_t)y * width_ + x) * 4);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	}
+
+	// brings the composite up to date with whatever changed since the last frame. only what's on screen
+	// unless asked for the whole thing, the rest waits until it's scrolled to
+	void update_composite(const bool whole = false)
+	{
+		int x0 = 0, y0 = 0, x1 = width_, y1 = height_;
+		if (!whole) visible_rect(x0, y0, x1, y1);
+		load_tiles(x0, y0, x1, y1);
+		composite(layers, composite_.data(), composite_dirty_.data(), width_, height_, x0, y0, x1, y1, options_);
+		if (x0 < x1 && y0 < y1) invalidate_opengl_region(x0, y0, x1 - x0, y1 - y0);
+	}
+
+	// decodes what's still in the document's file of the tiles compositing [x0, x1) * [y0, y1) reads, blurs
+	// read as far around as they reach
+	void load_tiles(const int x0, const int y0, const int x1, const int y1)
+	{
+		if (document_.tiles.empty()) return;
+		int reach = 0;
+		for (const layer& l : layers)
+		{
+			if (l.adjust == layer_adjust::blur) reach += blur_reach(l.radius) + composite_tile;
+		}
+		document_.tiles.load(layers, x0 - reach, y0 - reach, x1 + reach, y1 + reach);
+	}
+
+	const composite_options& options() const { return options_; }
+
+	// everything gets redone, any tile could have a 16-bit layer in it or layers mixing
+	void set_options(const composite_options& options)
+	{
+		options_ = options;
+		for (const auto& l : layers)
+		{
+			if (l.dirty) memset(l.dirty, 1, composite_dirty_.size());
+		}
+		std::fill(composite_dirty_.begin(), composite_dirty_.end(), (uint8_t)1);
+	}
+
+	// pixels of the current layer changed in [x0, x1) * [y0, y1)
+	void invalidate(const int x0, const int y0, const int x1, const int y1)
+	{
+		if (!stroking_) journal_barrier();
+		mark_unsaved(layers[cur_layer], width_, height_, x0, y0, x1, y1);
+		mark_dirty(layers, cur_layer, composite_dirty_.data(), width_, height_, x0, y0, x1, y1);
+	}
+
+	void invalidate()
+	{
+		invalidate(0, 0, width_, height_);
+	}
+
+	// a layer's visibility, opacity, blend mode or mask changed, so everywhere it has pixels needs
+	// redoing. the layers clipped to it go along, they could be clipped to another one now
+	void invalidate_layer(const int index)
+	{
+		journal_barrier();
+		for (int i = index; i < layers.size(); i++)
+		{
+			if (layers[i].depth > layers[index].depth) continue;
+			if (i != index && (layers[i].depth < layers[index].depth || !layers[i].clip)) break;
+			int x0 = 0, y0 = 0, x1 = width_, y1 = height_;
+			// a layer that's partly still in the file is taken to be everywhere
+			if (!layers[i].group && layers[i].adjust == layer_adjust::none && !document_.tiles.pending(layers[i])
+				&& !content_bounds(layers[i].pixels, width_, height_, x0, y0, x1, y1, layers[i].pixel_size())) continue;
+			mark_dirty(layers, i, composite_dirty_.data(), width_, height_, x0, y0, x1, y1);
+		}
+	}
+
+	// box of the canvas that's on screen, [x0, x1) * [y0, y1)
+	void visible_rect(int& x0, int& y0, int& x1, int& y1) const
+	{
+		const ImVec2 size = ImGui::GetIO().DisplaySize;
+		const matrix3x2 inverse = matrix.invert();
+		const ImVec2 corners[4] = { inverse.transform_vector(ImVec2(0, 0)), inverse.transform_vector(ImVec2(size.x, 0)),
+			inverse.transform_vector(size), inverse.transform_vector(ImVec2(0, size.y)) };
+		float min_x = corners[0].x, min_y = corners[0].y, max_x = min_x, max_y = min_y;
+		for (const auto& corner : corners)
+		{
+			min_x = std::min(min_x, corner.x);
+			min_y = std::min(min_y, corner.y);
+			max_x = std::max(max_x, corner.x);
+			max_y = std::max(max_y, corner.y);
+		}
+		x0 = std::max(0, (int)floor(min_x));
+		y0 = std::max(0, (int)floor(min_y));
+		x1 = std::min(width_, (int)ceil(max_x));
+		y1 = std::min(height_, (int)ceil(max_y));
 	}
 
-	void render(ImDrawList* drawlist) const
+	void render(ImDrawList* drawlist)
 	{
+		update_composite();
 		drawlist->AddImageQuad((void*)(intptr_t)texture_,
 			render_quad_[0], render_quad_[1],
 			render_quad_[2], render_quad_[3]);
+
+		// the selection moves along with a transform, showing it in the old spot would just confuse
+		if (sel.active() && !transforming_)
+		{
+			if (selection_version_ != sel.version()) update_selection_texture();
+			drawlist->AddImageQuad((void*)(intptr_t)selection_texture_,
+				render_quad_[0], render_quad_[1],
+				render_quad_[2], render_quad_[3]);
+		}
+		if (selecting_)
+		{
+			render_selection_outline(drawlist);
+		}
+		if (transforming_)
+		{
+			ImVec2 corners[4];
+			transform_corners(corners);
+			for (auto& corner : corners)
+			{
+				corner = matrix.transform_vector(corner);
+			}
+			drawlist->AddImageQuad((void*)(intptr_t)transform_texture_, corners[0], corners[1], corners[2], corners[3],
+				ImVec2(0, 0), ImVec2(1, 0), ImVec2(1, 1), ImVec2(0, 1), transform_mask_only_ ? IM_COL32(255, 255, 255, 120) : IM_COL32_WHITE);
+			drawlist->AddQuad(corners[0], corners[1], corners[2], corners[3], IM_COL32(40, 80, 160, 255));
+		}
+
+		if (overlay_w_ > 0 && overlay_h_ > 0)
+		{
+			const float x0 = overlay_x_, y0 = overlay_y_;
+			const float x1 = x0 + overlay_w_, y1 = y0 + overlay_h_;
+			drawlist->AddImageQuad((void*)(intptr_t)overlay_texture_,
+				matrix.transform_vector(ImVec2(x0, y0)), matrix.transform_vector(ImVec2(x1, y0)),
+				matrix.transform_vector(ImVec2(x1, y1)), matrix.transform_vector(ImVec2(x0, y1)));
+		}
+	}
+
+	void update_selection_texture()
+	{
+		selection_version_ = sel.version();
+		selection_scale_ = std::max(1, (std::max(width_, height_) + 2047) / 2048);
+		const int w = (width_ + selection_scale_ - 1) / selection_scale_, h = (height_ + selection_scale_ - 1) / selection_scale_;
+		selection_pixels_.resize((size_t)w * h * 4);
+
+		parallel_for(h, [&](const int first, const int last)
+		{
+			std::vector<uint8_t> row(width_);
+			std::vector<int> sums(w);
+			for (int y = first; y < last; y++)
+			{
+				std::fill(sums.begin(), sums.end(), 0);
+				int rows = 0;
+				for (int sy = y * selection_scale_; sy < std::min(height_, (y + 1) * selection_scale_); sy++, rows++)
+				{
+					const coverage c = sel.row(sy, 0, width_, row.data());
+					if (c != coverage::partial) memset(row.data(), c == coverage::all ? 255 : 0, width_);
+					for (int x = 0; x < width_; x++)
+					{
+						sums[x / selection_scale_] += row[x];
+					}
+				}
+				for (int x = 0; x < w; x++)
+				{
+					const int n = rows * std::min(selection_scale_, width_ - x * selection_scale_);
+					unsigned char* p = selection_pixels_.data() + ((size_t)y * w + x) * 4;
+					p[0] = 40;
+					p[1] = 80;
+					p[2] = 160;
+					p[3] = (unsigned char)((255 - sums[x] / n) * 120 / 255);
+				}
+			}
+		});
+
+		glBindTexture(GL_TEXTURE_2D, selection_texture_);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, selection_pixels_.data());
+		glBindTexture(GL_TEXTURE_2D, texture_);
+	}
+
+	void render_selection_outline(ImDrawList* drawlist) const
+	{
+		constexpr ImU32 outline = IM_COL32(40, 80, 160, 255);
+		const ImVec2 a = select_from_, b = select_to_;
+		switch (cur_tool)
+		{
+		case tool::select_rect:
+			drawlist->AddQuad(matrix.transform_vector(a), matrix.transform_vector(ImVec2(b.x, a.y)),
+				matrix.transform_vector(b), matrix.transform_vector(ImVec2(a.x, b.y)), outline);
+			break;
+		case tool::select_ellipse:
+		{
+			constexpr int segments = 64;
+			ImVec2 points[segments];
+			for (int i = 0; i < segments; i++)
+			{
+				const float t = i * 6.2831853f / segments;
+				points[i] = matrix.transform_vector(ImVec2((a.x + b.x) / 2 + cos(t) * (b.x - a.x) / 2, (a.y + b.y) / 2 + sin(t) * (b.y - a.y) / 2));
+			}
+			drawlist->AddPolyline(points, segments, outline, ImDrawFlags_Closed, 1);
+			break;
+		}
+		case tool::lasso:
+		{
+			std::vector<ImVec2> points(lasso_.size());
+			for (size_t i = 0; i < lasso_.size(); i++)
+			{
+				points[i] = matrix.transform_vector(lasso_[i]);
+			}
+			drawlist->AddPolyline(points.data(), (int)points.size(), outline, ImDrawFlags_Closed, 1);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	void clear_overlay()
+	{
+		overlay_w_ = overlay_h_ = 0;
+	}
+
+	// draws the predicted tail of the stroke into its own small texture, the layer is never touched
+	void update_overlay()
+	{
+		clear_overlay();
+
+		const dab_context& ctx = stroke_ctx_;
+		// erasing would need to punch holes into the canvas and smudging needs the pixels under the
+		// dabs, nothing to predict with an overlay. the selection mask is in canvas coordinates
+		if (ctx.mode != blend_mode::normal || ctx.selection_mask) return;
+
+		stroke_sample predicted;
+		if (!predictor.predict(predicted)) return;
+
+		// the real stroke stops at the last dab, so the tail starts there and not at the last sample
+		const ImVec2 from = stroke_pos_;
+		const float from_pressure = prev_pressure_;
+		const float tail_length = distance(from, predicted.pos);
+		const float spacing = std::max(.5f, ctx.size_at(predicted.pressure) * ctx.spacing);
+		if (tail_length < spacing) return;
+
+		const float margin = std::max(ctx.size_at(from_pressure), ctx.size_at(predicted.pressure)) / 2 + 2;
+		const int x0 = std::max(0, (int)floor(std::min(from.x, predicted.pos.x) - margin));
+		const int y0 = std::max(0, (int)floor(std::min(from.y, predicted.pos.y) - margin));
+		const int x1 = std::min(width_, (int)ceil(std::max(from.x, predicted.pos.x) + margin));
+		const int y1 = std::min(height_, (int)ceil(std::max(from.y, predicted.pos.y) + margin));
+		if (x1 <= x0 || y1 <= y0) return;
+
+		overlay_x_ = x0;
+		overlay_y_ = y0;
+		overlay_w_ = x1 - x0;
+		overlay_h_ = y1 - y0;
+
+		// transparent pixels of the stroke colour, so blending the dabs over it only builds up alpha
+		overlay_pixels_.resize((size_t)overlay_w_ * overlay_h_ * 4);
+		for (size_t i = 0; i < overlay_pixels_.size(); i += 4)
+		{
+			overlay_pixels_[i] = ctx.brush_color.r;
+			overlay_pixels_[i + 1] = ctx.brush_color.g;
+			overlay_pixels_[i + 2] = ctx.brush_color.b;
+			overlay_pixels_[i + 3] = 0;
+		}
+
+		const ImVec2 origin(overlay_x_, overlay_y_);
+		if (can_sweep(ctx, from_pressure, predicted.pressure))
+		{
+			sweep(ctx, ImVec2(from.x - origin.x, from.y - origin.y), from_pressure,
+				ImVec2(predicted.pos.x - origin.x, predicted.pos.y - origin.y), predicted.pressure, overlay_w_, overlay_h_, overlay_pixels_.data());
+		}
+		else
+		{
+			const auto df = spacing / tail_length;
+			for (auto f = df; f <= 1; f += df)
+			{
+				const float nx = (f * predicted.pos.x) + ((1 - f) * from.x);
+				const float ny = (f * predicted.pos.y) + ((1 - f) * from.y);
+				const float np = f * predicted.pressure + (1 - f) * from_pressure;
+				ctx.dab(nx - origin.x, ny - origin.y, np, overlay_w_, overlay_h_, overlay_pixels_.data());
+			}
+		}
+
+		display_transform_.apply(overlay_pixels_.data(), overlay_w_ * overlay_h_);
+		glBindTexture(GL_TEXTURE_2D, overlay_texture_);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, matrix.m11 >= 2.0f ? GL_NEAREST : GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, overlay_w_, overlay_h_, 0, GL_RGBA, GL_UNSIGNED_BYTE, overlay_pixels_.data());
+		glBindTexture(GL_TEXTURE_2D, texture_);
 	}
 
 #pragma endregion rendering
@@ -141,19 +534,40 @@ public:
 			return;
 		}
 
+		if (cur_tool == tool::fill)
+		{
+			ImVec2 pos;
+			if (io.MouseClicked[0] && active_pixels() && get_transformed_pos(io.MousePos, pos))
+			{
+				if (flood_fill((int)pos.x, (int)pos.y, fill_sample(), active_pixels(), width_, height_, color, fill, &sel))
+				{
+					invalidate();
+				}
+			}
+			return;
+		}
+		if (cur_tool == tool::transform)
+		{
+			handle_transform(io);
+			return;
+		}
+		if (cur_tool != tool::brush)
+		{
+			handle_selection(io);
+			return;
+		}
+
+		// groups have no pixels of their own to paint on
+		if (paint_pixels() == nullptr) return;
+
 		// stroke started
 		if (io.MouseClicked[0])
 		{
-			start_stroke();
 			ImVec2 transformed_pos;
 			get_transformed_pos(io.MousePos, transformed_pos);
-			buffer_ = new unsigned char[byte_count()];
-			stroke_pos_ = transformed_pos;
-			stroking_ = true;
-			prev_pressure_ = pressure;
-			//layers[cur_layer].clear(color_white);
-			dab(stroke_pos_.x, stroke_pos_.y, pressure, brush, color, width_, height_, layers[0].pixels);
-			invalidate_opengl_texture();
+			if (!begin_stroke(transformed_pos, pressure, brush, color, options_.linear)) return;
+			predictor.reset();
+			predictor.add_sample({ transformed_pos, pressure, glfwGetTime() });
 			glfwSwapInterval(0); // disable v-sync, we want many inputs as we can get so our lines aren't choppy
 			return;
 		}
@@ -163,15 +577,71 @@ public:
 		{
 			ImVec2 new_pos;
 			get_transformed_pos(io.MousePos, new_pos);
+			predictor.add_sample({ new_pos, pressure, glfwGetTime() });
+			continue_stroke(new_pos, pressure);
+			update_overlay();
+			return;
+		}
 
-			const auto dab_distance = distance(stroke_pos_, new_pos);
-			const auto stroke_size = brush.get_size(pressure);
-			const auto spacing = std::max(.5f, stroke_size * brush.spacing);
-			if (dab_distance < spacing)
-			{
-				return;
-			}
+		// stroke ended
+		if (io.MouseReleased[0] && stroking_)
+		{
+			finish_stroke();
+			clear_overlay();
+			glfwSwapInterval(1); // reenable v-sync, waste of gpu power to have it off while we're not painting
+		}
+	}
+
+	// a stroke's first sample, false if the brush can't paint on the current layer. replaying the journal
+	// goes through here too, so a stroke comes out the same either way
+	bool begin_stroke(const ImVec2 pos, const float pressure, const brush& brush, const color color, const bool linear)
+	{
+		uint8_t* pixels = paint_pixels();
+		if (pixels == nullptr || !can_paint(brush, layers[cur_layer].format)) return false;
+		start_stroke();
+		stroke_pos_ = pos;
+		stroking_ = true;
+		prev_pressure_ = pressure;
+		// brush settings are fixed for the rest of the stroke
+		stroke_ctx_ = make_dab_context(brush, color, &sel, layers[cur_layer].format, linear);
+		load_stroke(stroke_pos_, stroke_pos_);
+		stroke_ctx_.dab(stroke_pos_.x, stroke_pos_.y, pressure, width_, height_, pixels);
+		invalidate_stroke(stroke_pos_, stroke_pos_);
+		if (replaying_) return true;
+		// the selection isn't in the autosave and tip images aren't in the journal, strokes that need either
+		// can't be painted again
+		stroke_journaled_ = !sel.active() && brush.tip < 0;
+		stroke_brush_ = brush;
+		stroke_color_ = color;
+		stroke_linear_ = linear;
+		stroke_start_ = glfwGetTime();
+		stroke_samples_.assign(1, { pos.x, pos.y, pressure, 0 });
+		return true;
+	}
+
+	void continue_stroke(const ImVec2 new_pos, const float pressure)
+	{
+		if (!replaying_) stroke_samples_.push_back({ new_pos.x, new_pos.y, pressure, (float)(glfwGetTime() - stroke_start_) });
+		uint8_t* pixels = paint_pixels();
+		const auto dab_distance = distance(stroke_pos_, new_pos);
+		if (dab_distance > 0)
+		{
+			stroke_ctx_.direction = atan2(new_pos.y - stroke_pos_.y, new_pos.x - stroke_pos_.x);
+		}
+		const auto stroke_size = stroke_ctx_.size_at(pressure);
+		const auto spacing = std::max(.5f, stroke_size * stroke_ctx_.spacing);
+		if (dab_distance < spacing) return;
 
+		const ImVec2 from = stroke_pos_;
+		load_stroke(from, new_pos);
+		if (can_sweep(stroke_ctx_, prev_pressure_, pressure))
+		{
+			sweep(stroke_ctx_, stroke_pos_, prev_pressure_, new_pos, pressure, width_, height_, pixels);
+			stroke_pos_ = new_pos;
+			prev_pressure_ = pressure;
+		}
+		else
+		{
 			float nx, ny, np;
 			const auto df = spacing / dab_distance;
 			for (auto f = df; f <= 1; f += df)
@@ -179,67 +649,1022 @@ public:
 				nx = (f * new_pos.x) + ((1 - f) * stroke_pos_.x);
 				ny = (f * new_pos.y) + ((1 - f) * stroke_pos_.y);
 				np = f * pressure + (1 - f) * prev_pressure_;
-				dab(nx, ny, np, brush, color, width_, height_, layers[0].pixels);
+				stroke_ctx_.dab(nx, ny, np, width_, height_, pixels);
 			}
 
 			stroke_pos_ = ImVec2(nx, ny);
 			prev_pressure_ = np;
-			invalidate_opengl_texture();
+		}
+		invalidate_stroke(from, stroke_pos_);
+	}
+
+	void finish_stroke()
+	{
+		stroking_ = false;
+		if (replaying_) return;
+		if (!stroke_journaled_)
+		{
+			journal_barrier();
 			return;
 		}
+		journal_.stroke(layers[cur_layer].id, layers_checksum(layers), stroke_brush_, stroke_color_, stroke_linear_, stroke_samples_);
+	}
 
-		// stroke ended
-		if (io.MouseReleased[0] && stroking_)
+	// the pixels changed some other way than a stroke, replaying the journal has to stop here and the
+	// autosave has to catch up instead
+	void journal_barrier()
+	{
+		if (replaying_) return;
+		journal_.barrier();
+		autosave.soon();
+	}
+
+	// the tiles a stretch of the stroke can paint on, in case they're still in the document's file
+	void load_stroke(const ImVec2 from, const ImVec2 to)
+	{
+		const int reach = stroke_ctx_.reach();
+		document_.tiles.load(layers[cur_layer], (int)floor(std::min(from.x, to.x)) - reach, (int)floor(std::min(from.y, to.y)) - reach,
+			(int)ceil(std::max(from.x, to.x)) + reach + 1, (int)ceil(std::max(from.y, to.y)) + reach + 1);
+	}
+
+	// the box a stretch of the stroke can have painted in
+	void invalidate_stroke(const ImVec2 from, const ImVec2 to)
+	{
+		const int reach = stroke_ctx_.reach();
+		invalidate((int)floor(std::min(from.x, to.x)) - reach, (int)floor(std::min(from.y, to.y)) - reach,
+			(int)ceil(std::max(from.x, to.x)) + reach + 1, (int)ceil(std::max(from.y, to.y)) + reach + 1);
+	}
+
+	void handle_selection(const ImGuiIO& io)
+	{
+		ImVec2 pos;
+		get_transformed_pos(io.MousePos, pos);
+		const selection_op op = io.KeyShift ? selection_op::add : io.KeyAlt ? selection_op::subtract : select_op;
+
+		if (cur_tool == tool::magic_wand)
 		{
-			delete[]buffer_;
-			stroking_ = false;
-			glfwSwapInterval(1); // reenable v-sync, waste of gpu power to have it off while we're not painting
+			if (io.MouseClicked[0])
+			{
+				magic_wand(sel, op, (int)floor(pos.x), (int)floor(pos.y), fill_sample(), width_, height_, fill);
+			}
+			return;
+		}
+
+		if (io.MouseClicked[0])
+		{
+			selecting_ = true;
+			select_from_ = select_to_ = pos;
+			lasso_.clear();
+			lasso_.push_back(pos);
+			return;
+		}
+
+		if (io.MouseDown[0] && selecting_)
+		{
+			select_to_ = pos;
+			if (cur_tool == tool::lasso && distance(lasso_.back(), pos) >= 1)
+			{
+				lasso_.push_back(pos);
+			}
+			return;
+		}
+
+		if (io.MouseReleased[0] && selecting_)
+		{
+			selecting_ = false;
+			// just clicking somewhere drops the selection
+			if (op == selection_op::replace && distance(select_from_, select_to_) < 1)
+			{
+				sel.deselect();
+				return;
+			}
+			switch (cur_tool)
+			{
+			case tool::select_rect:
+				sel.rect(op, select_from_.x, select_from_.y, select_to_.x, select_to_.y);
+				break;
+			case tool::select_ellipse:
+				sel.ellipse(op, select_from_.x, select_from_.y, select_to_.x, select_to_.y);
+				break;
+			case tool::lasso:
+				sel.lasso(op, lasso_);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+#pragma region transform
+
+	bool transforming() const { return transforming_; }
+
+	// lifts the selected pixels (everything without a selection) off the layer so they can be moved around
+	bool begin_transform()
+	{
+		int x0 = 0, y0 = 0, x1 = width_, y1 = height_;
+		if (sel.active() && !sel.bounds(x0, y0, x1, y1)) return false;
+		if (transform_selection_only && !sel.active()) return false;
+		uint8_t* pixels = active_pixels();
+		if (!transform_selection_only && pixels == nullptr) return false;
+		if (pixels != nullptr) document_.tiles.load(layers[cur_layer]);
+
+		transform_mask_only_ = transform_selection_only;
+		transform_x_ = x0;
+		transform_y_ = y0;
+		transform_w_ = x1 - x0;
+		transform_h_ = y1 - y0;
+		const int w = transform_w_;
+		transform_mask_.clear();
+		if (sel.active())
+		{
+			transform_mask_.resize((size_t)w * transform_h_);
+			sel.read(x0, y0, w, transform_h_, transform_mask_.data());
+		}
+
+		transform_pixels_.resize((size_t)w * transform_h_ * 4);
+		if (transform_mask_only_)
+		{
+			// the mask rides along in the alpha channel, the color is just what the preview shows
+			for (size_t i = 0; i < transform_mask_.size(); i++)
+			{
+				uint8_t* p = transform_pixels_.data() + i * 4;
+				p[0] = 40;
+				p[1] = 80;
+				p[2] = 160;
+				p[3] = transform_mask_[i];
+			}
+		}
+		else
+		{
+			// only the lifted box can change, so that's all cancelling needs to put back
+			transform_original_.resize(transform_pixels_.size());
+			parallel_for_rows(transform_h_, resample_band, [&](const int first, const int last)
+			{
+				for (int y = first; y < last; y++)
+				{
+					uint8_t* row = pixels + ((size_t)(y0 + y) * width_ + x0) * 4;
+					uint8_t* lifted = transform_pixels_.data() + (size_t)y * w * 4;
+					memcpy(transform_original_.data() + (size_t)y * w * 4, row, (size_t)w * 4);
+					memcpy(lifted, row, (size_t)w * 4);
+					if (transform_mask_.empty())
+					{
+						for (int x = 0; x < w; x++)
+						{
+							row[x * 4 + 3] = 0;
+						}
+						continue;
+					}
+					const uint8_t* mask = transform_mask_.data() + (size_t)y * w;
+					for (int x = 0; x < w; x++)
+					{
+						lifted[x * 4 + 3] = mask_alpha(lifted[x * 4 + 3], mask[x]);
+						row[x * 4 + 3] = mask_alpha(row[x * 4 + 3], 255 - mask[x]);
+					}
+				}
+			});
+			invalidate(x0, y0, x1, y1);
+		}
+
+		glBindTexture(GL_TEXTURE_2D, transform_texture_);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, transform_h_, 0, GL_RGBA, GL_UNSIGNED_BYTE, transform_pixels_.data());
+		glBindTexture(GL_TEXTURE_2D, texture_);
+
+		transform_ = matrix3x2();
+		transform_.translate((float)x0, (float)y0);
+		transforming_ = true;
+		return true;
+	}
+
+	// resamples the lifted pixels (and the selection) into their new place
+	void apply_transform()
+	{
+		if (!transforming_) return;
+
+		ImVec2 corners[4];
+		transform_corners(corners);
+		float min_x = corners[0].x, min_y = corners[0].y, max_x = min_x, max_y = min_y;
+		for (const auto& corner : corners)
+		{
+			min_x = std::min(min_x, corner.x);
+			min_y = std::min(min_y, corner.y);
+			max_x = std::max(max_x, corner.x);
+			max_y = std::max(max_y, corner.y);
+		}
+		// the filters reach a pixel or two past the edges
+		const int x0 = std::max(0, (int)floor(min_x) - 2), y0 = std::max(0, (int)floor(min_y) - 2);
+		const int x1 = std::min(width_, (int)ceil(max_x) + 2), y1 = std::min(height_, (int)ceil(max_y) + 2);
+		const int w = x1 - x0, h = y1 - y0;
+		const matrix3x2 to_source = transform_.invert();
+
+		if (w > 0 && h > 0)
+		{
+			std::vector<uint8_t> out((size_t)w * h * 4);
+			if (!transform_mask_only_)
+			{
+				resample(transform_pixels_.data(), transform_w_, transform_h_, out.data(), x0, y0, w, h, to_source, transform_filter);
+				parallel_for_rows(h, resample_band, [&](const int first, const int last)
+				{
+					for (int y = first; y < last; y++)
+					{
+						over_span(active_pixels() + ((size_t)(y0 + y) * width_ + x0) * 4, out.data() + (size_t)y * w * 4, w, 255);
+					}
+				});
+				invalidate(x0, y0, x1, y1);
+			}
+			if (!transform_mask_.empty())
+			{
+				if (!transform_mask_only_)
+				{
+					for (size_t i = 0; i < transform_mask_.size(); i++)
+					{
+						transform_pixels_[i * 4] = transform_pixels_[i * 4 + 1] = transform_pixels_[i * 4 + 2] = 255;
+						transform_pixels_[i * 4 + 3] = transform_mask_[i];
+					}
+				}
+				resample(transform_pixels_.data(), transform_w_, transform_h_, out.data(), x0, y0, w, h, to_source, transform_filter);
+				std::vector<uint8_t> values((size_t)w * h);
+				for (size_t i = 0; i < values.size(); i++)
+				{
+					values[i] = out[i * 4 + 3];
+				}
+				sel.mask(selection_op::replace, values.data(), x0, y0, w, h);
+			}
+		}
+		else if (!transform_mask_.empty())
+		{
+			// moved entirely off the canvas
+			sel.deselect();
+		}
+		end_transform();
+	}
+
+	void cancel_transform()
+	{
+		if (!transforming_) return;
+		if (!transform_mask_only_)
+		{
+			for (int y = 0; y < transform_h_; y++)
+			{
+				memcpy(active_pixels() + ((size_t)(transform_y_ + y) * width_ + transform_x_) * 4,
+					transform_original_.data() + (size_t)y * transform_w_ * 4, (size_t)transform_w_ * 4);
+			}
+			invalidate(transform_x_, transform_y_, transform_x_ + transform_w_, transform_y_ + transform_h_);
+		}
+		end_transform();
+	}
+
+	// drag to move, ctrl+drag to rotate and shift+drag to scale around the center
+	void handle_transform(const ImGuiIO& io)
+	{
+		ImVec2 pos;
+		get_transformed_pos(io.MousePos, pos);
+
+		if (io.MouseClicked[0])
+		{
+			if (!transforming_ && !begin_transform()) return;
+			transform_dragging_ = true;
+			transform_drag_ = pos;
+			transform_start_ = transform_;
+			return;
+		}
+
+		if (io.MouseDown[0] && transform_dragging_)
+		{
+			const ImVec2 center = transform_start_.transform_vector(ImVec2(transform_w_ / 2.0f, transform_h_ / 2.0f));
+			matrix3x2 m;
+			if (io.KeyCtrl)
+			{
+				const float angle = atan2(pos.y - center.y, pos.x - center.x) - atan2(transform_drag_.y - center.y, transform_drag_.x - center.x);
+				m = m.rotate(angle, center);
+			}
+			else if (io.KeyShift)
+			{
+				const float scale = std::max(.01f, distance(pos, center) / std::max(1.0f, distance(transform_drag_, center)));
+				m.scale_at(scale, scale, center.x, center.y);
+			}
+			else
+			{
+				m.translate(pos.x - transform_drag_.x, pos.y - transform_drag_.y);
+			}
+			transform_ = m * transform_start_;
+			return;
 		}
+
+		if (io.MouseReleased[0])
+		{
+			transform_dragging_ = false;
+		}
+	}
+
+private:
+	void transform_corners(ImVec2 corners[4]) const
+	{
+		const float w = (float)transform_w_, h = (float)transform_h_;
+		corners[0] = transform_.transform_vector(ImVec2(0, 0));
+		corners[1] = transform_.transform_vector(ImVec2(w, 0));
+		corners[2] = transform_.transform_vector(ImVec2(w, h));
+		corners[3] = transform_.transform_vector(ImVec2(0, h));
+	}
+
+	void end_transform()
+	{
+		transforming_ = transform_dragging_ = false;
+		transform_pixels_ = {};
+		transform_mask_ = {};
+		transform_original_ = {};
+	}
+
+public:
+
+#pragma endregion transform
+
+#pragma region filters
+
+	bool filtering() const { return filtering_; }
+
+	// keeps the layer as it is so the filter can be rerun from it with every change
+	bool begin_filter()
+	{
+		if (filtering_) return true;
+		if (active_pixels() == nullptr) return false;
+		document_.tiles.load(layers[cur_layer]);
+		filtering_ = true;
+		filter_ = nullptr;
+		filter_original_.assign(active_pixels(), active_pixels() + byte_count());
+
+		// about screen sized, the most the preview would show of the whole canvas anyway
+		filter_scale_ = std::max(1, (std::max(width_, height_) + 2047) / 2048);
+		filter_mip_w_ = (width_ + filter_scale_ - 1) / filter_scale_;
+		filter_mip_h_ = (height_ + filter_scale_ - 1) / filter_scale_;
+		filter_mip_.resize((size_t)filter_mip_w_ * filter_mip_h_ * 4);
+		parallel_for(filter_mip_h_, [&](const int first, const int last)
+		{
+			for (int y = first; y < last; y++)
+			{
+				for (int x = 0; x < filter_mip_w_; x++)
+				{
+					// weighted by alpha, so transparent pixels don't darken the edges
+					uint32_t sum[4] = {};
+					for (int sy = y * filter_scale_; sy < std::min(height_, (y + 1) * filter_scale_); sy++)
+					{
+						for (int sx = x * filter_scale_; sx < std::min(width_, (x + 1) * filter_scale_); sx++)
+						{
+							const uint8_t* p = filter_original_.data() + ((size_t)sy * width_ + sx) * 4;
+							sum[0] += p[0] * p[3];
+							sum[1] += p[1] * p[3];
+							sum[2] += p[2] * p[3];
+							sum[3] += p[3];
+						}
+					}
+					const int n = (std::min(height_, (y + 1) * filter_scale_) - y * filter_scale_) * (std::min(width_, (x + 1) * filter_scale_) - x * filter_scale_);
+					uint8_t* out = filter_mip_.data() + ((size_t)y * filter_mip_w_ + x) * 4;
+					for (int c = 0; c < 3; c++)
+					{
+						out[c] = (uint8_t)(sum[3] ? sum[c] / sum[3] : 0);
+					}
+					out[3] = (uint8_t)(sum[3] / n);
+				}
+			}
+		});
+		return true;
+	}
+
+	template <typename Fn>
+	void set_filter(const Fn& fn)
+	{
+		filter_ = fn;
+		point_filter_ = nullptr;
+		filter_dirty_ = true;
+	}
+
+	// a filter that changes every pixel on its own, fn(pixels, count) works in place on a run of them
+	template <typename Fn>
+	void set_point_filter(const Fn& fn)
+	{
+		filter_ = [fn](const uint8_t* src, uint8_t* dst, const int width, const int height, int)
+		{
+			parallel_for_rows(height, filter_tile, [&](const int y0, const int y1)
+			{
+				const size_t offset = (size_t)y0 * width * 4;
+				memcpy(dst + offset, src + offset, (size_t)(y1 - y0) * width * 4);
+				fn(dst + offset, (y1 - y0) * width);
+			});
+		};
+		point_filter_ = fn;
+		filter_dirty_ = true;
+	}
+
+	// call every frame while the filter's settings are up, interacting is whether they're being dragged
+	void update_filter(const bool interacting)
+	{
+		if (!filtering_ || !filter_) return;
+
+		if (filter_dirty_ && interacting && point_filter_)
+		{
+			int x0, y0, x1, y1;
+			visible_rect(x0, y0, x1, y1);
+			if (x0 < x1 && y0 < y1)
+			{
+				const int w = x1 - x0;
+				parallel_for_rows(y1 - y0, filter_tile, [&](const int first, const int last)
+				{
+					for (int y = y0 + first; y < y0 + last; y++)
+					{
+						const size_t offset = ((size_t)y * width_ + x0) * 4;
+						memcpy(active_pixels() + offset, filter_original_.data() + offset, (size_t)w * 4);
+						point_filter_(active_pixels() + offset, w);
+					}
+				});
+				if (sel.active()) filter_selected_only(x0, y0, x1, y1);
+				invalidate(x0, y0, x1, y1);
+			}
+			filter_partial_ = true;
+			filter_dirty_ = false;
+			return;
+		}
+
+		if (filter_dirty_ && interacting && filter_scale_ > 1)
+		{
+			// the small result is scaled back up into the part of the layer that's on screen, which then
+			// composites with everything else like any other edit
+			filter_preview_.resize(filter_mip_.size());
+			filter_(filter_mip_.data(), filter_preview_.data(), filter_mip_w_, filter_mip_h_, filter_scale_);
+			int x0, y0, x1, y1;
+			visible_rect(x0, y0, x1, y1);
+			if (x0 < x1 && y0 < y1)
+			{
+				parallel_for_rows(y1 - y0, filter_tile, [&](const int first, const int last)
+				{
+					for (int y = y0 + first; y < y0 + last; y++)
+					{
+						const float sy = std::max(0.0f, (y + .5f) / filter_scale_ - .5f);
+						const int my0 = std::min((int)sy, filter_mip_h_ - 1), my1 = std::min(my0 + 1, filter_mip_h_ - 1);
+						const int fy = (int)((sy - my0) * 256);
+						const uint8_t* top = filter_preview_.data() + (size_t)my0 * filter_mip_w_ * 4;
+						const uint8_t* bottom = filter_preview_.data() + (size_t)my1 * filter_mip_w_ * 4;
+						uint8_t* row = active_pixels() + (size_t)y * width_ * 4;
+						for (int x = x0; x < x1; x++)
+						{
+							const float sx = std::max(0.0f, (x + .5f) / filter_scale_ - .5f);
+							const int mx0 = std::min((int)sx, filter_mip_w_ - 1), mx1 = std::min(mx0 + 1, filter_mip_w_ - 1);
+							const int fx = (int)((sx - mx0) * 256);
+							for (int c = 0; c < 4; c++)
+							{
+								const int a = top[mx0 * 4 + c] * (256 - fx) + top[mx1 * 4 + c] * fx;
+								const int b = bottom[mx0 * 4 + c] * (256 - fx) + bottom[mx1 * 4 + c] * fx;
+								row[x * 4 + c] = (uint8_t)((a * (256 - fy) + b * fy + (1 << 15)) >> 16);
+							}
+						}
+					}
+				});
+				if (sel.active()) filter_selected_only(x0, y0, x1, y1);
+				invalidate(x0, y0, x1, y1);
+			}
+			filter_rough_ = true;
+			filter_dirty_ = false;
+			return;
+		}
+
+		if (filter_dirty_ || ((filter_rough_ || filter_partial_) && !interacting))
+		{
+			filter_(filter_original_.data(), active_pixels(), width_, height_, 1);
+			if (sel.active()) filter_selected_only(0, 0, width_, height_);
+			filter_rough_ = filter_partial_ = filter_dirty_ = false;
+			invalidate();
+		}
+	}
+
+	void apply_filter()
+	{
+		update_filter(false);
+		end_filter();
+	}
+
+	void cancel_filter()
+	{
+		if (!filtering_) return;
+		memcpy(active_pixels(), filter_original_.data(), byte_count());
+		end_filter();
+		invalidate();
+	}
+
+private:
+	// puts the unselected parts of a box back, and blends the partly selected ones
+	void filter_selected_only(const int x0, const int y0, const int x1, const int y1)
+	{
+		const int w = x1 - x0;
+		parallel_for_rows(y1 - y0, filter_tile, [&](const int first, const int last)
+		{
+			std::vector<uint8_t> mask(w), filtered((size_t)w * 4);
+			for (int y = y0 + first; y < y0 + last; y++)
+			{
+				const size_t offset = ((size_t)y * width_ + x0) * 4;
+				uint8_t* row = active_pixels() + offset;
+				const coverage c = sel.row(y, x0, w, mask.data());
+				if (c == coverage::all) continue;
+				if (c == coverage::partial) memcpy(filtered.data(), row, filtered.size());
+				memcpy(row, filter_original_.data() + offset, filtered.size());
+				if (c == coverage::partial) lerp_span(row, filtered.data(), mask.data(), w);
+			}
+		});
+	}
+
+	void end_filter()
+	{
+		filtering_ = filter_rough_ = filter_partial_ = filter_dirty_ = false;
+		filter_ = nullptr;
+		point_filter_ = nullptr;
+		filter_original_ = {};
+		filter_mip_ = {};
+		filter_preview_ = {};
+	}
+
+public:
+
+#pragma endregion filters
+
+	// what the fill and magic wand look at, the current layer or everything as it's shown
+	const uint8_t* fill_sample()
+	{
+		if (fill.sample_merged || active_pixels() == nullptr)
+		{
+			update_composite(true);
+			return composite_.data();
+		}
+		document_.tiles.load(layers[cur_layer]);
+		return active_pixels();
+	}
+
+#pragma region layers
+
+	// 8-bit rgba pixels of the current layer, null for groups, adjustments and other formats
+	uint8_t* active_pixels()
+	{
+		return paint_pixels() && layers[cur_layer].format == pixel_format::rgba8 ? layers[cur_layer].pixels : nullptr;
+	}
+
+	// what the brush paints on, which can also be alpha only
+	uint8_t* paint_pixels()
+	{
+		if (cur_layer < 0 || cur_layer >= layers.size() || layers[cur_layer].group || layers[cur_layer].adjust != layer_adjust::none) return nullptr;
+		return layers[cur_layer].pixels;
+	}
+
+	// the adjustments in [begin, end) see different layers below them now, after grouping or ungrouping
+	void redo_adjustments(const int begin, const int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			if (layers[i].adjust != layer_adjust::none) memset(layers[i].dirty, 1, tile_count(width_, height_));
+		}
+	}
+
+	// a new adjustment layer right above the current one, it starts out changing nothing
+	void add_adjustment(const layer_adjust type)
+	{
+		const char* names[] = { "", "Curves", "Hue/Saturation", "Blur" };
+		layer adjustment(names[(int)type], byte_count());
+		adjustment.adjust = type;
+		adjustment.depth = cur_layer >= 0 ? layers[cur_layer].depth : 0;
+		adjustment.dirty = new unsigned char[tile_count(width_, height_)];
+		layers.insert(layers.begin() + cur_layer + 1, adjustment);
+		cur_layer++;
+		adjustment_changed(cur_layer);
 	}
 
+	// an adjustment's settings changed, everything it cached is out of date
+	void adjustment_changed(const int index)
+	{
+		layer& l = layers[index];
+		if (l.adjust == layer_adjust::curves) l.lut = color_lut::curves(l.curve, adjust_curve_points);
+		memset(l.dirty, 1, tile_count(width_, height_));
+		invalidate_layer(index);
+	}
+
+	// a new layer right above the current one, in the same group
 	void add_layer()
 	{
-		const layer layer("Layer " + std::to_string(layers.size() + 1), byte_count());
+		layer layer("Layer " + std::to_string(layers.size() + 1), byte_count());
+		layer.clear(color(), byte_count());
+		layer.depth = cur_layer >= 0 ? layers[cur_layer].depth : 0;
 		layers.insert(layers.begin() + cur_layer + 1, layer);
 		cur_layer++;
 	}
 
+	// puts the current layer (or group) into a new group
+	void add_group()
+	{
+		if (cur_layer < 0) return;
+		layer group("Group " + std::to_string(layers.size() + 1), byte_count());
+		group.group = true;
+		group.depth = layers[cur_layer].depth;
+		group.dirty = new unsigned char[tile_count(width_, height_)];
+		memset(group.dirty, 1, tile_count(width_, height_));
+		const int begin = layers[cur_layer].group ? group_begin(layers, cur_layer) : cur_layer;
+		for (int i = begin; i <= cur_layer; i++)
+		{
+			layers[i].depth++;
+		}
+		layers.insert(layers.begin() + cur_layer + 1, group);
+		cur_layer++;
+		redo_adjustments(begin, cur_layer);
+		invalidate_layer(cur_layer);
+	}
+
+	// a group goes along with everything in it
 	void remove_layer(const int idx)
 	{
-		if (idx < 0 || layers.size() <= 1) return;
+		if (idx < 0) return;
+		const int begin = layers[idx].group ? group_begin(layers, idx) : idx;
+		if (layers.size() - (idx - begin + 1) < 1) return;
+		invalidate_layer(idx);
+		for (int i = begin; i <= idx; i++)
+		{
+			delete[]layers[i].pixels;
+			delete[]layers[i].dirty;
+			delete[]layers[i].mask;
+			forget_saved(layers[i]);
+		}
+		layers.erase(layers.begin() + begin, layers.begin() + idx + 1);
+		cur_layer = std::max(0, std::min(begin, layers.size()) - 1);
+	}
+
+	// takes the layers out of a group and drops the group
+	void ungroup(const int idx)
+	{
+		if (idx < 0 || !layers[idx].group) return;
+		invalidate_layer(idx);
+		const int begin = group_begin(layers, idx);
+		for (int i = begin; i < idx; i++)
+		{
+			layers[i].depth--;
+		}
+		redo_adjustments(begin, idx);
 		delete[]layers[idx].pixels;
+		delete[]layers[idx].dirty;
+		delete[]layers[idx].mask;
+		forget_saved(layers[idx]);
 		layers.erase(layers.begin() + idx);
-		if (cur_layer != 0)
+		cur_layer = std::max(0, std::min(idx, layers.size()) - 1);
+	}
+
+	// the bottom layer goes back to white, anything else to transparent
+	void clear_layer()
+	{
+		if (paint_pixels() == nullptr) return;
+		const layer& l = layers[cur_layer];
+		document_.tiles.load(l);
+		if (l.format == pixel_format::alpha8) memset(l.pixels, 0, (size_t)width_ * height_);
+		else if (l.format == pixel_format::rgba16) memset(l.pixels, cur_layer == 0 ? 0xff : 0, (size_t)width_ * height_ * 8);
+		else l.clear(cur_layer == 0 ? color_white : color(), byte_count());
+		invalidate();
+	}
+
+	// changes the current layer's pixel format, anything else goes through 8-bit rgba on the way.
+	// going to alpha only keeps the coverage and tints it with the layer's average color, coming
+	// back fills in the tint. 16 to 8 bits rounds, there's no point dithering what gets painted on
+	void convert_layer(const pixel_format format)
+	{
+		if (paint_pixels() == nullptr || layers[cur_layer].format == format) return;
+		layer& l = layers[cur_layer];
+		document_.tiles.load(l);
+		const size_t count = (size_t)width_ * height_;
+		uint8_t* rgba = l.pixels;
+		if (l.format == pixel_format::alpha8)
+		{
+			rgba = new uint8_t[count * 4];
+			const uint8_t* alphas = l.pixels;
+			parallel_for_rows(height_, composite_tile, [&](const int y0, const int y1)
+			{
+				for (size_t i = (size_t)y0 * width_; i < (size_t)y1 * width_; i++)
+				{
+					rgba[i * 4] = l.tint.r;
+					rgba[i * 4 + 1] = l.tint.g;
+					rgba[i * 4 + 2] = l.tint.b;
+					rgba[i * 4 + 3] = alphas[i];
+				}
+			});
+		}
+		else if (l.format == pixel_format::rgba16)
+		{
+			rgba = new uint8_t[count * 4];
+			const uint16_t* deep = (const uint16_t*)l.pixels;
+			parallel_for_rows(height_, composite_tile, [&](const int y0, const int y1)
+			{
+				const size_t first = (size_t)y0 * width_;
+				narrow_span(deep + first * 4, rgba + first * 4, (y1 - y0) * width_, 0, y0, false);
+			});
+		}
+
+		uint8_t* pixels = rgba;
+		if (format == pixel_format::alpha8)
+		{
+			uint64_t sum[3] = {}, weight_sum = 0;
+			pixels = new uint8_t[count];
+			for (size_t i = 0; i < count; i++)
+			{
+				const uint8_t* p = rgba + i * 4;
+				pixels[i] = p[3];
+				sum[0] += p[0] * p[3];
+				sum[1] += p[1] * p[3];
+				sum[2] += p[2] * p[3];
+				weight_sum += p[3];
+			}
+			if (weight_sum > 0)
+			{
+				l.tint = color((uint8_t)(sum[0] / weight_sum), (uint8_t)(sum[1] / weight_sum), (uint8_t)(sum[2] / weight_sum), 255);
+			}
+		}
+		else if (format == pixel_format::rgba16)
+		{
+			uint16_t* deep = new uint16_t[count * 4];
+			parallel_for_rows(height_, composite_tile, [&](const int y0, const int y1)
+			{
+				for (size_t i = (size_t)y0 * width_ * 4; i < (size_t)y1 * width_ * 4; i++)
+				{
+					deep[i] = (uint16_t)(rgba[i] * 257);
+				}
+			});
+			pixels = (uint8_t*)deep;
+		}
+
+		if (rgba != l.pixels && rgba != pixels) delete[]rgba;
+		delete[]l.pixels;
+		forget_saved(l);
+		l.pixels = pixels;
+		l.format = format;
+		invalidate_layer(cur_layer);
+	}
+
+	// a mask on the current layer showing what's selected, or everything if nothing is
+	void add_mask()
+	{
+		if (cur_layer < 0 || layers[cur_layer].mask) return;
+		const size_t count = (size_t)width_ * height_;
+		layers[cur_layer].mask = new unsigned char[count];
+		forget_saved(layers[cur_layer]);
+		if (sel.active()) sel.read(0, 0, width_, height_, layers[cur_layer].mask);
+		else memset(layers[cur_layer].mask, 255, count);
+		invalidate_layer(cur_layer);
+	}
+
+	void invert_mask()
+	{
+		if (cur_layer < 0 || !layers[cur_layer].mask) return;
+		document_.tiles.load(layers[cur_layer]);
+		unsigned char* mask = layers[cur_layer].mask;
+		parallel_for_rows(height_, composite_tile, [&](const int y0, const int y1)
+		{
+			for (size_t i = (size_t)y0 * width_; i < (size_t)y1 * width_; i++)
+			{
+				mask[i] = 255 - mask[i];
+			}
+		});
+		mark_unsaved(layers[cur_layer], width_, height_, 0, 0, width_, height_);
+		invalidate_layer(cur_layer);
+	}
+
+	// drops the mask, applying it to the layer's alpha first if asked to (groups and adjustments can
+	// only drop theirs)
+	void remove_mask(const bool apply)
+	{
+		if (cur_layer < 0 || !layers[cur_layer].mask) return;
+		layer& l = layers[cur_layer];
+		document_.tiles.load(l);
+		if (apply && paint_pixels())
 		{
-			cur_layer--;
+			const int stride = l.pixel_size(), alpha = l.format == pixel_format::alpha8 ? 0 : 3;
+			parallel_for_rows(height_, composite_tile, [&](const int y0, const int y1)
+			{
+				for (size_t i = (size_t)y0 * width_; i < (size_t)y1 * width_; i++)
+				{
+					if (l.format == pixel_format::rgba16)
+					{
+						uint16_t* p = (uint16_t*)l.pixels + i * 4;
+						p[3] = (uint16_t)((p[3] * l.mask[i] + 127) / 255);
+					}
+					else l.pixels[i * stride + alpha] = mask_alpha(l.pixels[i * stride + alpha], l.mask[i]);
+				}
+			});
 		}
+		invalidate_layer(cur_layer);
+		delete[]l.mask;
+		l.mask = nullptr;
+		forget_saved(l);
 	}
 
+#pragma endregion layers
+
 #pragma region saving/loading
 
-	void save() const
+	// everything flattened into a png, through the export profile. the composite gets brought up to date a
+	// band of rows at a time as the encoder gets to them, and nothing else the size of the canvas is allocated
+	bool export_png(const std::string& path)
 	{
-		stbi_write_bmp("img.bmp", width_, height_, 4, layers[0].pixels);
+		return write_png(path, width_, height_, [&](const int y0, const int y1)
+		{
+			int x0 = 0, top = y0, x1 = width_, bottom = y1;
+			load_tiles(x0, top, x1, bottom);
+			composite(layers, composite_.data(), composite_dirty_.data(), width_, height_, x0, top, x1, bottom, options_);
+			if (x0 < x1 && top < bottom) invalidate_opengl_region(x0, top, x1 - x0, bottom - top);
+		}, [&](const int y, uint8_t* out)
+		{
+			memcpy(out, composite_.data() + (size_t)y * width_ * 4, (size_t)width_ * 4);
+			if (!export_transform_.empty()) export_transform_.apply(out, width_);
+		});
 	}
 
-	void open(const std::string& path)
+	// profiles for the monitor and for saving, an empty path goes back to plain srgb. false if the
+	// profile can't be used, the old one stays then
+	bool set_display_profile(const std::string& path)
 	{
-		int image_width, image_height, channels;
-		const unsigned char* image_data = stbi_load(path.c_str(), &image_width, &image_height, &channels, 4);
-		if (image_data == nullptr || channels != 4)
+		if (!load_transform(path, display_transform_)) return false;
+		invalidate_opengl_texture();
+		return true;
+	}
+
+	bool set_export_profile(const std::string& path)
+	{
+		return load_transform(path, export_transform_);
+	}
+
+	static bool load_transform(const std::string& path, color_transform& transform)
+	{
+		if (path.empty())
 		{
-			pfd::message("Problem", "An error occurred while doing things", pfd::choice::ok, pfd::icon::error);
-			return;
+			transform = color_transform();
+			return true;
 		}
+		icc_profile profile;
+		if (!profile.load(path)) return false;
+		transform = color_transform::between(icc_profile::srgb(), profile);
+		return true;
+	}
+
+	// empty if it was never saved or opened
+	const std::string& document_path() const { return document_.path; }
 
-		for (auto i = 0; i < byte_count(); i += 4)
+	// every layer as it is, nothing gets flattened. saving to the same file again only adds what changed.
+	// the transform and filter being previewed should be applied or dropped first, their pixels aren't in
+	// the layers yet
+	bool save_document(const std::string& path)
+	{
+		return document_.save(path, layers, cur_layer, width_, height_, journal_.last());
+	}
+
+	// finishes up whatever saving left running in the background and autosaves when it's time, once a frame
+	void poll_document()
+	{
+		const bool idle = !stroking_ && !transforming_ && !filtering_;
+		// what's left of an opened document comes in a bit at a time, the autosave waits until it's all there
+		if (idle) document_.tiles.step(layers, 4 << 20);
+		document_.poll(layers, width_, height_);
+		journal_.set_path(autosave_base(document_.path) + ".journal");
+		if (autosave.update(layers, cur_layer, width_, height_, document_.path, journal_.last(), idle && document_.tiles.empty()))
 		{
-			layers[0].pixels[i] = image_data[i];
-			layers[0].pixels[i + 1] = image_data[i + 1];
-			layers[0].pixels[i + 2] = image_data[i + 2];
-			layers[0].pixels[i + 3] = image_data[i + 3];
+			journal_.rotate();
 		}
-		invalidate_opengl_texture();
+	}
+
+	// replaces everything with the document at path, which can be a different size. false (and nothing
+	// changes) if it can't be read
+	bool open_document(const std::string& path)
+	{
+		uint64_t journal;
+		return load_document(path, journal);
+	}
+
+	// whether a crash left an autosave and journal behind for the document at document_path (empty for an
+	// untitled one)
+	static bool can_recover(const std::string& document_path)
+	{
+		const std::string base = autosave_base(document_path);
+		return file_size(base + ".autosave") != 0 && (file_size(base + ".journal") != 0 || file_size(base + ".journal.old") != 0);
+	}
+
+	static void discard_recovery(const std::string& document_path)
+	{
+		remove_journal(autosave_base(document_path) + ".journal");
+	}
+
+	// opens the autosave of the document at document_path and paints the strokes journaled after it again, up
+	// to the first one it can't. the document is the one at document_path afterwards, the next save
+	// replaces all of it
+	bool recover(const std::string& document_path)
+	{
+		const std::string base = autosave_base(document_path);
+		uint64_t checkpoint;
+		if (!load_document(base + ".autosave", checkpoint)) return false;
+		std::vector<journal_stroke> records;
+		read_journal(base + ".journal.old", records);
+		read_journal(base + ".journal", records);
+		std::stable_sort(records.begin(), records.end(), [](const journal_stroke& a, const journal_stroke& b) { return a.seq < b.seq; });
+		replaying_ = true;
+		uint64_t next = checkpoint + 1;
+		for (const journal_stroke& record : records)
+		{
+			if (record.seq < next) continue;
+			// a gap means records went missing, whatever comes after them was painted on something else
+			if (record.seq != next || !replay(record)) break;
+			next++;
+		}
+		replaying_ = false;
+		document_.detach(document_path);
+		autosave.soon();
+		return true;
+	}
+
+	// the document's size changed, everything sized after it starts over
+	void resize(const int width, const int height)
+	{
+		width_ = width;
+		height_ = height;
+		sel.resize(width, height);
+		composite_.assign(byte_count(), 0);
+		composite_dirty_.assign(tile_count(width, height), 1);
+		selection_version_ = -1;
+		invalidate_render_quad();
+		if (texture_ != 0) invalidate_opengl_texture();
+	}
+
+private:
+	bool load_document(const std::string& path, uint64_t& journal)
+	{
+		ImVector<layer> loaded;
+		int loaded_layer = 0, width = 0, height = 0;
+		if (!document_.open(path, loaded, loaded_layer, width, height, journal)) return false;
+		replace_layers(loaded, loaded_layer, width, height);
+		return true;
+	}
+
+	void replace_layers(ImVector<layer>& loaded, const int loaded_layer, const int width, const int height)
+	{
+		// what's journaled for the layers being replaced is no good anymore
+		journal_barrier();
+		autosave.restart();
+		free_layers(layers);
+		layers.swap(loaded);
+		cur_layer = loaded_layer;
+		for (layer& l : layers)
+		{
+			if (l.adjust == layer_adjust::curves) l.lut = color_lut::curves(l.curve, adjust_curve_points);
+		}
+		resize(width, height);
+	}
+
+	// paints a journaled stroke again, false if the layers aren't what it was painted on
+	bool replay(const journal_stroke& record)
+	{
+		int index = 0;
+		while (index < layers.size() && layers[index].id != record.layer_id) index++;
+		if (index == layers.size() || record.samples.empty() || layers_checksum(layers) != record.layers) return false;
+		// strokes with a tip are barriers, a journal from before that says otherwise can't be trusted with it
+		if (record.settings.tip >= 0) return false;
+		cur_layer = index;
+		const journal_sample& first = record.samples[0];
+		if (!begin_stroke(ImVec2(first.x, first.y), first.pressure, record.settings, record.paint, record.linear)) return false;
+		for (size_t i = 1; i < record.samples.size(); i++)
+		{
+			continue_stroke(ImVec2(record.samples[i].x, record.samples[i].y), record.samples[i].pressure);
+		}
+		finish_stroke();
+		return true;
+	}
+
+public:
+	// replaces everything with an untitled document the size of the image at path, the image in its one layer.
+	// pngs are decoded a row at a time straight into the layer, anything else stb_image reads goes through it
+	// first. false (and nothing changes) if it can't be read
+	bool open(const std::string& path)
+	{
+		ImVector<layer> loaded;
+		int width = 0, height = 0;
+		const auto make_layer = [&](const int w, const int h) -> uint8_t*
+		{
+			// byte counts are ints everywhere else
+			if ((size_t)w * h * 4 > INT32_MAX) return nullptr;
+			width = w;
+			height = h;
+			loaded.resize(1);
+			// constructed in place, layers don't survive being copied around byte by byte
+			return (new (&loaded[0]) layer(path.substr(path.find_last_of("/\\") + 1), w * h * 4))->pixels;
+		};
+		if (!read_png(path, make_layer))
+		{
+			free_layers(loaded);
+			int channels;
+			unsigned char* image = stbi_load(path.c_str(), &width, &height, &channels, 4);
+			if (image == nullptr) return false;
+			uint8_t* pixels = make_layer(width, height);
+			if (pixels != nullptr) memcpy(pixels, image, (size_t)width * height * 4);
+			stbi_image_free(image);
+			if (pixels == nullptr) return false;
+		}
+		document_.tiles.clear();
+		replace_layers(loaded, 0, width, height);
+		document_.detach(std::string());
+		return true;
 	}
 
 #pragma endregion saving/loading
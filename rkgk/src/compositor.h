@@ -0,0 +1,430 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "imgui/imgui.h"
+#include "blend.h"
+#include "filter.h"
+#include "layer.h"
+#include "parallel.h"
+#include "selection.h"
+
+constexpr int composite_tile = 64;
+
+// document wide settings for how the layers come together
+struct composite_options
+{
+	// 16-bit layers get ordered dither going down to the 8-bit composite
+	bool dither = true;
+	// layers mix in linear light
+	bool linear = false;
+};
+
+// Full is the channel's 1, 255 for srgb bytes and 65535 in linear light
+template <int Full = 255>
+inline int blend_channel(const layer_blend mode, const int below, const int above)
+{
+	switch (mode)
+	{
+	case layer_blend::multiply:
+		return (int)((uint32_t)below * above / Full);
+	case layer_blend::screen:
+		return below + above - (int)((uint32_t)below * above / Full);
+	case layer_blend::add:
+		return std::min(Full, below + above);
+	default:
+		return above;
+	}
+}
+
+// a run of a layer onto what's below it, straight alpha, with the layer's alpha limited per pixel by
+// weights if there are any (its mask and what it's clipped to). where both are opaque it's just the
+// blend mode, where either is transparent the other shows through as is. in linear light the blend
+// modes work on amounts of light, so multiply and screen are the physical filters and add really adds
+inline void composite_span(uint8_t* dst, const uint8_t* src, const int count, const uint8_t opacity, const layer_blend mode,
+	const uint8_t* weights = nullptr, const bool linear = false)
+{
+	if (mode == layer_blend::normal)
+	{
+		over_span(dst, src, count, opacity, weights, linear);
+		return;
+	}
+	const srgb_tables& t = srgb();
+	for (int i = 0; i < count; i++, dst += 4, src += 4)
+	{
+		int src_a = src[3] * opacity / 255;
+		if (weights) src_a = mask_alpha((uint8_t)src_a, weights[i]);
+		if (src_a == 0) continue;
+		const int dst_a = dst[3];
+		const int out_a = src_a + dst_a * (255 - src_a) / 255;
+		for (int c = 0; c < 3; c++)
+		{
+			if (linear)
+			{
+				const int s = t.to_linear[src[c]], d = t.to_linear[dst[c]];
+				const int64_t mixed = (int64_t)src_a * (255 - dst_a) * s + (int64_t)src_a * dst_a * blend_channel<65535>(mode, d, s)
+					+ (int64_t)(255 - src_a) * dst_a * d;
+				dst[c] = t.from_linear[std::min<int64_t>(65535, mixed / (255 * out_a)) >> 4];
+				continue;
+			}
+			const int mixed = src_a * (255 - dst_a) * src[c] + src_a * dst_a * blend_channel(mode, dst[c], src[c]) + (255 - src_a) * dst_a * dst[c];
+			dst[c] = (uint8_t)std::min(255, mixed / (255 * out_a));
+		}
+		dst[3] = (uint8_t)out_a;
+	}
+}
+
+// whether a box of a mask is all hidden, all shown or a mix. checked per tile while compositing, it's a
+// few hundred compares against blending thousands of pixels
+inline coverage mask_coverage(const uint8_t* mask, const int width, const int x0, const int y0, const int w, const int h)
+{
+	const uint8_t value = mask[(size_t)y0 * width + x0];
+	if (value != 0 && value != 255) return coverage::partial;
+	const uint64_t all = 0x0101010101010101ull * value;
+	for (int y = y0; y < y0 + h; y++)
+	{
+		const uint8_t* row = mask + (size_t)y * width + x0;
+		int x = 0;
+		for (; x + 8 <= w; x += 8)
+		{
+			uint64_t v;
+			memcpy(&v, row + x, 8);
+			if (v != all) return coverage::partial;
+		}
+		for (; x < w; x++)
+		{
+			if (row[x] != value) return coverage::partial;
+		}
+	}
+	return value ? coverage::all : coverage::none;
+}
+
+// per pixel weights of a clipped layer, the alpha of the layer it's clipped to through that one's mask,
+// and then through its own mask. either mask can be null, base_alpha points at the first alpha and
+// they're stride bytes apart
+inline void clip_weights(uint8_t* out, const uint8_t* base_alpha, const int stride, const uint8_t* base_mask, const uint8_t* mask, const int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		uint8_t a = base_alpha[i * stride];
+		if (base_mask) a = mask_alpha(a, base_mask[i]);
+		if (mask) a = mask_alpha(a, mask[i]);
+		out[i] = a;
+	}
+}
+
+// the group directly holding a layer, -1 for the top level
+inline int parent_layer(const ImVector<layer>& layers, const int index)
+{
+	for (int i = index + 1; i < layers.size(); i++)
+	{
+		if (layers[i].depth < layers[index].depth) return i;
+	}
+	return -1;
+}
+
+// first of the layers inside a group (or past the end of the group if it's empty)
+inline int group_begin(const ImVector<layer>& layers, const int group)
+{
+	int i = group;
+	while (i > 0 && layers[i - 1].depth > layers[group].depth) i--;
+	return i;
+}
+
+inline int tile_count(const int width, const int height)
+{
+	return ((width + composite_tile - 1) / composite_tile) * ((height + composite_tile - 1) / composite_tile);
+}
+
+// marks [x0, x1) * [y0, y1) out of date in everything a layer shows up in: the adjustments above it,
+// the groups it's in and the document's composite. groups next to it keep their caches, and so do
+// adjustments below it. blurs spread the change as far as they reach to everything above them
+inline void mark_dirty(ImVector<layer>& layers, const int index, uint8_t* root_dirty, const int width, const int height,
+	int x0, int y0, int x1, int y1)
+{
+	const int tiles_x = (width + composite_tile - 1) / composite_tile;
+	const auto mark = [&](uint8_t* dirty)
+	{
+		const int cx0 = std::max(0, x0), cy0 = std::max(0, y0);
+		const int cx1 = std::min(width, x1), cy1 = std::min(height, y1);
+		if (cx0 >= cx1 || cy0 >= cy1) return;
+		const int tx0 = cx0 / composite_tile, tx1 = (cx1 - 1) / composite_tile;
+		for (int ty = cy0 / composite_tile; ty <= (cy1 - 1) / composite_tile; ty++)
+		{
+			memset(dirty + ty * tiles_x + tx0, 1, tx1 - tx0 + 1);
+		}
+	};
+	for (int node = index;;)
+	{
+		const int parent = parent_layer(layers, node);
+		for (int i = node + 1; i < (parent == -1 ? layers.size() : parent); i++)
+		{
+			layer& l = layers[i];
+			if (l.depth != layers[node].depth || l.adjust == layer_adjust::none) continue;
+			if (l.adjust == layer_adjust::blur)
+			{
+				const int reach = blur_reach(l.radius);
+				x0 -= reach;
+				y0 -= reach;
+				x1 += reach;
+				y1 += reach;
+			}
+			mark(l.dirty);
+		}
+		if (parent == -1) break;
+		mark(layers[parent].dirty);
+		node = parent;
+	}
+	mark(root_dirty);
+}
+
+// composites the visible layers of [begin, end) that are at depth into one tile, bringing the tiles of
+// the groups and adjustments among them up to date first. out points at the tile's top left corner and
+// is stride pixels wide
+inline void composite_group_tile(ImVector<layer>& layers, const int begin, const int end, const int depth,
+	uint8_t* out, const int stride, const int width, const int height, const int tx, const int ty, const composite_options& options)
+{
+	const int x0 = tx * composite_tile, y0 = ty * composite_tile;
+	const int w = std::min(composite_tile, width - x0), h = std::min(composite_tile, height - y0);
+	for (int y = 0; y < h; y++)
+	{
+		memset(out + (size_t)y * stride * 4, 0, (size_t)w * 4);
+	}
+
+	const int t = ty * ((width + composite_tile - 1) / composite_tile) + tx;
+	// the last unclipped layer, what the clipped ones above it show through
+	int base = -1;
+	coverage base_coverage = coverage::none;
+	uint8_t weights[composite_tile];
+	for (int i = begin; i < end; i++)
+	{
+		layer& l = layers[i];
+		if (l.depth != depth) continue;
+		const bool clipped = l.clip && base != -1;
+		if (!l.clip || base == -1)
+		{
+			base = i;
+			base_coverage = !l.visible || l.opacity == 0 ? coverage::none
+				: l.mask ? mask_coverage(l.mask, width, x0, y0, w, h) : coverage::all;
+		}
+		if (!l.visible || l.opacity == 0) continue;
+		if (clipped && base_coverage == coverage::none) continue;
+		const coverage mask = l.mask ? mask_coverage(l.mask, width, x0, y0, w, h) : coverage::all;
+		if (mask == coverage::none) continue;
+
+		if (l.group && l.dirty[t])
+		{
+			composite_group_tile(layers, group_begin(layers, i), i, depth + 1, l.pixels + ((size_t)y0 * width + x0) * 4, width, width, height, tx, ty, options);
+			l.dirty[t] = 0;
+		}
+		if (l.adjust != layer_adjust::none && l.dirty[t])
+		{
+			// blurs need more than this tile and are done up front by update_blurs, one that wasn't
+			// needed there lets everything through as is
+			if (l.adjust == layer_adjust::blur) continue;
+			for (int y = 0; y < h; y++)
+			{
+				uint8_t* cached = l.pixels + ((size_t)(y0 + y) * width + x0) * 4;
+				memcpy(cached, out + (size_t)y * stride * 4, (size_t)w * 4);
+				if (l.adjust == layer_adjust::curves) l.lut.apply(cached, w);
+				else hsl_span(cached, w, l.hsl);
+			}
+			l.dirty[t] = 0;
+		}
+
+		const layer& b = layers[base];
+		for (int y = 0; y < h; y++)
+		{
+			uint8_t* dst = out + (size_t)y * stride * 4;
+			const size_t offset = ((size_t)(y0 + y) * width + x0) * 4;
+			const size_t mask_offset = (size_t)(y0 + y) * width + x0;
+			const uint8_t* mask_row = mask == coverage::partial ? l.mask + mask_offset : nullptr;
+			const uint8_t* row_weights = mask_row;
+			if (clipped)
+			{
+				// the high byte of a 16-bit alpha is close enough for a weight
+				const uint8_t* base_alpha = b.pixels + mask_offset * b.pixel_size() + b.pixel_size() - 1;
+				clip_weights(weights, base_alpha, b.pixel_size(), base_coverage == coverage::partial ? b.mask + mask_offset : nullptr, mask_row, w);
+				row_weights = weights;
+			}
+			if (l.format == pixel_format::alpha8 && l.blend == layer_blend::normal)
+			{
+				over_tint_span(dst, l.pixels + mask_offset, l.tint, w, l.opacity, row_weights, options.linear);
+			}
+			else if (l.format == pixel_format::rgba16)
+			{
+				uint8_t narrowed[composite_tile * 4];
+				narrow_span((const uint16_t*)l.pixels + mask_offset * 4, narrowed, w, x0, y0 + y, options.dither);
+				composite_span(dst, narrowed, w, l.opacity, l.blend, row_weights, options.linear);
+			}
+			else if (l.format == pixel_format::alpha8)
+			{
+				uint8_t tinted[composite_tile * 4];
+				for (int x = 0; x < w; x++)
+				{
+					tinted[x * 4] = l.tint.r;
+					tinted[x * 4 + 1] = l.tint.g;
+					tinted[x * 4 + 2] = l.tint.b;
+					tinted[x * 4 + 3] = l.pixels[mask_offset + x];
+				}
+				composite_span(dst, tinted, w, l.opacity, l.blend, row_weights, options.linear);
+			}
+			else if (l.adjust == layer_adjust::none)
+			{
+				composite_span(dst, l.pixels + offset, w, l.opacity, l.blend, row_weights, options.linear);
+			}
+			else if (row_weights == nullptr && l.opacity == 255)
+			{
+				memcpy(dst, l.pixels + offset, (size_t)w * 4);
+			}
+			else
+			{
+				// adjustments fade between what's below and the adjusted version of it
+				uint8_t fade[composite_tile];
+				for (int x = 0; x < w; x++)
+				{
+					fade[x] = row_weights ? mask_alpha(l.opacity, row_weights[x]) : l.opacity;
+				}
+				lerp_span(dst, l.pixels + offset, fade, w);
+			}
+		}
+	}
+}
+
+// blur adjustments can't go a tile at a time like everything else, each tile of one needs what's below
+// it as far as the blur reaches. the tiles of them that compositing the needed tiles will run into are
+// brought up to date here first, bottom to top so any a blur needs from another one below it are ready
+inline void update_blurs(ImVector<layer>& layers, const std::vector<uint8_t>& needed, const int width, const int height, const composite_options& options)
+{
+	const int tiles_x = (width + composite_tile - 1) / composite_tile, tiles_y = (height + composite_tile - 1) / composite_tile;
+	std::vector<int> blurs;
+	for (int i = 0; i < layers.size(); i++)
+	{
+		if (layers[i].adjust != layer_adjust::blur) continue;
+		bool shown = layers[i].visible;
+		for (int group = parent_layer(layers, i); group != -1 && shown; group = parent_layer(layers, group))
+		{
+			shown = layers[group].visible;
+		}
+		if (shown) blurs.push_back(i);
+	}
+	if (blurs.empty()) return;
+
+	// each blur needs the tiles being composited, plus as far as every blur above it reaches
+	std::vector<std::vector<uint8_t>> wanted(blurs.size());
+	std::vector<uint8_t> grown = needed;
+	for (int k = (int)blurs.size(); k-- > 0;)
+	{
+		wanted[k] = grown;
+		const int reach = (blur_reach(layers[blurs[k]].radius) + composite_tile - 1) / composite_tile;
+		std::vector<uint8_t> next(grown.size());
+		for (int ty = 0; ty < tiles_y; ty++)
+		{
+			for (int tx = 0; tx < tiles_x; tx++)
+			{
+				if (!grown[ty * tiles_x + tx]) continue;
+				for (int y = std::max(0, ty - reach); y <= std::min(tiles_y - 1, ty + reach); y++)
+				{
+					memset(next.data() + y * tiles_x + std::max(0, tx - reach), 1, std::min(tiles_x - 1, tx + reach) - std::max(0, tx - reach) + 1);
+				}
+			}
+		}
+		grown.swap(next);
+	}
+
+	for (int k = 0; k < (int)blurs.size(); k++)
+	{
+		layer& l = layers[blurs[k]];
+		int tx0 = tiles_x, ty0 = tiles_y, tx1 = -1, ty1 = -1;
+		for (int t = 0; t < tiles_x * tiles_y; t++)
+		{
+			if (!wanted[k][t] || !l.dirty[t]) continue;
+			tx0 = std::min(tx0, t % tiles_x);
+			ty0 = std::min(ty0, t / tiles_x);
+			tx1 = std::max(tx1, t % tiles_x);
+			ty1 = std::max(ty1, t / tiles_x);
+		}
+		if (tx1 < 0) continue;
+
+		// what's below the blur over the tiles it needs, and as far around them as it reaches
+		const int reach = (blur_reach(l.radius) + composite_tile - 1) / composite_tile;
+		const int sx0 = std::max(0, tx0 - reach), sy0 = std::max(0, ty0 - reach);
+		const int sx1 = std::min(tiles_x - 1, tx1 + reach), sy1 = std::min(tiles_y - 1, ty1 + reach);
+		const int rx = sx0 * composite_tile, ry = sy0 * composite_tile;
+		const int rw = std::min(width, (sx1 + 1) * composite_tile) - rx, rh = std::min(height, (sy1 + 1) * composite_tile) - ry;
+		std::vector<uint8_t> region((size_t)rw * rh * 4);
+		const int parent = parent_layer(layers, blurs[k]);
+		const int scope = parent == -1 ? 0 : group_begin(layers, parent);
+		const int columns = sx1 - sx0 + 1;
+		parallel_for(columns * (sy1 - sy0 + 1), [&](const int first, const int last)
+		{
+			for (int i = first; i < last; i++)
+			{
+				const int tx = sx0 + i % columns, ty = sy0 + i / columns;
+				uint8_t* tile = region.data() + ((size_t)(ty * composite_tile - ry) * rw + tx * composite_tile - rx) * 4;
+				composite_group_tile(layers, scope, blurs[k], l.depth, tile, rw, width, height, tx, ty, options);
+			}
+		});
+		gaussian_blur(region.data(), region.data(), rw, rh, l.radius);
+
+		for (int ty = ty0; ty <= ty1; ty++)
+		{
+			for (int tx = tx0; tx <= tx1; tx++)
+			{
+				const int t = ty * tiles_x + tx;
+				if (!wanted[k][t] || !l.dirty[t]) continue;
+				const int x = tx * composite_tile, w = std::min(composite_tile, width - x);
+				for (int y = ty * composite_tile; y < std::min(height, (ty + 1) * composite_tile); y++)
+				{
+					memcpy(l.pixels + ((size_t)y * width + x) * 4, region.data() + ((size_t)(y - ry) * rw + x - rx) * 4, (size_t)w * 4);
+				}
+				l.dirty[t] = 0;
+			}
+		}
+	}
+}
+
+// redoes the dirty tiles of the document's composite that touch [x0, x1) * [y0, y1), the rest stay
+// dirty until they're wanted. returns the box that was redone in the same variables (empty if none were)
+inline void composite(ImVector<layer>& layers, uint8_t* out, uint8_t* dirty, const int width, const int height,
+	int& x0, int& y0, int& x1, int& y1, const composite_options& options = composite_options())
+{
+	const int tiles_x = (width + composite_tile - 1) / composite_tile;
+	const int tiles = tile_count(width, height);
+	// an empty box left of or above the document would round its last tile up to the first one
+	const bool empty = x1 <= std::max(0, x0) || y1 <= std::max(0, y0);
+	const int want_x0 = std::max(0, x0) / composite_tile, want_y0 = std::max(0, y0) / composite_tile;
+	const int want_x1 = (std::min(width, x1) - 1) / composite_tile, want_y1 = (std::min(height, y1) - 1) / composite_tile;
+	x0 = width;
+	y0 = height;
+	x1 = y1 = 0;
+	if (empty) return;
+	std::vector<int> todo;
+	std::vector<uint8_t> needed(tiles);
+	for (int t = 0; t < tiles; t++)
+	{
+		const int tx = t % tiles_x, ty = t / tiles_x;
+		if (!dirty[t] || tx < want_x0 || tx > want_x1 || ty < want_y0 || ty > want_y1) continue;
+		todo.push_back(t);
+		needed[t] = 1;
+		x0 = std::min(x0, tx * composite_tile);
+		y0 = std::min(y0, ty * composite_tile);
+		x1 = std::max(x1, std::min(width, (tx + 1) * composite_tile));
+		y1 = std::max(y1, std::min(height, (ty + 1) * composite_tile));
+	}
+	if (todo.empty()) return;
+	update_blurs(layers, needed, width, height, options);
+
+	parallel_for((int)todo.size(), [&](const int first, const int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			const int t = todo[i];
+			const int tx = t % tiles_x, ty = t / tiles_x;
+			composite_group_tile(layers, 0, layers.size(), 0, out + ((size_t)ty * composite_tile * width + tx * composite_tile) * 4, width, width, height, tx, ty, options);
+			dirty[t] = 0;
+		}
+	});
+}
@@ -0,0 +1,955 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN 1
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "imgui/imgui.h"
+#include "compositor.h"
+#include "layer.h"
+#include "parallel.h"
+
+// a whole file mapped in read only, the os pages in what gets touched
+struct mapped_file
+{
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+
+	mapped_file() = default;
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+	~mapped_file() { close(); }
+
+	bool open(const std::string& path)
+	{
+		close();
+#ifdef _WIN32
+		file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file_ == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER length;
+		if (!GetFileSizeEx(file_, &length) || length.QuadPart == 0)
+		{
+			close();
+			return false;
+		}
+		size = (size_t)length.QuadPart;
+		mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping_ != nullptr) data = (const uint8_t*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+#else
+		const int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat info;
+		if (fstat(fd, &info) == 0 && info.st_size > 0)
+		{
+			size = (size_t)info.st_size;
+			void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (view != MAP_FAILED) data = (const uint8_t*)view;
+		}
+		::close(fd);
+#endif
+		if (data == nullptr)
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (data != nullptr) UnmapViewOfFile(data);
+		if (mapping_ != nullptr) CloseHandle(mapping_);
+		if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+		mapping_ = nullptr;
+		file_ = INVALID_HANDLE_VALUE;
+#else
+		if (data != nullptr) munmap((void*)data, size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE file_ = INVALID_HANDLE_VALUE, mapping_ = nullptr;
+#endif
+};
+
+// rename that's allowed to replace what's there, so a file is only ever the old or the new one
+inline bool replace_file(const std::string& from, const std::string& to)
+{
+#ifdef _WIN32
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// .rkgk documents. a header pointing at the index at the end of the file, then every layer's tiles on their
+// own so nothing has to be flattened to save and only the tiles that are needed have to be read. the index
+// has the layers' settings and a tile_ref per tile of their pixels (and mask). everything little endian
+struct document_header
+{
+	char magic[4] = { 'R', 'K', 'G', 'K' };
+	uint32_t version = 2;
+	uint64_t index_offset = 0, index_size = 0;
+};
+
+constexpr int document_tile = composite_tile;
+
+inline bool same_pixel(const uint8_t* a, const uint8_t* b, const int size)
+{
+	if (size == 4) return *(const uint32_t*)a == *(const uint32_t*)b;
+	if (size == 8) return *(const uint64_t*)a == *(const uint64_t*)b;
+	return *a == *b;
+}
+
+// runs of a pixel repeated are a byte of 127 + count (2 to 128) and the pixel, anything else a byte of
+// count - 1 (up to 128) and that many pixels as they are. soft brushes don't give it many runs but flat
+// color and empty space do, and it goes both ways fast enough to keep up with the disk
+inline void encode_tile(const uint8_t* pixels, const int width, const int height, const int tx, const int ty, const int size,
+	std::vector<uint8_t>& out, tile_ref& ref)
+{
+	const int x0 = tx * document_tile, y0 = ty * document_tile;
+	const int w = std::min(document_tile, width - x0), h = std::min(document_tile, height - y0);
+	const size_t stride = (size_t)width * size;
+	const uint8_t* first = pixels + y0 * stride + (size_t)x0 * size;
+	bool solid = true;
+	for (int y = 0; y < h && solid; y++)
+	{
+		const uint8_t* row = first + y * stride;
+		for (int x = 0; x < w; x++)
+		{
+			if (!same_pixel(row + x * size, first, size))
+			{
+				solid = false;
+				break;
+			}
+		}
+	}
+	out.clear();
+	if (solid)
+	{
+		ref.offset = 0;
+		ref.size = 0;
+		memcpy(&ref.offset, first, size);
+		return;
+	}
+
+	for (int y = 0; y < h; y++)
+	{
+		const uint8_t* row = first + y * stride;
+		int x = 0;
+		while (x < w)
+		{
+			int run = 1;
+			while (x + run < w && run < 128 && same_pixel(row + (x + run) * size, row + x * size, size)) run++;
+			if (run > 1)
+			{
+				out.push_back((uint8_t)(127 + run));
+				out.insert(out.end(), row + x * size, row + (x + 1) * size);
+				x += run;
+				continue;
+			}
+			int literal = 1;
+			while (x + literal < w && literal < 128
+				&& !(x + literal + 1 < w && same_pixel(row + (x + literal) * size, row + (x + literal + 1) * size, size))) literal++;
+			out.push_back((uint8_t)(literal - 1));
+			out.insert(out.end(), row + x * size, row + (x + literal) * size);
+			x += literal;
+		}
+	}
+	ref.size = (uint32_t)out.size();
+}
+
+// false if the data doesn't fill the tile exactly, a damaged file
+inline bool decode_tile(const tile_ref& ref, const uint8_t* data, uint8_t* pixels, const int width, const int height,
+	const int tx, const int ty, const int size)
+{
+	const int x0 = tx * document_tile, y0 = ty * document_tile;
+	const int w = std::min(document_tile, width - x0), h = std::min(document_tile, height - y0);
+	const size_t stride = (size_t)width * size;
+	uint8_t* first = pixels + y0 * stride + (size_t)x0 * size;
+	if (ref.size == 0)
+	{
+		uint8_t pixel[8];
+		memcpy(pixel, &ref.offset, 8);
+		for (int y = 0; y < h; y++)
+		{
+			uint8_t* row = first + y * stride;
+			if (size == 1) memset(row, pixel[0], w);
+			else for (int x = 0; x < w; x++) memcpy(row + x * size, pixel, size);
+		}
+		return true;
+	}
+
+	const uint8_t* in = data + ref.offset;
+	const uint8_t* end = in + ref.size;
+	for (int y = 0; y < h; y++)
+	{
+		uint8_t* row = first + y * stride;
+		int x = 0;
+		while (x < w)
+		{
+			if (in >= end) return false;
+			const int control = *in++;
+			const int count = control >= 128 ? control - 127 : control + 1;
+			if (x + count > w) return false;
+			if (control >= 128)
+			{
+				if (end - in < size) return false;
+				if (size == 1) memset(row + x, *in, count);
+				else for (int i = 0; i < count; i++) memcpy(row + (x + i) * size, in, size);
+				in += size;
+			}
+			else
+			{
+				if (end - in < count * size) return false;
+				memcpy(row + x * size, in, (size_t)count * size);
+				in += count * size;
+			}
+			x += count;
+		}
+	}
+	return in == end;
+}
+
+// the index is written and read a field at a time so there's no padding or struct layout in the file
+struct index_writer
+{
+	std::vector<uint8_t> bytes;
+
+	template <typename T>
+	void put(const T& value)
+	{
+		const uint8_t* p = (const uint8_t*)&value;
+		bytes.insert(bytes.end(), p, p + sizeof(T));
+	}
+
+	void put_string(const std::string& s)
+	{
+		put((uint32_t)s.size());
+		bytes.insert(bytes.end(), s.begin(), s.end());
+	}
+};
+
+struct index_reader
+{
+	const uint8_t* pos;
+	const uint8_t* end;
+	bool ok = true;
+
+	template <typename T>
+	T get()
+	{
+		T value = T();
+		if (end - pos < (ptrdiff_t)sizeof(T)) ok = false;
+		else memcpy(&value, pos, sizeof(T));
+		if (ok) pos += sizeof(T);
+		return value;
+	}
+
+	std::string get_string()
+	{
+		const uint32_t length = get<uint32_t>();
+		if (!ok || (size_t)(end - pos) < length)
+		{
+			ok = false;
+			return std::string();
+		}
+		std::string s((const char*)pos, length);
+		pos += length;
+		return s;
+	}
+};
+
+// layers that have pixels of their own to save, groups and adjustments only have caches
+template <typename Settings>
+bool stores_pixels(const Settings& l)
+{
+	return !l.group && l.adjust == layer_adjust::none;
+}
+
+inline void write_layer_settings(index_writer& index, const layer& l)
+{
+	index.put((int32_t)l.id);
+	index.put_string(l.name);
+	index.put(l.opacity);
+	index.put((uint8_t)l.visible);
+	index.put((uint8_t)l.blend);
+	index.put((uint8_t)l.group);
+	index.put((int32_t)l.depth);
+	index.put((uint8_t)l.clip);
+	index.put((uint8_t)l.format);
+	index.put(l.tint);
+	index.put((uint8_t)l.adjust);
+	for (const float point : l.curve) index.put(point);
+	index.put(l.hsl.hue);
+	index.put(l.hsl.saturation);
+	index.put(l.hsl.lightness);
+	index.put(l.radius);
+	index.put((uint8_t)(l.mask != nullptr));
+}
+
+
+// what of a layer goes in the index, for reading one without making a layer
+struct layer_settings
+{
+	std::string name;
+	int id = 0;
+	unsigned char opacity = 255;
+	bool visible = true;
+	layer_blend blend = layer_blend::normal;
+	bool group = false;
+	int depth = 0;
+	bool clip = false;
+	pixel_format format = pixel_format::rgba8;
+	color tint;
+	layer_adjust adjust = layer_adjust::none;
+	float curve[adjust_curve_points] = {};
+	hsl_shift hsl;
+	float radius = 0;
+};
+
+// the other way, into a layer or layer_settings, false if they don't make sense. whether a mask's tiles follow
+// the pixels' goes in has_mask
+template <typename Settings>
+bool read_layer_settings(index_reader& index, Settings& l, bool& has_mask)
+{
+	l.id = index.get<int32_t>();
+	l.name = index.get_string();
+	l.opacity = index.get<uint8_t>();
+	l.visible = index.get<uint8_t>() != 0;
+	const uint8_t blend = index.get<uint8_t>();
+	l.group = index.get<uint8_t>() != 0;
+	l.depth = index.get<int32_t>();
+	l.clip = index.get<uint8_t>() != 0;
+	const uint8_t format = index.get<uint8_t>();
+	l.tint = index.get<color>();
+	const uint8_t adjust = index.get<uint8_t>();
+	for (float& point : l.curve) point = index.get<float>();
+	l.hsl.hue = index.get<float>();
+	l.hsl.saturation = index.get<float>();
+	l.hsl.lightness = index.get<float>();
+	l.radius = index.get<float>();
+	has_mask = index.get<uint8_t>() != 0;
+	if (!index.ok || (l.depth < 0) || blend > (uint8_t)layer_blend::add || format > (uint8_t)pixel_format::rgba16 || adjust > (uint8_t)layer_adjust::blur) return false;
+	l.blend = (layer_blend)blend;
+	l.format = (pixel_format)format;
+	l.adjust = (layer_adjust)adjust;
+	return true;
+}
+
+// what a layer's unsaved bytes say changed since: the last save of the document, the last autosave
+constexpr uint8_t unsaved_document = 1, unsaved_autosave = 2;
+
+// tiles of a layer that changed in [x0, x1) * [y0, y1), for the next save and autosave to pick up
+inline void mark_unsaved(const layer& l, const int width, const int height, int x0, int y0, int x1, int y1)
+{
+	if (l.unsaved == nullptr) return;
+	x0 = std::max(0, x0);
+	y0 = std::max(0, y0);
+	x1 = std::min(width, x1);
+	y1 = std::min(height, y1);
+	if (x0 >= x1 || y0 >= y1) return;
+	const int tiles_x = (width + document_tile - 1) / document_tile;
+	const int tx0 = x0 / document_tile, tx1 = (x1 - 1) / document_tile;
+	for (int ty = y0 / document_tile; ty <= (y1 - 1) / document_tile; ty++)
+	{
+		memset(l.unsaved + ty * tiles_x + tx0, unsaved_document | unsaved_autosave, tx1 - tx0 + 1);
+	}
+}
+
+// the next save writes all of the layer, after its pixels were swapped for new ones or its mask came or went
+inline void forget_saved(layer& l)
+{
+	delete[]l.saved;
+	delete[]l.unsaved;
+	l.saved = nullptr;
+	l.unsaved = nullptr;
+}
+
+inline void free_layers(ImVector<layer>& layers)
+{
+	for (layer& l : layers)
+	{
+		delete[]l.pixels;
+		delete[]l.dirty;
+		delete[]l.mask;
+		forget_saved(l);
+	}
+	layers.clear();
+}
+
+// makes sure what was written is on the disk before anything that points at it is
+inline bool flush_file(FILE* file)
+{
+	if (fflush(file) != 0) return false;
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+inline uint64_t file_size(const std::string& path)
+{
+#ifdef _WIN32
+	struct _stat64 info;
+	return _stat64(path.c_str(), &info) == 0 ? (uint64_t)info.st_size : 0;
+#else
+	struct stat info;
+	return stat(path.c_str(), &info) == 0 ? (uint64_t)info.st_size : 0;
+#endif
+}
+
+inline bool read_header(const mapped_file& file, document_header& header)
+{
+	if (file.size < sizeof(header)) return false;
+	memcpy(&header, file.data, sizeof(header));
+	return memcmp(header.magic, document_header().magic, 4) == 0 && header.version == document_header().version
+		&& header.index_offset <= file.size && file.size - header.index_offset >= header.index_size;
+}
+
+// appends the tiles of one layer's pixels (or mask) that changed (all of them without changed) and points their
+// refs at them. they're encoded in parallel a batch at a time and written in order, so only a batch of them is
+// ever held on to
+inline bool write_tiles(FILE* file, uint64_t& offset, const uint8_t* pixels, const int width, const int height, const int size,
+	tile_ref* refs, const uint8_t* changed)
+{
+	const int tiles_x = (width + document_tile - 1) / document_tile, count = tile_count(width, height);
+	std::vector<int> todo;
+	for (int i = 0; i < count; i++)
+	{
+		if (changed == nullptr || (changed[i] & unsaved_document)) todo.push_back(i);
+	}
+	const int batch = std::max(1, (int)std::thread::hardware_concurrency()) * 256;
+	std::vector<std::vector<uint8_t>> blobs(std::min<size_t>(batch, todo.size()));
+	for (size_t first = 0; first < todo.size(); first += batch)
+	{
+		const int n = (int)std::min<size_t>(batch, todo.size() - first);
+		parallel_for(n, [&](const int begin, const int end)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				const int tile = todo[first + i];
+				encode_tile(pixels, width, height, tile % tiles_x, tile / tiles_x, size, blobs[i], refs[tile]);
+			}
+		});
+		for (int i = 0; i < n; i++)
+		{
+			tile_ref& ref = refs[todo[first + i]];
+			if (ref.size == 0) continue;
+			if (fwrite(blobs[i].data(), 1, blobs[i].size(), file) != blobs[i].size()) return false;
+			ref.offset = offset;
+			offset += blobs[i].size();
+		}
+	}
+	return true;
+}
+
+// appends the tiles that changed since the last save (or all of them) and an index of everything after them,
+// keeping track of where they went in the layers. header gets pointed at the index. journal is the last stroke
+// journal record the layers have in them
+inline bool append_document(FILE* file, uint64_t& offset, ImVector<layer>& layers, const int cur_layer, const int width, const int height,
+	const uint64_t journal, const bool everything, document_header& header)
+{
+	const int count = tile_count(width, height);
+	index_writer index;
+	index.put((int32_t)width);
+	index.put((int32_t)height);
+	index.put((int32_t)document_tile);
+	index.put((int32_t)layers.size());
+	index.put((int32_t)cur_layer);
+	index.put(journal);
+	for (layer& l : layers)
+	{
+		write_layer_settings(index, l);
+		if (!stores_pixels(l)) continue;
+		const uint8_t* changed = everything || l.saved == nullptr ? nullptr : l.unsaved;
+		if (l.saved == nullptr) l.saved = new tile_ref[(size_t)count * 2];
+		if (l.unsaved == nullptr)
+		{
+			// whatever the autosave had of it is out of date too
+			l.unsaved = new unsigned char[count];
+			memset(l.unsaved, unsaved_autosave, count);
+		}
+		if (!write_tiles(file, offset, l.pixels, width, height, l.pixel_size(), l.saved, changed)) return false;
+		index.bytes.insert(index.bytes.end(), (const uint8_t*)l.saved, (const uint8_t*)(l.saved + count));
+		if (l.mask == nullptr) continue;
+		if (!write_tiles(file, offset, l.mask, width, height, 1, l.saved + count, changed)) return false;
+		index.bytes.insert(index.bytes.end(), (const uint8_t*)(l.saved + count), (const uint8_t*)(l.saved + count * 2));
+	}
+	header.index_offset = offset;
+	header.index_size = index.bytes.size();
+	if (fwrite(index.bytes.data(), 1, index.bytes.size(), file) != index.bytes.size()) return false;
+	offset += index.bytes.size();
+	return true;
+}
+
+// a layer's tile refs out of the index, false if any of them points past the end of the file
+inline bool read_refs(index_reader& index, const size_t file_size, tile_ref* refs, const int count)
+{
+	if ((size_t)(index.end - index.pos) < (size_t)count * sizeof(tile_ref)) return false;
+	memcpy(refs, index.pos, (size_t)count * sizeof(tile_ref));
+	index.pos += (size_t)count * sizeof(tile_ref);
+	for (int i = 0; i < count; i++)
+	{
+		if (refs[i].size != 0 && (refs[i].offset > file_size || file_size - refs[i].offset < refs[i].size)) return false;
+	}
+	return true;
+}
+
+// the tiles of an opened document that aren't in its layers yet. opening only reads the index, a tile is
+// decoded out of the mapped file the first time something needs its pixels and the rest come in a batch at
+// a time between frames, then the file is let go. a damaged tile comes out transparent. it keeps its own
+// copy of where they are, saving and compacting move the layers' refs around
+struct document_tiles
+{
+	document_tiles() = default;
+	document_tiles(const document_tiles&) = delete;
+	document_tiles& operator=(const document_tiles&) = delete;
+
+	// takes over file for layers that were just read out of it and have their tiles' refs in saved
+	void start(std::unique_ptr<mapped_file> file, const ImVector<layer>& layers, const int width, const int height)
+	{
+		clear();
+		width_ = width;
+		height_ = height;
+		const int count = tile_count(width, height);
+		for (const layer& l : layers)
+		{
+			if (l.saved == nullptr) continue;
+			layer_tiles& left = left_[l.id];
+			left.refs.assign(l.saved, l.saved + (l.mask ? count * 2 : count));
+			left.tiles.assign(count, l.mask ? 3 : 1);
+			left.count = count;
+		}
+		if (!left_.empty()) file_ = std::move(file);
+	}
+
+	void clear()
+	{
+		left_.clear();
+		file_.reset();
+	}
+
+	bool empty() const { return left_.empty(); }
+
+	// whether some of the layer is still in the file
+	bool pending(const layer& l) const { return left_.find(l.id) != left_.end(); }
+
+	// decodes what's left of a layer's pixels and mask in [x0, x1) * [y0, y1)
+	void load(const layer& l, int x0, int y0, int x1, int y1)
+	{
+		const auto found = left_.find(l.id);
+		if (found == left_.end()) return;
+		x0 = std::max(0, x0);
+		y0 = std::max(0, y0);
+		x1 = std::min(width_, x1);
+		y1 = std::min(height_, y1);
+		if (x0 >= x1 || y0 >= y1) return;
+		const int tiles_x = (width_ + document_tile - 1) / document_tile;
+		std::vector<int> todo;
+		for (int ty = y0 / document_tile; ty <= (y1 - 1) / document_tile; ty++)
+		{
+			for (int tx = x0 / document_tile; tx <= (x1 - 1) / document_tile; tx++)
+			{
+				if (found->second.tiles[ty * tiles_x + tx]) todo.push_back(ty * tiles_x + tx);
+			}
+		}
+		decode(l, found, todo);
+	}
+
+	void load(const layer& l)
+	{
+		load(l, 0, 0, width_, height_);
+	}
+
+	void load(const ImVector<layer>& layers, const int x0, const int y0, const int x1, const int y1)
+	{
+		for (const layer& l : layers)
+		{
+			if (empty()) return;
+			load(l, x0, y0, x1, y1);
+		}
+	}
+
+	// decodes about bytes worth of what's left, false once nothing is
+	bool step(const ImVector<layer>& layers, size_t bytes)
+	{
+		// layers that were deleted in the meantime don't need theirs anymore
+		for (auto i = left_.begin(); i != left_.end();)
+		{
+			const auto found = std::find_if(layers.begin(), layers.end(), [&](const layer& l) { return l.id == i->first; });
+			i = found == layers.end() ? left_.erase(i) : std::next(i);
+		}
+		for (const layer& l : layers)
+		{
+			const auto found = left_.find(l.id);
+			if (found == left_.end()) continue;
+			const size_t tile = (size_t)document_tile * document_tile * (l.pixel_size() + (l.mask ? 1 : 0));
+			std::vector<int> todo;
+			for (int t = 0; t < (int)found->second.tiles.size() && bytes >= tile; t++)
+			{
+				if (!found->second.tiles[t]) continue;
+				todo.push_back(t);
+				bytes -= tile;
+			}
+			decode(l, found, todo);
+			if (bytes < tile) break;
+		}
+		if (left_.empty()) file_.reset();
+		return !left_.empty();
+	}
+
+private:
+	struct layer_tiles
+	{
+		// pixel tiles' refs and then the mask's
+		std::vector<tile_ref> refs;
+		// per tile, 1 if its pixels are still in the file and 2 if its mask is
+		std::vector<uint8_t> tiles;
+		int count = 0;
+	};
+
+	std::unique_ptr<mapped_file> file_;
+	int width_ = 0, height_ = 0;
+	std::unordered_map<int, layer_tiles> left_;
+
+	void decode(const layer& l, const std::unordered_map<int, layer_tiles>::iterator found, const std::vector<int>& todo)
+	{
+		layer_tiles& left = found->second;
+		const int tiles_x = (width_ + document_tile - 1) / document_tile, count = (int)left.tiles.size();
+		parallel_for((int)todo.size(), [&](const int first, const int last)
+		{
+			for (int i = first; i < last; i++)
+			{
+				const int t = todo[i], tx = t % tiles_x, ty = t / tiles_x;
+				if ((left.tiles[t] & 1) && !decode_tile(left.refs[t], file_->data, l.pixels, width_, height_, tx, ty, l.pixel_size()))
+				{
+					decode_tile(tile_ref(), nullptr, l.pixels, width_, height_, tx, ty, l.pixel_size());
+				}
+				if ((left.tiles[t] & 2) && l.mask && !decode_tile(left.refs[count + t], file_->data, l.mask, width_, height_, tx, ty, 1))
+				{
+					decode_tile(tile_ref(), nullptr, l.mask, width_, height_, tx, ty, 1);
+				}
+				left.tiles[t] = 0;
+			}
+		});
+		left.count -= (int)todo.size();
+		if (left.count == 0) left_.erase(found);
+		if (left_.empty()) file_.reset();
+	}
+};
+
+// the document at path into layers (which should be empty), false if it isn't one or is damaged. only the
+// index is read, tiles hands out the pixels as they're needed. the layers know where their tiles are
+// afterwards, so saving back to it only has to add what changes
+inline bool read_document(const std::string& path, ImVector<layer>& layers, int& cur_layer, int& width, int& height, uint64_t& journal,
+	document_header& header, document_tiles& tiles)
+{
+	std::unique_ptr<mapped_file> file(new mapped_file);
+	if (!file->open(path) || !read_header(*file, header)) return false;
+
+	index_reader index = { file->data + header.index_offset, file->data + header.index_offset + header.index_size };
+	width = index.get<int32_t>();
+	height = index.get<int32_t>();
+	const int tile = index.get<int32_t>();
+	const int count = index.get<int32_t>();
+	cur_layer = index.get<int32_t>();
+	journal = index.get<uint64_t>();
+	if (!index.ok || width <= 0 || height <= 0 || tile != document_tile || count <= 0 || (size_t)width * height * 4 > INT32_MAX) return false;
+
+	const size_t pixel_count = (size_t)width * height;
+	const int tiles_count = tile_count(width, height);
+	bool ok = true;
+	for (int i = 0; i < count && ok; i++)
+	{
+		// constructed in place, layers don't survive being copied around byte by byte
+		layers.resize(layers.size() + 1);
+		layer& l = *new (&layers.back()) layer(std::string(), 0);
+		bool has_mask;
+		// byte counts are ints everywhere else
+		ok = read_layer_settings(index, l, has_mask) && pixel_count * l.pixel_size() <= INT32_MAX;
+		if (!ok) break;
+		saw_layer_id(l.id);
+		delete[]l.pixels;
+		l.pixels = new unsigned char[pixel_count * l.pixel_size()];
+		if (!stores_pixels(l))
+		{
+			l.dirty = new unsigned char[tiles_count];
+			memset(l.dirty, 1, tiles_count);
+			continue;
+		}
+		l.saved = new tile_ref[(size_t)tiles_count * 2];
+		l.unsaved = new unsigned char[tiles_count];
+		memset(l.unsaved, 0, tiles_count);
+		ok = read_refs(index, file->size, l.saved, tiles_count);
+		if (!ok || !has_mask) continue;
+		l.mask = new unsigned char[pixel_count];
+		ok = read_refs(index, file->size, l.saved + tiles_count, tiles_count);
+	}
+	// from the top down a layer can only be one deeper than the one above it, and only if that's a group it's
+	// in. anything else would have the compositor looking for groups that aren't there
+	for (int i = layers.size() - 1; i >= 0 && ok; i--)
+	{
+		const int deepest = i == layers.size() - 1 ? 0 : layers[i + 1].depth + (layers[i + 1].group ? 1 : 0);
+		ok = layers[i].depth <= deepest;
+	}
+	if (!ok)
+	{
+		free_layers(layers);
+		return false;
+	}
+	cur_layer = std::max(0, std::min(cur_layer, count - 1));
+	tiles.start(std::move(file), layers, width, height);
+	return true;
+}
+
+// copies the tiles the last save's index uses out of the document at path into a new file at temp, leaving out
+// everything that's been replaced since. moved gets where each tile went
+inline bool compact_document(const std::string& path, const std::string& temp, std::vector<std::pair<uint64_t, uint64_t>>& moved, uint64_t& size)
+{
+	mapped_file source;
+	document_header header;
+	if (!source.open(path) || !read_header(source, header)) return false;
+	std::vector<uint8_t> index(source.data + header.index_offset, source.data + header.index_offset + header.index_size);
+	FILE* file = fopen(temp.c_str(), "wb");
+	if (file == nullptr) return false;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	uint64_t offset = sizeof(header);
+
+	index_reader reader = { index.data(), index.data() + index.size() };
+	const int width = reader.get<int32_t>(), height = reader.get<int32_t>();
+	reader.get<int32_t>();
+	const int count = reader.get<int32_t>();
+	reader.get<int32_t>();
+	reader.get<uint64_t>();
+	ok = ok && reader.ok && width > 0 && height > 0;
+	const int tiles = ok ? tile_count(width, height) : 0;
+	layer_settings settings;
+	for (int i = 0; i < count && ok; i++)
+	{
+		bool has_mask;
+		ok = read_layer_settings(reader, settings, has_mask);
+		const int refs = ((stores_pixels(settings) ? 1 : 0) + (has_mask ? 1 : 0)) * tiles;
+		for (int t = 0; t < refs && ok; t++)
+		{
+			tile_ref ref = reader.get<tile_ref>();
+			ok = reader.ok;
+			if (!ok || ref.size == 0) continue;
+			ok = ref.offset <= source.size && source.size - ref.offset >= ref.size
+				&& fwrite(source.data + ref.offset, 1, ref.size, file) == ref.size;
+			moved.emplace_back(ref.offset, offset);
+			ref.offset = offset;
+			offset += ref.size;
+			memcpy(index.data() + (reader.pos - index.data()) - sizeof(ref), &ref, sizeof(ref));
+		}
+	}
+	source.close();
+
+	header.index_offset = offset;
+	size = offset + index.size();
+	ok = ok && fwrite(index.data(), 1, index.size(), file) == index.size() && flush_file(file);
+	ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 && flush_file(file);
+	ok = fclose(file) == 0 && ok;
+	if (!ok) remove(temp.c_str());
+	return ok;
+}
+
+// the .rkgk a document lives in. the first save writes all of it to a new file that replaces the old one, the ones
+// after only add the tiles that changed and a new index to the end and then point the header at that index. the
+// header fits in the first sector and only gets written once everything it points at is on the disk, so a crash
+// at any point leaves the last save's index in place. the tiles that got replaced are dead space, once there's as
+// much of it as there is document the tiles still in use get copied to a new file in the background, which is
+// swapped in if nothing was saved in the meantime
+struct document_file
+{
+	// empty until the document is saved or opened
+	std::string path;
+	// what of the opened document is still in its file
+	document_tiles tiles;
+
+	document_file() = default;
+	document_file(const document_file&) = delete;
+	document_file& operator=(const document_file&) = delete;
+	~document_file()
+	{
+		if (!compactor_.joinable()) return;
+		compactor_.join();
+		remove(compact_path_.c_str());
+	}
+
+	bool open(const std::string& path, ImVector<layer>& layers, int& cur_layer, int& width, int& height, uint64_t& journal)
+	{
+		if (compactor_.joinable())
+		{
+			compactor_.join();
+			remove(compact_path_.c_str());
+		}
+		document_header header;
+		if (!read_document(path, layers, cur_layer, width, height, journal, header, tiles)) return false;
+		this->path = path;
+		size_ = file_size(path);
+		index_size_ = header.index_size;
+		appendable_ = true;
+		generation_++;
+		return true;
+	}
+
+	bool save(const std::string& path, ImVector<layer>& layers, const int cur_layer, const int width, const int height, const uint64_t journal)
+	{
+		poll(layers, width, height);
+		// starts over if it's somewhere else, something else wrote to the file or the last save didn't make it
+		const bool append = appendable_ && path == this->path && file_size(path) == size_;
+		// the layers that get written whole need all of their pixels
+		for (const layer& l : layers)
+		{
+			if (!append || l.saved == nullptr) tiles.load(l);
+		}
+		const std::string target = append ? path : path + ".tmp";
+		FILE* file = fopen(target.c_str(), append ? "r+b" : "wb");
+		if (file == nullptr) return false;
+		document_header header;
+		uint64_t offset = append ? size_ : sizeof(header);
+		bool ok = append ? fseek(file, 0, SEEK_END) == 0 : fwrite(&header, sizeof(header), 1, file) == 1;
+		ok = ok && append_document(file, offset, layers, cur_layer, width, height, journal, !append, header) && flush_file(file);
+		ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 && flush_file(file);
+		ok = fclose(file) == 0 && ok;
+		if (ok && !append) ok = replace_file(target, path);
+		generation_++;
+		if (!ok)
+		{
+			if (!append) remove(target.c_str());
+			// the layers could be pointing at tiles that never made it
+			appendable_ = false;
+			return false;
+		}
+
+		this->path = path;
+		size_ = offset;
+		index_size_ = header.index_size;
+		appendable_ = true;
+		for (const layer& l : layers)
+		{
+			if (l.unsaved == nullptr) continue;
+			for (int i = 0; i < tile_count(width, height); i++)
+			{
+				l.unsaved[i] &= ~unsaved_document;
+			}
+		}
+		compact_if_worth_it(layers, width, height);
+		return true;
+	}
+
+	// the layers were opened from somewhere else (like the autosave) but belong to the document at path now,
+	// the next save writes all of them
+	void detach(const std::string& path)
+	{
+		this->path = path;
+		appendable_ = false;
+		generation_++;
+	}
+
+	// swaps in the compacted file once it's done. every now and then is often enough
+	void poll(ImVector<layer>& layers, const int width, const int height)
+	{
+		if (!compactor_.joinable() || !compacted_) return;
+		compactor_.join();
+		if (!compact_ok_ || compact_generation_ != generation_ || !replace_file(compact_path_, path))
+		{
+			// saved again while it was copying, the file it made is already out of date
+			remove(compact_path_.c_str());
+			if (compact_ok_) compact_if_worth_it(layers, width, height);
+			return;
+		}
+
+		std::sort(moved_.begin(), moved_.end());
+		const int count = tile_count(width, height);
+		for (const layer& l : layers)
+		{
+			if (l.saved == nullptr) continue;
+			for (int i = 0; i < (l.mask ? count * 2 : count); i++)
+			{
+				tile_ref& ref = l.saved[i];
+				if (ref.size == 0) continue;
+				const auto to = std::lower_bound(moved_.begin(), moved_.end(), std::make_pair(ref.offset, (uint64_t)0));
+				if (to != moved_.end() && to->first == ref.offset) ref.offset = to->second;
+				else appendable_ = false;
+			}
+		}
+		size_ = compacted_size_;
+		moved_ = std::vector<std::pair<uint64_t, uint64_t>>();
+	}
+
+private:
+	uint64_t size_ = 0, index_size_ = 0;
+	bool appendable_ = false;
+	int generation_ = 0;
+	std::thread compactor_;
+	std::atomic<bool> compacted_ { false };
+	bool compact_ok_ = false;
+	int compact_generation_ = 0;
+	std::string compact_path_;
+	uint64_t compacted_size_ = 0;
+	std::vector<std::pair<uint64_t, uint64_t>> moved_;
+
+	// bytes of the file the last save's index still uses
+	uint64_t used(const ImVector<layer>& layers, const int width, const int height) const
+	{
+		uint64_t bytes = sizeof(document_header) + index_size_;
+		const int count = tile_count(width, height);
+		for (const layer& l : layers)
+		{
+			if (l.saved == nullptr) continue;
+			for (int i = 0; i < (l.mask ? count * 2 : count); i++)
+			{
+				bytes += l.saved[i].size;
+			}
+		}
+		return bytes;
+	}
+
+	void compact_if_worth_it(const ImVector<layer>& layers, const int width, const int height)
+	{
+		// not while tiles are still read out of the file, it couldn't be replaced everywhere
+		if (appendable_ && tiles.empty() && !compactor_.joinable() && size_ > ((uint64_t)64 << 20) && size_ > used(layers, width, height) * 2) start_compaction();
+	}
+
+	void start_compaction()
+	{
+		compacted_ = false;
+		compact_generation_ = generation_;
+		moved_.clear();
+		compact_path_ = path + ".compact";
+		compactor_ = std::thread([this, path = path]
+		{
+			compact_ok_ = compact_document(path, compact_path_, moved_, compacted_size_);
+			compacted_ = true;
+		});
+	}
+};
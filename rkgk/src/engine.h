@@ -1,14 +1,22 @@
 ﻿#pragma once
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
+#include <vector>
 
+
+#include "blend.h"
+#include "brush.h"
 #include "color.h"
 #include "imgui/imgui.h"
+#include "selection.h"
+#include "stamp.h"
 
-
-unsigned char* buffer_{};
 ImVec2 stroke_pos_;
 bool stroking_ = false;
 float prev_pressure_ = 0;
+struct dab_context;
 
 void start_stroke()
 {
@@ -25,15 +33,6 @@ void end_stroke()
 
 }
 
-void alpha_blend(uint8_t* dst, uint8_t* src, uint8_t alpha)
-{
-	uint8_t inv_alpha = 255 - alpha;
-	dst[0] = (src[0] * alpha + dst[0] * inv_alpha) / 255;
-	dst[1] = (src[1] * alpha + dst[1] * inv_alpha) / 255;
-	dst[2] = (src[2] * alpha + dst[2] * inv_alpha) / 255;
-	dst[3] = (src[3] * alpha + dst[3] * inv_alpha) / 255;
-}
-
 void set_pixel(const int x, const int y, const color new_color, const int width, const int height, unsigned char* pixels)
 {
 	if (x < 0 || y < 0 || x >= width || y >= height)
@@ -41,35 +40,22 @@ void set_pixel(const int x, const int y, const color new_color, const int width,
 		return;
 	}
 
-	const int bytes_per_pixel = 4;
-	const int packed_pos = y * width + x;
-	buffer_[packed_pos + 0] = new_color.r;
-	buffer_[packed_pos + 1] = new_color.g;
-	buffer_[packed_pos + 2] = new_color.b;
-	buffer_[packed_pos + 3] = new_color.a;
-
-	const unsigned char rA = new_color.r;
-	const unsigned char gA = new_color.g;
-	const unsigned char bA = new_color.b;
-	const unsigned char aA = new_color.a;
-
-	const unsigned char rB = buffer_[packed_pos + 0];
-	const unsigned char gB = buffer_[packed_pos + 1];
-	const unsigned char bB = buffer_[packed_pos + 2];
-	const unsigned char aB = buffer_[packed_pos + 3];
-
-	const int stride = ((32 * width) + 31) / 32 * 4;
-	// Pointer to the first byte of the 4-byte color data
-	unsigned char* data = pixels + (y * stride) + (x * bytes_per_pixel);
+	uint8_t src[4] = { new_color.r, new_color.g, new_color.b, 255 };
+	alpha_blend(pixels + ((size_t)y * width + x) * 4, src, new_color.a);
+}
 
-	uint8_t src[4] = { rA, gA, bA, 255 };
-	uint8_t alpha = aA;
-	alpha_blend(data, src, alpha);
+// the falloff ramps up from the edge of the dab and is capped by the dab's alpha
+inline float falloff(const float ramp, const float r, const float dist, const float max_alpha)
+{
+	return std::max(0.0f, std::min(max_alpha, ramp * (r - dist)));
 }
 
+// plain version of the dab kernels below that checks the brush settings as it goes,
+// the benchmark compares against it
 void dab(float cx, float cy, const float pressure, const brush& brush, const color new_color, const int width, const int height, unsigned char* pixels)
 {
 	const float size = brush.get_size(pressure);
+	const uint8_t max_alpha = new_color.a * brush.get_alpha(pressure) / 255;
 
 	float r, fudge;
 	// arbitrary value fudging to make small brush sizes look nice
@@ -77,8 +63,6 @@ void dab(float cx, float cy, const float pressure, const brush& brush, const col
 	{
 		fudge = size / 2;
 		r = 1;
-		// fix weird off by one issue
-		cx--; cy--;
 	}
 	else
 	{
@@ -86,23 +70,746 @@ void dab(float cx, float cy, const float pressure, const brush& brush, const col
 		r = size / 2;
 	}
 
-	const float cpx = floor(cx) + .5f;
-	const float cpy = floor(cy) + .5f;
-	for (float x = cpx - r; x <= cpx + r; x++)
+	// inside of r_solid every pixel gets the same alpha so those get filled in runs without any per pixel math
+	const float ramp = brush.aa * fudge * 255;
+	const float r_solid = r - max_alpha / ramp;
+
+	// pixel centers sit at +.5
+	const int y0 = std::max(0, (int)floor(cy - r - .5f)), y1 = std::min(height - 1, (int)ceil(cy + r - .5f));
+	for (int y = y0; y <= y1; y++)
 	{
-		for (float y = cpy - r; y <= cpy + r; y++)
+		const float dy = y + .5f - cy;
+		if (std::abs(dy) > r) continue;
+
+		// exact extent of the disk on this row
+		const float half = std::sqrt(r * r - dy * dy);
+		const int x0 = std::max(0, (int)ceil(cx - half - .5f));
+		const int x1 = std::min(width - 1, (int)floor(cx + half - .5f));
+		if (x1 < x0) continue;
+
+		int solid0 = x1 + 1, solid1 = x1;
+		if (r_solid > std::abs(dy))
 		{
-			const auto v1 = ImVec2(x, y);
-			const auto v2 = ImVec2(cx, cy);
-			const float dist = distance(v1, v2);
-			if (dist > r) continue;
-			const float aa = r - lerp(r, dist, brush.aa);
-			const float alpha = std::max(0.0f, std::min((float)new_color.a, aa * fudge * 255));
-			const int rx = lround(x);
-			const int ry = lround(y);
-			set_pixel(rx, ry, color(new_color.r, new_color.g, new_color.b, alpha), width, height, pixels);
+			const float solid_half = std::sqrt(r_solid * r_solid - dy * dy);
+			solid0 = std::max(x0, (int)ceil(cx - solid_half - .5f));
+			solid1 = std::min(x1, (int)floor(cx + solid_half - .5f));
+			if (solid1 < solid0)
+			{
+				solid0 = x1 + 1;
+				solid1 = x1;
+			}
+		}
+
+		uint8_t* row = pixels + (size_t)y * width * 4;
+		const auto edge = [&](const int from, const int to)
+		{
+			for (int x = from; x <= to; x++)
+			{
+				const float dx = x + .5f - cx;
+				const float dist = std::sqrt(dx * dx + dy * dy);
+				if (dist > r) continue;
+				blend_pixel(brush.mode, row + x * 4, new_color, (uint8_t)falloff(ramp, r, dist, max_alpha));
+			}
+		};
+
+		edge(x0, std::min(x1, solid0 - 1));
+		if (solid0 <= solid1)
+		{
+			if (brush.mode == blend_mode::erase)
+			{
+				erase_span(row + solid0 * 4, solid1 - solid0 + 1, max_alpha);
+			}
+			else
+			{
+				blend_span(row + solid0 * 4, solid1 - solid0 + 1, new_color, max_alpha);
+			}
+			edge(solid1 + 1, x1);
+		}
+	}
+}
+
+// paint the smudge and blend brushes carry from one dab to the next
+struct smudge_state
+{
+	bool loaded = false;
+	// smudge: the pixels under the last dab, centered on it
+	int patch_half = 0;
+	std::vector<uint8_t> patch;
+	// blend: the mixed color
+	uint8_t carried[4] = {};
+	// scratch for the dab mask and per pixel weights
+	std::vector<uint8_t> mask, weights, fill;
+};
+
+using dab_kernel_fn = void (*)(const dab_context& ctx, float cx, float cy, float pressure, int width, int height, uint8_t* pixels);
+
+// brush settings resolved once per stroke, along with the dab kernel specialized for them
+struct dab_context
+{
+	float size = 1, min_size = 0;
+	// brush opacity with the color's alpha already applied
+	float opacity = 255, min_opacity = 0;
+	float aa = .5f, spacing = .05f;
+	color brush_color;
+	blend_mode mode = blend_mode::normal;
+	dab_kernel_fn kernel = nullptr;
+	// falloff curve baked by squared distance over squared radius, 1 << 15 is full coverage,
+	// empty for the plain hard falloff
+	static constexpr int lut_size = 4096;
+	std::vector<uint16_t> lut;
+	// image tip, index into brush_tips or -1
+	int tip = -1;
+	tip_rotation rotation = tip_rotation::fixed;
+	float angle = 0;
+	// direction the stroke is heading in, kept up to date by whoever drives the stroke
+	float direction = 0;
+	float smudge_length = .5f;
+	// the kernels only get a const context, the carried paint is the one thing a dab changes
+	mutable smudge_state smudge;
+	// painting only goes where this is selected, null without a selection
+	const selection* selection_mask = nullptr;
+	mutable std::vector<uint8_t> selection_row;
+	// what the layer being painted on is made of
+	pixel_format format = pixel_format::rgba8;
+	// normal dabs mix in linear light
+	bool linear = false;
+
+	void dab(const float cx, const float cy, const float pressure, const int width, const int height, uint8_t* pixels) const
+	{
+		kernel(*this, cx, cy, pressure, width, height, pixels);
+	}
+
+	float size_at(const float pressure) const
+	{
+		return lerp(min_size, size, pressure);
+	}
+
+	// how far from its center a dab can touch pixels, big enough for a rotated tip at full size
+	int reach() const
+	{
+		return (int)ceil(std::max(size, min_size) * .75f) + 2;
+	}
+
+	uint8_t alpha_at(const float pressure) const
+	{
+		return (uint8_t)lerp(min_opacity, opacity, pressure);
+	}
+
+	// selection mask for [x, x + count) on row y, starting at x. null if there's nothing to mask (and if
+	// coverage is none, nothing to paint either)
+	const uint8_t* mask_row(const int y, const int x, const int count, coverage& c) const
+	{
+		c = coverage::all;
+		if (selection_mask == nullptr) return nullptr;
+		if ((int)selection_row.size() < count) selection_row.resize(count);
+		c = selection_mask->row(y, x, count, selection_row.data());
+		return c == coverage::partial ? selection_row.data() : nullptr;
+	}
+
+	float alpha_at(const float dist, const float r, const float fudge, const float max_alpha) const
+	{
+		const float ramp = aa * fudge * 255;
+		if (lut.empty()) return falloff(ramp, r, dist, max_alpha);
+		const int i = std::min(lut_size - 1, (int)(dist * dist / (r * r) * (lut_size - 1)));
+		return max_alpha * lut[i] / 32768.0f * std::max(0.0f, std::min(1.0f, ramp / 255 * (r - dist)));
+	}
+};
+
+template <bool SizePressure, bool OpacityPressure, bool MaybeSmall, bool Curve, bool Masked, typename Op>
+void dab_kernel(const dab_context& ctx, const float cx, const float cy, const float pressure, const int width, const int height, uint8_t* pixels)
+{
+	const float size = SizePressure ? lerp(ctx.min_size, ctx.size, pressure) : ctx.size;
+	const uint8_t max_alpha = OpacityPressure ? (uint8_t)lerp(ctx.min_opacity, ctx.opacity, pressure) : (uint8_t)ctx.opacity;
+
+	// same small brush fudging as dab(), without the branch
+	const float r = MaybeSmall ? std::max(1.0f, size / 2) : size / 2;
+	const float ramp = MaybeSmall ? ctx.aa * std::min(1.0f, size / 2) * 255 : ctx.aa * 255;
+	// with a curve the alpha isn't the same anywhere, but inside of the anti-aliased edge it only
+	// depends on the curve, which is a lookup by squared distance
+	const float r_solid = Curve ? r - 255 / ramp : r - max_alpha / ramp;
+	const float r2 = r * r, r_solid2 = r_solid * r_solid;
+	const uint16_t* lut = Curve ? ctx.lut.data() : nullptr;
+	const float lut_scale = (dab_context::lut_size - 1) / r2;
+	const auto pixel_alpha = [&](const float dist2)
+	{
+		if (!Curve) return (uint8_t)falloff(ramp, r, std::sqrt(dist2), max_alpha);
+		const float dist = std::sqrt(dist2);
+		const float edge = std::max(0.0f, std::min(1.0f, ramp / 255 * (r - dist)));
+		const int i = std::min(dab_context::lut_size - 1, (int)(dist2 * lut_scale));
+		return (uint8_t)(max_alpha * lut[i] / 32768.0f * edge);
+	};
+
+	const int y0 = std::max(0, (int)floor(cy - r - .5f)), y1 = std::min(height - 1, (int)ceil(cy + r - .5f));
+	for (int y = y0; y <= y1; y++)
+	{
+		const float dy = y + .5f - cy;
+		const float dy2 = dy * dy;
+		if (dy2 > r2) continue;
+
+		const float half = std::sqrt(r2 - dy2);
+		const int x0 = std::max(0, (int)ceil(cx - half - .5f));
+		const int x1 = std::min(width - 1, (int)floor(cx + half - .5f));
+		if (x1 < x0) continue;
+
+		// an empty solid run sits right after the row so the edge loops below cover all of it
+		int solid0 = x1 + 1, solid1 = x1;
+		if (r_solid > 0 && r_solid2 > dy2)
+		{
+			const float solid_half = std::sqrt(r_solid2 - dy2);
+			solid0 = std::max(x0, (int)ceil(cx - solid_half - .5f));
+			solid1 = std::max(solid0 - 1, std::min(x1, (int)floor(cx + solid_half - .5f)));
+		}
+
+		// the selection is applied right in the blends, rows that are fully selected don't even look at it
+		const uint8_t* mask = nullptr;
+		if (Masked)
+		{
+			coverage c;
+			mask = ctx.mask_row(y, x0, x1 - x0 + 1, c);
+			if (c == coverage::none) continue;
+		}
+		const auto masked = [&](const int x, const uint8_t alpha)
+		{
+			return Masked && mask ? mask_alpha(alpha, mask[x - x0]) : alpha;
+		};
+
+		uint8_t* row = pixels + (size_t)y * width * Op::pixel_size;
+		for (int x = x0; x < solid0; x++)
+		{
+			const float dx = x + .5f - cx;
+			Op::pixel(row + x * Op::pixel_size, ctx.brush_color, masked(x, pixel_alpha(dx * dx + dy2)));
+		}
+		if (Curve)
+		{
+			for (int x = solid0; x <= solid1; x++)
+			{
+				const float dx = x + .5f - cx;
+				const int i = std::min(dab_context::lut_size - 1, (int)((dx * dx + dy2) * lut_scale));
+				Op::pixel(row + x * Op::pixel_size, ctx.brush_color, masked(x, (uint8_t)((lut[i] * max_alpha + 16384) >> 15)));
+			}
+		}
+		else if (Masked && mask)
+		{
+			Op::span_masked(row + solid0 * Op::pixel_size, solid1 - solid0 + 1, ctx.brush_color, max_alpha, mask + solid0 - x0);
+		}
+		else
+		{
+			Op::span(row + solid0 * Op::pixel_size, solid1 - solid0 + 1, ctx.brush_color, max_alpha);
+		}
+		for (int x = std::max(solid0, solid1 + 1); x <= x1; x++)
+		{
+			const float dx = x + .5f - cx;
+			Op::pixel(row + x * Op::pixel_size, ctx.brush_color, masked(x, pixel_alpha(dx * dx + dy2)));
+		}
+	}
+}
+
+template <bool SizePressure, bool OpacityPressure, bool MaybeSmall, bool Curve, bool Masked>
+dab_kernel_fn pick_dab_kernel(const blend_mode mode, const pixel_format format, const bool linear)
+{
+	if (format == pixel_format::alpha8)
+	{
+		return mode == blend_mode::erase
+			? &dab_kernel<SizePressure, OpacityPressure, MaybeSmall, Curve, Masked, alpha_op<blend_mode::erase>>
+			: &dab_kernel<SizePressure, OpacityPressure, MaybeSmall, Curve, Masked, alpha_op<blend_mode::normal>>;
+	}
+	if (format == pixel_format::rgba16)
+	{
+		return mode == blend_mode::erase
+			? &dab_kernel<SizePressure, OpacityPressure, MaybeSmall, Curve, Masked, deep_op<blend_mode::erase>>
+			: &dab_kernel<SizePressure, OpacityPressure, MaybeSmall, Curve, Masked, deep_op<blend_mode::normal>>;
+	}
+	if (mode == blend_mode::erase) return &dab_kernel<SizePressure, OpacityPressure, MaybeSmall, Curve, Masked, blend_op<blend_mode::erase>>;
+	return linear
+		? &dab_kernel<SizePressure, OpacityPressure, MaybeSmall, Curve, Masked, linear_op<blend_mode::normal>>
+		: &dab_kernel<SizePressure, OpacityPressure, MaybeSmall, Curve, Masked, blend_op<blend_mode::normal>>;
+}
+
+template <bool SizePressure, bool OpacityPressure, bool MaybeSmall, bool Curve>
+dab_kernel_fn pick_dab_kernel(const bool masked, const blend_mode mode, const pixel_format format, const bool linear)
+{
+	return masked
+		? pick_dab_kernel<SizePressure, OpacityPressure, MaybeSmall, Curve, true>(mode, format, linear)
+		: pick_dab_kernel<SizePressure, OpacityPressure, MaybeSmall, Curve, false>(mode, format, linear);
+}
+
+template <bool SizePressure, bool OpacityPressure, bool MaybeSmall>
+dab_kernel_fn pick_dab_kernel(const bool curve, const bool masked, const blend_mode mode, const pixel_format format, const bool linear)
+{
+	return curve
+		? pick_dab_kernel<SizePressure, OpacityPressure, MaybeSmall, true>(masked, mode, format, linear)
+		: pick_dab_kernel<SizePressure, OpacityPressure, MaybeSmall, false>(masked, mode, format, linear);
+}
+
+template <bool SizePressure, bool OpacityPressure>
+dab_kernel_fn pick_dab_kernel(const bool maybe_small, const bool curve, const bool masked, const blend_mode mode, const pixel_format format, const bool linear)
+{
+	return maybe_small
+		? pick_dab_kernel<SizePressure, OpacityPressure, true>(curve, masked, mode, format, linear)
+		: pick_dab_kernel<SizePressure, OpacityPressure, false>(curve, masked, mode, format, linear);
+}
+
+template <bool SizePressure>
+dab_kernel_fn pick_dab_kernel(const bool opacity_pressure, const bool maybe_small, const bool curve, const bool masked, const blend_mode mode, const pixel_format format, const bool linear)
+{
+	return opacity_pressure
+		? pick_dab_kernel<SizePressure, true>(maybe_small, curve, masked, mode, format, linear)
+		: pick_dab_kernel<SizePressure, false>(maybe_small, curve, masked, mode, format, linear);
+}
+
+float tip_angle(const dab_context& ctx, const float pressure)
+{
+	switch (ctx.rotation)
+	{
+	case tip_rotation::fixed:
+		break;
+	case tip_rotation::direction:
+		return ctx.angle + ctx.direction;
+	case tip_rotation::pressure:
+		return ctx.angle + pressure * 6.2831853f;
+	}
+	return ctx.angle;
+}
+
+// stamps a cached, already scaled and rotated copy of the tip, so a dab is just a mask blend
+template <typename Op>
+void tip_dab_kernel(const dab_context& ctx, const float cx, const float cy, const float pressure, const int width, const int height, uint8_t* pixels)
+{
+	const stamp& s = brush_tips[ctx.tip].get(ctx.size_at(pressure), tip_angle(ctx, pressure));
+	const uint8_t max_alpha = ctx.alpha_at(pressure);
+
+	const int left = (int)lround(cx - s.width * .5f), top = (int)lround(cy - s.height * .5f);
+	const int x0 = std::max(0, left), x1 = std::min(width, left + s.width);
+	const int y0 = std::max(0, top), y1 = std::min(height, top + s.height);
+	for (int y = y0; y < y1; y++)
+	{
+		coverage c;
+		const uint8_t* selected = x0 < x1 ? ctx.mask_row(y, x0, x1 - x0, c) : nullptr;
+		if (x0 >= x1 || c == coverage::none) continue;
+
+		const uint8_t* mask = s.mask.data() + (size_t)(y - top) * s.width;
+		uint8_t* row = pixels + (size_t)y * width * Op::pixel_size;
+		for (int x = x0; x < x1; x++)
+		{
+			if (mask[x - left] == 0) continue;
+			const uint8_t alpha = mask_alpha(max_alpha, mask[x - left]);
+			Op::pixel(row + x * Op::pixel_size, ctx.brush_color, selected ? mask_alpha(alpha, selected[x - x0]) : alpha);
+		}
+	}
+}
+
+// coverage of a dab over its bounding box, for kernels that need the whole mask before touching the layer.
+// round dabs are drawn into mask, tips already have one in their cache and that's what's returned instead
+const uint8_t* dab_mask(const dab_context& ctx, const float cx, const float cy, const float pressure, std::vector<uint8_t>& mask, int& left, int& top, int& w, int& h)
+{
+	const float size = ctx.size_at(pressure);
+	if (ctx.tip >= 0)
+	{
+		const stamp& s = brush_tips[ctx.tip].get(size, tip_angle(ctx, pressure));
+		left = (int)lround(cx - s.width * .5f);
+		top = (int)lround(cy - s.height * .5f);
+		w = s.width;
+		h = s.height;
+		return s.mask.data();
+	}
+
+	const float r = std::max(1.0f, size / 2), fudge = std::min(1.0f, size / 2);
+	left = (int)floor(cx - r);
+	top = (int)floor(cy - r);
+	w = (int)ceil(cx + r) - left;
+	h = (int)ceil(cy + r) - top;
+	mask.resize((size_t)w * h);
+
+	// same as alpha_at, in row spans like the dab kernels: nothing outside of the disk, a plain fill
+	// (or just the curve lookup) inside of the anti-aliased edge
+	const float ramp = ctx.aa * fudge * 255;
+	const float r_solid = r - 255 / ramp;
+	const float r2 = r * r, r_solid2 = r_solid * r_solid;
+	const float lut_scale = (dab_context::lut_size - 1) / r2;
+	const bool curve = !ctx.lut.empty();
+	const auto edge_alpha = [&](const float dist2)
+	{
+		const float edge = std::max(0.0f, std::min(1.0f, ramp / 255 * (r - std::sqrt(dist2))));
+		if (!curve) return (uint8_t)(255 * edge);
+		return (uint8_t)(ctx.lut[std::min(dab_context::lut_size - 1, (int)(dist2 * lut_scale))] * (255 / 32768.0f) * edge);
+	};
+
+	memset(mask.data(), 0, mask.size());
+	for (int y = 0; y < h; y++)
+	{
+		const float dy = top + y + .5f - cy;
+		const float dy2 = dy * dy;
+		if (dy2 > r2) continue;
+
+		const float half = std::sqrt(r2 - dy2);
+		const int x0 = std::max(0, (int)ceil(cx - half - .5f) - left);
+		const int x1 = std::min(w - 1, (int)floor(cx + half - .5f) - left);
+		int solid0 = x1 + 1, solid1 = x1;
+		if (r_solid > 0 && r_solid2 > dy2)
+		{
+			const float solid_half = std::sqrt(r_solid2 - dy2);
+			solid0 = std::max(x0, (int)ceil(cx - solid_half - .5f) - left);
+			solid1 = std::max(solid0 - 1, std::min(x1, (int)floor(cx + solid_half - .5f) - left));
+		}
+
+		uint8_t* row = mask.data() + (size_t)y * w;
+		for (int x = x0; x < solid0; x++)
+		{
+			const float dx = left + x + .5f - cx;
+			row[x] = edge_alpha(dx * dx + dy2);
+		}
+		if (curve)
+		{
+			for (int x = solid0; x <= solid1; x++)
+			{
+				const float dx = left + x + .5f - cx;
+				row[x] = (uint8_t)((ctx.lut[std::min(dab_context::lut_size - 1, (int)((dx * dx + dy2) * lut_scale))] * 255 + 16384) >> 15);
+			}
+		}
+		else if (solid0 <= solid1)
+		{
+			memset(row + solid0, 255, solid1 - solid0 + 1);
+		}
+		for (int x = std::max(solid0, solid1 + 1); x <= x1; x++)
+		{
+			const float dx = left + x + .5f - cx;
+			row[x] = edge_alpha(dx * dx + dy2);
+		}
+	}
+	return mask.data();
+}
+
+// smudge drags a patch of pixels along with the dab: it's laid down with the dab's alpha, then
+// whatever ends up under the dab is picked back up into the patch, less so the longer the smudge.
+// blend does the same with the average color under the dab instead of the pixels themselves.
+// both read and write the layer rows straight away with the vectorized span functions, on alpha only
+// layers (Channels 1) the same goes for just the coverage
+template <blend_mode Mode, int Channels>
+void smudge_dab_kernel(const dab_context& ctx, const float cx, const float cy, const float pressure, const int width, const int height, uint8_t* pixels)
+{
+	smudge_state& s = ctx.smudge;
+	int left, top, w, h;
+	const uint8_t* dab = dab_mask(ctx, cx, cy, pressure, s.mask, left, top, w, h);
+
+	int x0 = std::max(0, left), x1 = std::min(width, left + w);
+	int y0 = std::max(0, top), y1 = std::min(height, top + h);
+
+	const int patch_size = s.patch_half * 2;
+	const int patch_x = (int)lround(cx) - s.patch_half, patch_y = (int)lround(cy) - s.patch_half;
+	if (Mode == blend_mode::smudge)
+	{
+		if (!s.loaded)
+		{
+			// the first dab just picks up, laying down what's already there changes nothing
+			s.patch.assign((size_t)patch_size * patch_size * Channels, 0);
+			for (int y = std::max(0, patch_y); y < std::min(height, patch_y + patch_size); y++)
+			{
+				const int from = std::max(0, patch_x), to = std::min(width, patch_x + patch_size);
+				if (from >= to) break;
+				memcpy(s.patch.data() + ((size_t)(y - patch_y) * patch_size + from - patch_x) * Channels,
+					pixels + ((size_t)y * width + from) * Channels, (size_t)(to - from) * Channels);
+			}
+			s.loaded = true;
+		}
+		x0 = std::max(x0, patch_x);
+		x1 = std::min(x1, patch_x + patch_size);
+		y0 = std::max(y0, patch_y);
+		y1 = std::min(y1, patch_y + patch_size);
+	}
+	if (x0 >= x1 || y0 >= y1) return;
+
+	const int count = x1 - x0;
+	const uint8_t max_alpha = ctx.alpha_at(pressure);
+	const int pickup = 255 - (int)lround(ctx.smudge_length * 255);
+	s.weights.resize(count);
+
+	if (Mode == blend_mode::blend)
+	{
+		uint64_t sum[4] = {}, weight_sum = 0;
+		for (int y = y0; y < y1; y++)
+		{
+			const uint8_t* mask = dab + (size_t)(y - top) * w + x0 - left;
+			const uint8_t* row = pixels + ((size_t)y * width + x0) * Channels;
+			if (Channels == 4)
+			{
+				weighted_sum_span(row, mask, count, sum, weight_sum);
+				continue;
+			}
+			for (int i = 0; i < count; i++)
+			{
+				sum[0] += row[i] * mask[i];
+				weight_sum += mask[i];
+			}
+		}
+		if (weight_sum == 0) return;
+
+		for (int c = 0; c < Channels; c++)
+		{
+			const uint8_t average = (uint8_t)((sum[c] + weight_sum / 2) / weight_sum);
+			s.carried[c] = s.loaded ? (uint8_t)((average * pickup + s.carried[c] * (255 - pickup) + 127) / 255) : average;
+		}
+		s.loaded = true;
+
+		s.fill.resize((size_t)count * Channels);
+		for (int i = 0; i < count; i++)
+		{
+			memcpy(s.fill.data() + i * Channels, s.carried, Channels);
+		}
+	}
+
+	for (int y = y0; y < y1; y++)
+	{
+		const uint8_t* mask = dab + (size_t)(y - top) * w + x0 - left;
+		uint8_t* row = pixels + ((size_t)y * width + x0) * Channels;
+		coverage c;
+		const uint8_t* selected = ctx.mask_row(y, x0, count, c);
+		if (c == coverage::none) continue;
+		for (int i = 0; i < count; i++)
+		{
+			s.weights[i] = (uint8_t)((mask[i] * max_alpha + 127) / 255);
+		}
+		if (selected)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				s.weights[i] = mask_alpha(s.weights[i], selected[i]);
+			}
+		}
+
+		if (Mode == blend_mode::blend)
+		{
+			(Channels == 4 ? lerp_span : alpha_lerp_span)(row, s.fill.data(), s.weights.data(), count);
+			continue;
+		}
+
+		uint8_t* patch = s.patch.data() + ((size_t)(y - patch_y) * patch_size + x0 - patch_x) * Channels;
+		(Channels == 4 ? lerp_span : alpha_lerp_span)(row, patch, s.weights.data(), count);
+		for (int i = 0; i < count; i++)
+		{
+			s.weights[i] = (uint8_t)((mask[i] * pickup + 127) / 255);
 		}
+		(Channels == 4 ? lerp_span : alpha_lerp_span)(patch, row, s.weights.data(), count);
 	}
 }
 
+// smudge and blend carry 8-bit paint, they only go onto 8-bit layers
+bool can_paint(const brush& brush, const pixel_format format)
+{
+	return format != pixel_format::rgba16 || (brush.mode != blend_mode::smudge && brush.mode != blend_mode::blend);
+}
+
+// with linear, normal dabs on 8-bit rgba layers mix in linear light. other layers and brushes ignore it
+dab_context make_dab_context(const brush& brush, const color new_color, const selection* mask = nullptr, const pixel_format format = pixel_format::rgba8,
+	const bool linear = false)
+{
+	dab_context ctx;
+	ctx.format = format;
+	ctx.linear = linear && format == pixel_format::rgba8;
+	ctx.size = brush.size;
+	ctx.min_size = brush.size_pressure ? brush.min_size : brush.size;
+	ctx.opacity = new_color.a * brush.opacity / 255;
+	ctx.min_opacity = brush.opacity_pressure ? new_color.a * brush.min_opacity / 255 : ctx.opacity;
+	ctx.aa = brush.aa;
+	ctx.spacing = brush.spacing;
+	ctx.brush_color = new_color;
+	ctx.mode = brush.mode;
+	ctx.smudge_length = brush.smudge_length;
+	if (mask && mask->active()) ctx.selection_mask = mask;
+	const bool masked = ctx.selection_mask != nullptr;
+
+	if (brush.tip >= 0 && brush.tip < (int)brush_tips.size())
+	{
+		ctx.tip = brush.tip;
+		ctx.rotation = brush.rotation;
+		ctx.angle = brush.angle * 3.14159265f / 180;
+	}
+
+	const bool curve = brush.falloff != falloff_curve::hard;
+	if (curve)
+	{
+		// indexing by squared distance spends most of the entries near the edge, where the dab is widest
+		ctx.lut.resize(dab_context::lut_size);
+		for (int i = 0; i < dab_context::lut_size; i++)
+		{
+			const float u = std::sqrt(i / (float)(dab_context::lut_size - 1));
+			ctx.lut[i] = (uint16_t)lround(brush.falloff_at(u) * 32768);
+		}
+	}
+
+	if (brush.mode == blend_mode::smudge || brush.mode == blend_mode::blend)
+	{
+		ctx.smudge.patch_half = ctx.reach();
+		if (format == pixel_format::alpha8) ctx.kernel = brush.mode == blend_mode::smudge ? &smudge_dab_kernel<blend_mode::smudge, 1> : &smudge_dab_kernel<blend_mode::blend, 1>;
+		else ctx.kernel = brush.mode == blend_mode::smudge ? &smudge_dab_kernel<blend_mode::smudge, 4> : &smudge_dab_kernel<blend_mode::blend, 4>;
+		return ctx;
+	}
+
+	if (ctx.tip >= 0)
+	{
+		if (format == pixel_format::alpha8) ctx.kernel = brush.mode == blend_mode::erase ? &tip_dab_kernel<alpha_op<blend_mode::erase>> : &tip_dab_kernel<alpha_op<blend_mode::normal>>;
+		else if (format == pixel_format::rgba16) ctx.kernel = brush.mode == blend_mode::erase ? &tip_dab_kernel<deep_op<blend_mode::erase>> : &tip_dab_kernel<deep_op<blend_mode::normal>>;
+		else if (brush.mode == blend_mode::erase) ctx.kernel = &tip_dab_kernel<blend_op<blend_mode::erase>>;
+		else ctx.kernel = ctx.linear ? &tip_dab_kernel<linear_op<blend_mode::normal>> : &tip_dab_kernel<blend_op<blend_mode::normal>>;
+		return ctx;
+	}
+
+	const bool maybe_small = std::min(ctx.size, ctx.min_size) < 2;
+	ctx.kernel = brush.size_pressure
+		? pick_dab_kernel<true>(brush.opacity_pressure, maybe_small, curve, masked, brush.mode, format, ctx.linear)
+		: pick_dab_kernel<false>(brush.opacity_pressure, maybe_small, curve, masked, brush.mode, format, ctx.linear);
+	return ctx;
+}
+
+dab_context stroke_ctx_;
+
+// whether the dabs between two stroke points can be drawn as one swept shape instead
+bool can_sweep(const dab_context& ctx, const float p0, const float p1)
+{
+	// image tips aren't round, their union along a segment is no capsule
+	if (ctx.tip >= 0) return false;
+	if (ctx.mode == blend_mode::smudge || ctx.mode == blend_mode::blend) return false;
+
+	// with wide spacing the dabs are meant to be visible on their own, only sweep where the
+	// scalloping along the edge of the dab chain stays under half a pixel
+	const float r = std::max(1.0f, std::max(ctx.size_at(p0), ctx.size_at(p1)) / 2);
+	const float s = std::min(1.0f, ctx.spacing);
+	return r * (1 - std::sqrt(1 - s * s)) < .5f;
+}
+
+// draws the union of all the dabs along a segment (a capsule, tapered if the size changes)
+// blending every pixel once instead of once per overlapping dab
+template <typename Op>
+void sweep_kernel(const dab_context& ctx, const ImVec2 from, const float p0, const ImVec2 to, const float p1, const int width, const int height, uint8_t* pixels)
+{
+	const float size0 = ctx.size_at(p0), size1 = ctx.size_at(p1);
+	const float r0 = std::max(1.0f, size0 / 2), r1 = std::max(1.0f, size1 / 2);
+	const float fudge0 = std::min(1.0f, size0 / 2), fudge1 = std::min(1.0f, size1 / 2);
+	const float alpha0 = ctx.alpha_at(p0), alpha1 = ctx.alpha_at(p1);
 
+	const float len = distance(from, to);
+	if (len < .001f)
+	{
+		ctx.dab(to.x, to.y, p1, width, height, pixels);
+		return;
+	}
+	const ImVec2 dir((to.x - from.x) / len, (to.y - from.y) / len);
+
+	// the dab touching a pixel the most is the one minimizing (distance - radius) along the segment,
+	// for a linearly changing radius that's where d/dt |p - c(t)| = dr/dt, which has a closed form
+	const float dr = r1 - r0;
+	const float k = -dr / len;
+	const bool one_end_contains_other = std::abs(k) >= 1;
+	const float k_scale = one_end_contains_other ? 0 : k / std::sqrt(1 - k * k);
+	// the dab at from is the last one of the segment before and already blended, this segment's own
+	// dabs start a spacing further on
+	const float t_first = std::min(1.0f, std::max(.5f, size0 * ctx.spacing) / len);
+
+	// alpha of the dab at t along the segment
+	const auto dab_alpha = [&](const float dist, const float t)
+	{
+		return ctx.alpha_at(dist, r0 + t * dr, lerp(fudge0, fudge1, t), lerp(alpha0, alpha1, t));
+	};
+
+	const float rmax = std::max(r0, r1);
+	const int y0 = std::max(0, (int)floor(std::min(from.y, to.y) - rmax));
+	const int y1 = std::min(height - 1, (int)ceil(std::max(from.y, to.y) + rmax));
+	for (int y = y0; y <= y1; y++)
+	{
+		// only the part of the segment within reach of this row can touch it, for a diagonal stroke
+		// that's a lot less than the whole bounding box
+		const float yc = y + .5f;
+		float ta = 0, tb = 1;
+		if (to.y != from.y)
+		{
+			ta = (yc - rmax - from.y) / (to.y - from.y);
+			tb = (yc + rmax - from.y) / (to.y - from.y);
+			if (ta > tb) std::swap(ta, tb);
+			ta = std::max(0.0f, ta);
+			tb = std::min(1.0f, tb);
+			if (ta > tb) continue;
+		}
+		const float xa = lerp(from.x, to.x, ta), xb = lerp(from.x, to.x, tb);
+		const int x0 = std::max(0, (int)floor(std::min(xa, xb) - rmax));
+		const int x1 = std::min(width - 1, (int)ceil(std::max(xa, xb) + rmax));
+
+		coverage c;
+		const uint8_t* selected = x0 <= x1 ? ctx.mask_row(y, x0, x1 - x0 + 1, c) : nullptr;
+		if (x0 > x1 || c == coverage::none) continue;
+
+		uint8_t* row = pixels + (size_t)y * width * Op::pixel_size;
+		for (int x = x0; x <= x1; x++)
+		{
+			const float px = x + .5f - from.x, py = y + .5f - from.y;
+			const float along = px * dir.x + py * dir.y;
+			const float h = std::abs(px * dir.y - py * dir.x);
+
+			float t;
+			if (one_end_contains_other)
+			{
+				t = dr > 0 ? 1.0f : t_first;
+			}
+			else
+			{
+				t = std::max(t_first, std::min(1.0f, (along - k_scale * h) / len));
+			}
+
+			const float da = along - t * len;
+			const float dist = std::sqrt(da * da + h * h);
+			const float r = r0 + t * dr;
+			if (dist > r) continue;
+
+			// some dab covers this pixel fully, no need to add up the others
+			float alpha = dab_alpha(dist, t);
+			if (alpha < 255)
+			{
+				// stamping blends every dab over the pixel in turn, which adds up to 1 - prod(1 - alpha),
+				// integrate that over the dabs whose center lies in this segment and within reach
+				constexpr int samples = 8;
+				const float reach = std::sqrt(std::max(0.0f, r * r - h * h));
+				const float s0 = std::max(0.0f, along - reach), s1 = std::min(len, along + reach);
+				const float spacing = std::max(.5f, lerp(size0, size1, t) * ctx.spacing);
+				const float step = (s1 - s0) / samples;
+
+				float log_transparency = 0;
+				for (int i = 0; i < samples; i++)
+				{
+					const float s = s0 + (i + .5f) * step;
+					const float f = s / len;
+					const float ds = along - s;
+					const float a = dab_alpha(std::sqrt(ds * ds + h * h), f) / 255;
+					if (a >= 1)
+					{
+						log_transparency = -INFINITY;
+						break;
+					}
+					log_transparency += std::log(1 - a);
+				}
+				const float dabs_per_sample = step / spacing;
+				alpha = std::max(alpha, 255 * (1 - std::exp(log_transparency * dabs_per_sample)));
+			}
+			Op::pixel(row + x * Op::pixel_size, ctx.brush_color, selected ? mask_alpha((uint8_t)alpha, selected[x - x0]) : (uint8_t)alpha);
+		}
+	}
+}
+
+void sweep(const dab_context& ctx, const ImVec2 from, const float p0, const ImVec2 to, const float p1, const int width, const int height, uint8_t* pixels)
+{
+	switch (ctx.mode)
+	{
+	case blend_mode::normal:
+		if (ctx.format == pixel_format::alpha8) sweep_kernel<alpha_op<blend_mode::normal>>(ctx, from, p0, to, p1, width, height, pixels);
+		else if (ctx.format == pixel_format::rgba16) sweep_kernel<deep_op<blend_mode::normal>>(ctx, from, p0, to, p1, width, height, pixels);
+		else if (ctx.linear) sweep_kernel<linear_op<blend_mode::normal>>(ctx, from, p0, to, p1, width, height, pixels);
+		else sweep_kernel<blend_op<blend_mode::normal>>(ctx, from, p0, to, p1, width, height, pixels);
+		break;
+	case blend_mode::erase:
+		if (ctx.format == pixel_format::alpha8) sweep_kernel<alpha_op<blend_mode::erase>>(ctx, from, p0, to, p1, width, height, pixels);
+		else if (ctx.format == pixel_format::rgba16) sweep_kernel<deep_op<blend_mode::erase>>(ctx, from, p0, to, p1, width, height, pixels);
+		else sweep_kernel<blend_op<blend_mode::erase>>(ctx, from, p0, to, p1, width, height, pixels);
+		break;
+	case blend_mode::smudge:
+	case blend_mode::blend:
+		// every dab depends on the ones before it, can_sweep never lets these through
+		break;
+	}
+}
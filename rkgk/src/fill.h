@@ -0,0 +1,303 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "blend.h"
+#include "color.h"
+#include "parallel.h"
+#include "selection.h"
+
+struct fill_options
+{
+	// how far any channel can be off from the clicked pixel and still get filled
+	int tolerance = 16;
+	// look at all the layers merged instead of just the one being filled
+	bool sample_merged = false;
+	// gaps in the line art up to twice this wide don't let the fill leak through
+	int gap = 0;
+};
+
+constexpr int fill_band = 64;
+
+// marks the pixels that are within tolerance of the seed color with 1, everything else 0
+inline void fill_match(const uint8_t* sample, const int width, const int height, const uint8_t* seed, const int tolerance, uint8_t* open)
+{
+	uint32_t seed_packed;
+	memcpy(&seed_packed, seed, 4);
+	parallel_for_rows(height, fill_band, [&](const int y0, const int y1)
+	{
+		const size_t begin = (size_t)y0 * width, end = (size_t)y1 * width;
+		size_t i = begin;
+#ifdef RKGK_SSE2
+		const __m128i s = _mm_set1_epi32((int)seed_packed);
+		const __m128i tol = _mm_set1_epi8((char)std::min(255, tolerance));
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 4 <= end; i += 4)
+		{
+			const __m128i p = _mm_loadu_si128((const __m128i*)(sample + i * 4));
+			const __m128i diff = _mm_or_si128(_mm_subs_epu8(p, s), _mm_subs_epu8(s, p));
+			// every channel of the pixel within tolerance <=> the whole pixel saturates to 0
+			const __m128i within = _mm_cmpeq_epi32(_mm_subs_epu8(diff, tol), zero);
+			const int bits = _mm_movemask_ps(_mm_castsi128_ps(within));
+			open[i] = bits & 1;
+			open[i + 1] = bits >> 1 & 1;
+			open[i + 2] = bits >> 2 & 1;
+			open[i + 3] = bits >> 3 & 1;
+		}
+#endif
+		for (; i < end; i++)
+		{
+			bool within = true;
+			for (int c = 0; c < 4; c++)
+			{
+				within &= std::abs(sample[i * 4 + c] - seed[c]) <= tolerance;
+			}
+			open[i] = within;
+		}
+	});
+}
+
+inline void or_span(uint8_t* dst, const uint8_t* src, const int count)
+{
+	int i = 0;
+#ifdef RKGK_SSE2
+	for (; i + 16 <= count; i += 16)
+	{
+		const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(d, _mm_loadu_si128((const __m128i*)(src + i))));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		dst[i] |= src[i];
+	}
+}
+
+// grows the set pixels of a 0/1 mask by a square of the given radius, in place. gaps are a few
+// pixels at most, so or-ing together shifted rows (which vectorizes nicely) beats anything clever
+inline void fill_dilate(uint8_t* mask, const int width, const int height, const int radius)
+{
+	std::vector<uint8_t> rows((size_t)width * height);
+
+	parallel_for_rows(height, fill_band, [&](const int y0, const int y1)
+	{
+		for (int y = y0; y < y1; y++)
+		{
+			const uint8_t* src = mask + (size_t)y * width;
+			uint8_t* dst = rows.data() + (size_t)y * width;
+			memcpy(dst, src, width);
+			for (int k = 1; k <= radius && k < width; k++)
+			{
+				or_span(dst, src + k, width - k);
+				or_span(dst + k, src, width - k);
+			}
+		}
+	});
+
+	parallel_for_rows(height, fill_band, [&](const int y0, const int y1)
+	{
+		for (int y = y0; y < y1; y++)
+		{
+			uint8_t* dst = mask + (size_t)y * width;
+			memset(dst, 0, width);
+			for (int k = std::max(0, y - radius); k <= std::min(height - 1, y + radius); k++)
+			{
+				or_span(dst, rows.data() + (size_t)k * width, width);
+			}
+		}
+	});
+}
+
+// first x at or after from where the row doesn't hold value, 8 bytes at a time while it does
+inline int fill_skip(const uint8_t* row, int from, const int end, const uint8_t value)
+{
+	const uint64_t all = 0x0101010101010101ull * value;
+	for (; from + 8 <= end; from += 8)
+	{
+		uint64_t v;
+		memcpy(&v, row + from, 8);
+		if (v != all) break;
+	}
+	while (from < end && row[from] == value) from++;
+	return from;
+}
+
+struct fill_bounds
+{
+	int x0, y0, x1, y1; // inclusive
+};
+
+// scanline flood fill over the pixels marked 1, marking the reached ones 2. a stack of run starts
+// instead of recursion, so memory only depends on how many runs the region has
+inline fill_bounds fill_scanline(uint8_t* mask, const int width, const int height, const int seed_x, const int seed_y)
+{
+	fill_bounds bounds{ seed_x, seed_y, seed_x, seed_y };
+	struct seed
+	{
+		int x, y;
+	};
+	std::vector<seed> stack;
+	stack.push_back({ seed_x, seed_y });
+
+	while (!stack.empty())
+	{
+		const seed s = stack.back();
+		stack.pop_back();
+		uint8_t* row = mask + (size_t)s.y * width;
+		if (row[s.x] != 1) continue;
+
+		int left = s.x, right = s.x;
+		while (left > 0 && row[left - 1] == 1) left--;
+		right = fill_skip(row, right, width, 1) - 1;
+		memset(row + left, 2, right - left + 1);
+		bounds.x0 = std::min(bounds.x0, left);
+		bounds.x1 = std::max(bounds.x1, right);
+		bounds.y0 = std::min(bounds.y0, s.y);
+		bounds.y1 = std::max(bounds.y1, s.y);
+
+		// one seed per run of fillable pixels touching this one, above and below
+		for (const int ny : { s.y - 1, s.y + 1 })
+		{
+			if (ny < 0 || ny >= height) continue;
+			const uint8_t* next = mask + (size_t)ny * width;
+			// coming back to rows that are already filled is the common case, skip those quickly
+			for (int x = fill_skip(next, left, right + 1, 2); x <= right; x = fill_skip(next, x, right + 1, 2))
+			{
+				if (next[x] != 1)
+				{
+					x++;
+					continue;
+				}
+				stack.push_back({ x, ny });
+				x = fill_skip(next, x, right + 1, 1);
+			}
+		}
+	}
+	return bounds;
+}
+
+// bucket fill: the region around (x, y) in sample that's within tolerance of the clicked color gets
+// filled with new_color in target. returns false if nothing was filled
+inline bool flood_fill(const int x, const int y, const uint8_t* sample, uint8_t* target, const int width, const int height, const color new_color, const fill_options& options, const selection* mask = nullptr)
+{
+	if (x < 0 || y < 0 || x >= width || y >= height) return false;
+
+	const size_t count = (size_t)width * height;
+	const size_t seed = (size_t)y * width + x;
+	std::vector<uint8_t> open(count);
+	fill_match(sample, width, height, sample + seed * 4, options.tolerance, open.data());
+
+	std::vector<uint8_t> region;
+	if (options.gap > 0)
+	{
+		// thicken the walls so the fill can't squeeze through small gaps, then grow the result back
+		// by the same amount so it still reaches the lines
+		region.resize(count);
+		parallel_for_rows(height, fill_band, [&](const int y0, const int y1)
+		{
+			for (size_t i = (size_t)y0 * width; i < (size_t)y1 * width; i++)
+			{
+				region[i] = !open[i];
+			}
+		});
+		fill_dilate(region.data(), width, height, options.gap);
+		parallel_for_rows(height, fill_band, [&](const int y0, const int y1)
+		{
+			for (size_t i = (size_t)y0 * width; i < (size_t)y1 * width; i++)
+			{
+				region[i] = open[i] && !region[i];
+			}
+		});
+		// clicked right into a gap, just fill without closing any
+		if (!region[seed]) region = open;
+	}
+	else
+	{
+		region = open;
+	}
+
+	fill_bounds bounds = fill_scanline(region.data(), width, height, x, y);
+
+	// from here on only the filled area matters, usually one panel of a big page
+	if (options.gap > 0)
+	{
+		bounds.x0 = std::max(0, bounds.x0 - options.gap);
+		bounds.y0 = std::max(0, bounds.y0 - options.gap);
+		bounds.x1 = std::min(width - 1, bounds.x1 + options.gap);
+		bounds.y1 = std::min(height - 1, bounds.y1 + options.gap);
+		const int w = bounds.x1 - bounds.x0 + 1, h = bounds.y1 - bounds.y0 + 1;
+		std::vector<uint8_t> grown((size_t)w * h);
+		for (int row_y = 0; row_y < h; row_y++)
+		{
+			const uint8_t* src = region.data() + (size_t)(bounds.y0 + row_y) * width + bounds.x0;
+			for (int row_x = 0; row_x < w; row_x++)
+			{
+				grown[(size_t)row_y * w + row_x] = src[row_x] == 2;
+			}
+		}
+		fill_dilate(grown.data(), w, h, options.gap);
+		for (int row_y = 0; row_y < h; row_y++)
+		{
+			const size_t offset = (size_t)(bounds.y0 + row_y) * width + bounds.x0;
+			for (int row_x = 0; row_x < w; row_x++)
+			{
+				region[offset + row_x] = grown[(size_t)row_y * w + row_x] && open[offset + row_x] ? 2 : 0;
+			}
+		}
+	}
+
+	parallel_for_rows(bounds.y1 - bounds.y0 + 1, fill_band, [&](const int y0, const int y1)
+	{
+		std::vector<uint8_t> selected(mask ? width : 0);
+		for (int row_y = bounds.y0 + y0; row_y < bounds.y0 + y1; row_y++)
+		{
+			const uint8_t* row = region.data() + (size_t)row_y * width;
+			uint8_t* pixels = target + (size_t)row_y * width * 4;
+			for (int run_x = fill_skip(row, bounds.x0, bounds.x1 + 1, 0); run_x <= bounds.x1; run_x = fill_skip(row, run_x, bounds.x1 + 1, 0))
+			{
+				if (row[run_x] != 2)
+				{
+					run_x++;
+					continue;
+				}
+				const int start = run_x;
+				run_x = fill_skip(row, run_x, bounds.x1 + 1, 2);
+				const coverage c = mask ? mask->row(row_y, start, run_x - start, selected.data()) : coverage::all;
+				if (c == coverage::all)
+				{
+					blend_span(pixels + start * 4, run_x - start, new_color, new_color.a);
+				}
+				else if (c == coverage::partial)
+				{
+					blend_span_masked(pixels + start * 4, run_x - start, new_color, new_color.a, selected.data());
+				}
+			}
+		}
+	});
+	return true;
+}
+
+// the magic wand is a fill into the selection instead of the layer
+inline void magic_wand(selection& sel, const selection_op op, const int x, const int y, const uint8_t* sample, const int width, const int height, const fill_options& options)
+{
+	if (x < 0 || y < 0 || x >= width || y >= height) return;
+
+	std::vector<uint8_t> region((size_t)width * height);
+	fill_match(sample, width, height, sample + ((size_t)y * width + x) * 4, options.tolerance, region.data());
+	const fill_bounds bounds = fill_scanline(region.data(), width, height, x, y);
+
+	const int w = bounds.x1 - bounds.x0 + 1, h = bounds.y1 - bounds.y0 + 1;
+	std::vector<uint8_t> values((size_t)w * h);
+	for (int row_y = 0; row_y < h; row_y++)
+	{
+		const uint8_t* src = region.data() + (size_t)(bounds.y0 + row_y) * width + bounds.x0;
+		for (int row_x = 0; row_x < w; row_x++)
+		{
+			values[(size_t)row_y * w + row_x] = src[row_x] == 2 ? 255 : 0;
+		}
+	}
+	sel.mask(op, values.data(), bounds.x0, bounds.y0, w, h);
+}
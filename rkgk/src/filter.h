@@ -0,0 +1,276 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "blend.h"
+#include "parallel.h"
+
+constexpr int filter_tile = 64;
+
+// box [x0, x1) * [y0, y1) around the tiles with anything that isn't fully transparent, false if
+// there's nothing. filters leave transparent areas transparent, so they can skip the rest. pixel_size
+// is in bytes, see pixel_format
+inline bool content_bounds(const uint8_t* pixels, const int width, const int height, int& x0, int& y0, int& x1, int& y1, const int pixel_size = 4)
+{
+	const int tiles_x = (width + filter_tile - 1) / filter_tile, tiles_y = (height + filter_tile - 1) / filter_tile;
+	std::vector<uint8_t> used((size_t)tiles_x * tiles_y);
+	parallel_for(tiles_y, [&](const int first, const int last)
+	{
+		for (int ty = first; ty < last; ty++)
+		{
+			for (int y = ty * filter_tile; y < std::min(height, (ty + 1) * filter_tile); y++)
+			{
+				const uint8_t* row = pixels + (size_t)y * width * pixel_size;
+				for (int tx = 0; tx < tiles_x; tx++)
+				{
+					uint8_t& u = used[(size_t)ty * tiles_x + tx];
+					if (u) continue;
+					const int from = tx * filter_tile, to = std::min(width, (tx + 1) * filter_tile);
+					uint64_t any = 0;
+					if (pixel_size == 1)
+					{
+						for (int x = from; x < to; x++) any |= row[x];
+					}
+					else if (pixel_size == 8)
+					{
+						for (int x = from; x < to; x++) any |= ((const uint64_t*)row)[x];
+						any >>= 48;
+					}
+					else
+					{
+						// alpha is the top byte on little endian
+						for (int x = from; x < to; x++) any |= ((const uint32_t*)row)[x];
+						any >>= 24;
+					}
+					u = any != 0;
+				}
+			}
+		}
+	});
+
+	x0 = width;
+	y0 = height;
+	x1 = y1 = 0;
+	for (int ty = 0; ty < tiles_y; ty++)
+	{
+		for (int tx = 0; tx < tiles_x; tx++)
+		{
+			if (!used[(size_t)ty * tiles_x + tx]) continue;
+			x0 = std::min(x0, tx * filter_tile);
+			y0 = std::min(y0, ty * filter_tile);
+			x1 = std::max(x1, std::min(width, (tx + 1) * filter_tile));
+			y1 = std::max(y1, std::min(height, (ty + 1) * filter_tile));
+		}
+	}
+	return x0 < x1;
+}
+
+// radii of three box blurs that add up to a gaussian of sigma
+inline void gaussian_boxes(const float sigma, int radii[3])
+{
+	const float ideal = std::sqrt(12 * sigma * sigma / 3 + 1);
+	int lower = (int)ideal;
+	if (lower % 2 == 0) lower--;
+	const float ideal_count = (12 * sigma * sigma - 3 * lower * lower - 12 * lower - 9) / (-4.0f * lower - 4);
+	const int count = (int)lround(ideal_count);
+	for (int i = 0; i < 3; i++)
+	{
+		radii[i] = ((i < count ? lower : lower + 2) - 1) / 2;
+	}
+}
+
+// how far gaussian_blur spreads a pixel
+inline int blur_reach(const float radius)
+{
+	int radii[3];
+	gaussian_boxes(radius / 3, radii);
+	return radii[0] + radii[1] + radii[2];
+}
+
+#ifdef RKGK_SSE2
+inline __m128i load_wide_sse2(const uint16_t* p)
+{
+	return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+}
+
+// the average of a running sum as four uint16s, there's no unsigned 32 -> 16 pack before sse4.1
+inline void store_average_sse2(uint16_t* p, const __m128i sum, const __m128 inv_window)
+{
+	const __m128i average = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sum), inv_window));
+	const __m128i biased = _mm_packs_epi32(_mm_sub_epi32(average, _mm_set1_epi32(32768)), _mm_setzero_si128());
+	_mm_storel_epi64((__m128i*)p, _mm_xor_si128(biased, _mm_set1_epi16((short)0x8000)));
+}
+#endif
+
+// box blur along a line of premultiplied 16-bit pixels, the ends repeat
+inline void box_line(const uint16_t* src, uint16_t* dst, const int count, const int radius)
+{
+	const int window = radius * 2 + 1;
+	const auto at = [&](const int i) { return src + std::max(0, std::min(count - 1, i)) * 4; };
+#ifdef RKGK_SSE2
+	const __m128 inv_window = _mm_set1_ps(1.0f / window);
+	__m128i sum = _mm_setzero_si128();
+	for (int i = -radius; i <= radius; i++)
+	{
+		sum = _mm_add_epi32(sum, load_wide_sse2(at(i)));
+	}
+	for (int i = 0; i < count; i++)
+	{
+		store_average_sse2(dst + i * 4, sum, inv_window);
+		sum = _mm_add_epi32(sum, _mm_sub_epi32(load_wide_sse2(at(i + radius + 1)), load_wide_sse2(at(i - radius))));
+	}
+#else
+	int sum[4] = {};
+	for (int i = -radius; i <= radius; i++)
+	{
+		for (int c = 0; c < 4; c++) sum[c] += at(i)[c];
+	}
+	for (int i = 0; i < count; i++)
+	{
+		const uint16_t* add = at(i + radius + 1);
+		const uint16_t* sub = at(i - radius);
+		for (int c = 0; c < 4; c++)
+		{
+			dst[i * 4 + c] = (uint16_t)((sum[c] + window / 2) / window);
+			sum[c] += add[c] - sub[c];
+		}
+	}
+#endif
+}
+
+// the same down a strip of columns, walking it row by row so the reads stay sequential
+inline void box_columns(const uint16_t* src, uint16_t* dst, const int width, const int height, const int radius)
+{
+	const int window = radius * 2 + 1;
+	const auto at = [&](const int y) { return src + (size_t)std::max(0, std::min(height - 1, y)) * width * 4; };
+#ifdef RKGK_SSE2
+	const __m128 inv_window = _mm_set1_ps(1.0f / window);
+	std::vector<int32_t> sum_storage((size_t)width * 4);
+	__m128i* sums = (__m128i*)sum_storage.data();
+	for (int i = -radius; i <= radius; i++)
+	{
+		const uint16_t* row = at(i);
+		for (int x = 0; x < width; x++)
+		{
+			_mm_storeu_si128(sums + x, _mm_add_epi32(_mm_loadu_si128(sums + x), load_wide_sse2(row + x * 4)));
+		}
+	}
+	for (int y = 0; y < height; y++)
+	{
+		uint16_t* out = dst + (size_t)y * width * 4;
+		const uint16_t* add = at(y + radius + 1);
+		const uint16_t* sub = at(y - radius);
+		for (int x = 0; x < width; x++)
+		{
+			const __m128i sum = _mm_loadu_si128(sums + x);
+			store_average_sse2(out + x * 4, sum, inv_window);
+			_mm_storeu_si128(sums + x, _mm_add_epi32(sum, _mm_sub_epi32(load_wide_sse2(add + x * 4), load_wide_sse2(sub + x * 4))));
+		}
+	}
+#else
+	std::vector<int> sums((size_t)width * 4);
+	for (int i = -radius; i <= radius; i++)
+	{
+		const uint16_t* row = at(i);
+		for (int x = 0; x < width * 4; x++) sums[x] += row[x];
+	}
+	for (int y = 0; y < height; y++)
+	{
+		uint16_t* out = dst + (size_t)y * width * 4;
+		const uint16_t* add = at(y + radius + 1);
+		const uint16_t* sub = at(y - radius);
+		for (int x = 0; x < width * 4; x++)
+		{
+			out[x] = (uint16_t)((sums[x] + window / 2) / window);
+			sums[x] += add[x] - sub[x];
+		}
+	}
+#endif
+}
+
+// 8-bit straight alpha to 16-bit premultiplied (color * alpha, alpha * 255) and back
+inline void premultiply_span(const uint8_t* src, uint16_t* dst, const int count)
+{
+	for (int i = 0; i < count; i++, src += 4, dst += 4)
+	{
+		dst[0] = (uint16_t)(src[0] * src[3]);
+		dst[1] = (uint16_t)(src[1] * src[3]);
+		dst[2] = (uint16_t)(src[2] * src[3]);
+		dst[3] = (uint16_t)(src[3] * 255);
+	}
+}
+
+inline void unpremultiply_span(const uint16_t* src, uint8_t* dst, const int count)
+{
+	for (int i = 0; i < count; i++, src += 4, dst += 4)
+	{
+		const int a = src[3];
+		if (a < 128)
+		{
+			memset(dst, 0, 4);
+			continue;
+		}
+		const float scale = 255.0f / a;
+		for (int c = 0; c < 3; c++)
+		{
+			dst[c] = (uint8_t)std::min(255, (int)(src[c] * scale + .5f));
+		}
+		dst[3] = (uint8_t)((a + 127) / 255);
+	}
+}
+
+// gaussian blur reaching about radius pixels, as three box blurs each way on premultiplied colors.
+// src and dst are whole images, only the part with something in it (and as far as that spreads) is
+// blurred, the rest is copied over
+inline void gaussian_blur(const uint8_t* src, uint8_t* dst, const int width, const int height, const float radius)
+{
+	if (dst != src) memcpy(dst, src, (size_t)width * height * 4);
+	int radii[3];
+	gaussian_boxes(radius / 3, radii);
+	const int reach = radii[0] + radii[1] + radii[2];
+	int x0, y0, x1, y1;
+	if (reach == 0 || !content_bounds(src, width, height, x0, y0, x1, y1)) return;
+	x0 = std::max(0, x0 - reach);
+	y0 = std::max(0, y0 - reach);
+	x1 = std::min(width, x1 + reach);
+	y1 = std::min(height, y1 + reach);
+	const int w = x1 - x0, h = y1 - y0;
+
+	// rows first, into a 16-bit copy of the box
+	std::vector<uint16_t> rows((size_t)w * h * 4);
+	parallel_for_rows(h, filter_tile, [&](const int first, const int last)
+	{
+		std::vector<uint16_t> a((size_t)w * 4), b((size_t)w * 4);
+		for (int y = first; y < last; y++)
+		{
+			premultiply_span(src + ((size_t)(y0 + y) * width + x0) * 4, a.data(), w);
+			box_line(a.data(), b.data(), w, radii[0]);
+			box_line(b.data(), a.data(), w, radii[1]);
+			box_line(a.data(), rows.data() + (size_t)y * w * 4, w, radii[2]);
+		}
+	});
+
+	// then the columns a tile wide strip at a time
+	parallel_for_rows(w, filter_tile, [&](const int first, const int last)
+	{
+		std::vector<uint16_t> a((size_t)filter_tile * h * 4), b((size_t)filter_tile * h * 4);
+		for (int strip_x = first; strip_x < last; strip_x += filter_tile)
+		{
+			const int strip = std::min(filter_tile, last - strip_x);
+			for (int y = 0; y < h; y++)
+			{
+				memcpy(a.data() + (size_t)y * strip * 4, rows.data() + ((size_t)y * w + strip_x) * 4, (size_t)strip * 8);
+			}
+			box_columns(a.data(), b.data(), strip, h, radii[0]);
+			box_columns(b.data(), a.data(), strip, h, radii[1]);
+			box_columns(a.data(), b.data(), strip, h, radii[2]);
+			for (int y = 0; y < h; y++)
+			{
+				unpremultiply_span(b.data() + (size_t)y * strip * 4, dst + ((size_t)(y0 + y) * width + x0 + strip_x) * 4, strip);
+			}
+		}
+	});
+}
@@ -3,4 +3,59 @@
 inline void setup_gui_style(const ImGuiIO& io)
 {
 	ImGui::StyleColorsClassic();
-}
\ No newline at end of file
+}
+
+// plots eval(u) for u in 0..1, the points (if any) are evenly spaced along u and can be dragged up and down
+template <typename Eval>
+bool curve_editor(const char* label, float* points, const int count, Eval eval)
+{
+	const ImVec2 size(ImGui::CalcItemWidth(), 100);
+	const ImVec2 pos = ImGui::GetCursorScreenPos();
+	const ImVec2 end(pos.x + size.x, pos.y + size.y);
+	ImGui::InvisibleButton(label, size);
+
+	const auto to_screen = [&](const float u, const float v)
+	{
+		return ImVec2(pos.x + u * size.x, pos.y + (1 - v) * size.y);
+	};
+
+	bool changed = false;
+	ImGuiStorage* storage = ImGui::GetStateStorage();
+	const ImGuiID dragged_id = ImGui::GetItemID();
+	if (count > 1 && ImGui::IsItemActive())
+	{
+		const ImVec2 mouse = ImGui::GetIO().MousePos;
+		// grab the nearest point when the drag starts and stick with it
+		if (ImGui::IsItemActivated())
+		{
+			const float u = (mouse.x - pos.x) / size.x;
+			storage->SetInt(dragged_id, std::max(0, std::min(count - 1, (int)lround(u * (count - 1)))));
+		}
+		const int i = storage->GetInt(dragged_id);
+		const float v = std::max(0.0f, std::min(1.0f, 1 - (mouse.y - pos.y) / size.y));
+		if (points[i] != v)
+		{
+			points[i] = v;
+			changed = true;
+		}
+	}
+
+	ImDrawList* drawlist = ImGui::GetWindowDrawList();
+	drawlist->AddRectFilled(pos, end, ImGui::GetColorU32(ImGuiCol_FrameBg));
+	constexpr int segments = 64;
+	ImVec2 line[segments + 1];
+	for (int i = 0; i <= segments; i++)
+	{
+		const float u = i / (float)segments;
+		line[i] = to_screen(u, eval(u));
+	}
+	drawlist->AddPolyline(line, segments + 1, ImGui::GetColorU32(ImGuiCol_PlotLines), 0, 2);
+	for (int i = 0; i < count; i++)
+	{
+		drawlist->AddCircleFilled(to_screen(i / (float)(count - 1), points[i]), 4, ImGui::GetColorU32(ImGuiCol_SliderGrab));
+	}
+
+	ImGui::SameLine();
+	ImGui::TextUnformatted(label);
+	return changed;
+}
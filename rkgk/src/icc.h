@@ -0,0 +1,267 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "blend.h"
+
+// an rgb icc profile of the matrix/trc kind, which is what monitor calibration makes. lut based
+// profiles (printers mostly) aren't supported
+struct icc_profile
+{
+	// colorants, rgb to d50 xyz
+	float matrix[3][3] = {};
+	// tone curves per channel as icc parametric curves, type 0 to 4 with params g, a, b, c, d, e, f.
+	// a sampled curve goes into table instead
+	struct curve
+	{
+		int type = 0;
+		float params[7] = { 1, 1, 0, 0, 0, 0, 0 };
+		std::vector<float> table;
+
+		float eval(const float x) const
+		{
+			if (!table.empty())
+			{
+				const float pos = std::max(0.0f, std::min(1.0f, x)) * (table.size() - 1);
+				const int i = std::min((int)table.size() - 2, (int)pos);
+				return table[i] + (table[i + 1] - table[i]) * (pos - i);
+			}
+			const float g = params[0], a = params[1], b = params[2], c = params[3], d = params[4], e = params[5], f = params[6];
+			const auto power = [&](const float v) { return v > 0 ? std::pow(v, g) : 0.0f; };
+			switch (type)
+			{
+			case 1: return x >= -b / a ? power(a * x + b) : 0;
+			case 2: return x >= -b / a ? power(a * x + b) + c : c;
+			case 3: return x >= d ? power(a * x + b) : c * x;
+			case 4: return x >= d ? power(a * x + b) + e : c * x + f;
+			default: return power(x);
+			}
+		}
+	} curves[3];
+
+	static icc_profile srgb()
+	{
+		icc_profile p;
+		const float m[3][3] = { { .4360747f, .3850649f, .1430804f }, { .2225045f, .7168786f, .0606169f }, { .0139322f, .0971045f, .7141733f } };
+		memcpy(p.matrix, m, sizeof m);
+		for (auto& c : p.curves)
+		{
+			c.type = 3;
+			const float params[7] = { 2.4f, 1 / 1.055f, .055f / 1.055f, 1 / 12.92f, .04045f, 0, 0 };
+			memcpy(c.params, params, sizeof params);
+		}
+		return p;
+	}
+
+	// false if it isn't a profile this can use
+	bool load(const std::string& path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		const std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (data.size() < 132 || memcmp(data.data() + 16, "RGB ", 4) != 0 || memcmp(data.data() + 20, "XYZ ", 4) != 0) return false;
+
+		const auto u16 = [&](const size_t at) { return at + 2 <= data.size() ? (uint32_t)(data[at] << 8 | data[at + 1]) : 0u; };
+		const auto u32 = [&](const size_t at) { return u16(at) << 16 | u16(at + 2); };
+		const auto s15 = [&](const size_t at) { return (int32_t)u32(at) / 65536.0f; };
+		// where a tag's data starts, 0 if there's no such tag
+		const auto find = [&](const char* sig) -> size_t
+		{
+			const uint32_t count = u32(128);
+			for (uint32_t i = 0; i < count && 132 + i * 12 + 12 <= data.size(); i++)
+			{
+				const size_t entry = 132 + i * 12;
+				if (memcmp(data.data() + entry, sig, 4) == 0 && u32(entry + 4) + 12 <= data.size()) return u32(entry + 4);
+			}
+			return 0;
+		};
+
+		const char* colorants[3] = { "rXYZ", "gXYZ", "bXYZ" };
+		const char* trcs[3] = { "rTRC", "gTRC", "bTRC" };
+		for (int ch = 0; ch < 3; ch++)
+		{
+			const size_t xyz = find(colorants[ch]), trc = find(trcs[ch]);
+			if (!xyz || !trc || memcmp(data.data() + xyz, "XYZ ", 4) != 0) return false;
+			for (int row = 0; row < 3; row++)
+			{
+				matrix[row][ch] = s15(xyz + 8 + row * 4);
+			}
+
+			curve& c = curves[ch];
+			if (memcmp(data.data() + trc, "curv", 4) == 0)
+			{
+				const uint32_t count = u32(trc + 8);
+				c = curve();
+				if (count == 1) c.params[0] = u16(trc + 12) / 256.0f;
+				for (uint32_t i = 0; count > 1 && i < count && trc + 12 + i * 2 + 2 <= data.size(); i++)
+				{
+					c.table.push_back(u16(trc + 12 + i * 2) / 65535.0f);
+				}
+			}
+			else if (memcmp(data.data() + trc, "para", 4) == 0)
+			{
+				static const int param_count[5] = { 1, 3, 4, 5, 7 };
+				c = curve();
+				c.type = u16(trc + 8);
+				if (c.type > 4) return false;
+				for (int i = 0; i < param_count[c.type]; i++)
+				{
+					c.params[i] = s15(trc + 12 + i * 4);
+				}
+			}
+			else
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+inline void invert3x3(const float m[3][3], float out[3][3])
+{
+	const float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+		+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	const float inv = det != 0 ? 1 / det : 0;
+	out[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv;
+	out[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv;
+	out[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv;
+	out[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv;
+	out[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv;
+	out[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv;
+	out[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv;
+	out[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv;
+	out[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv;
+}
+
+// one profile's rgb to another's, relative colorimetric with out of gamut colors clipped. the whole
+// conversion is baked into a 3d lut over the source bytes once, applying it is tetrahedral
+// interpolation between 4 of the grid points around each color. empty does nothing
+struct color_transform
+{
+	static constexpr int grid = 33;
+	// r, g, b and a pad per grid point, 0 to 255 * 128 so 4 weights out of 256 times a node fit an int
+	// and the nodes fit the signed 16 bit lanes madd wants
+	std::vector<int16_t> lut;
+
+	bool empty() const { return lut.empty(); }
+
+	static color_transform between(const icc_profile& from, const icc_profile& to)
+	{
+		color_transform t;
+		float to_inverse[3][3];
+		invert3x3(to.matrix, to_inverse);
+		// the destination's curves sampled, evenly in what they encode to so inverting them by search
+		// stays accurate where they're steep near black
+		constexpr int samples = 4096;
+		std::vector<float> forward[3];
+		for (int ch = 0; ch < 3; ch++)
+		{
+			forward[ch].resize(samples);
+			for (int i = 0; i < samples; i++)
+			{
+				forward[ch][i] = to.curves[ch].eval(i / (float)(samples - 1));
+			}
+		}
+
+		t.lut.resize(grid * grid * grid * 4);
+		for (int b = 0; b < grid; b++)
+		{
+			for (int g = 0; g < grid; g++)
+			{
+				for (int r = 0; r < grid; r++)
+				{
+					const float rgb[3] = { from.curves[0].eval(r / (grid - 1.0f)), from.curves[1].eval(g / (grid - 1.0f)), from.curves[2].eval(b / (grid - 1.0f)) };
+					float xyz[3];
+					for (int row = 0; row < 3; row++)
+					{
+						xyz[row] = from.matrix[row][0] * rgb[0] + from.matrix[row][1] * rgb[1] + from.matrix[row][2] * rgb[2];
+					}
+					int16_t* node = t.lut.data() + ((b * grid + g) * grid + r) * 4;
+					for (int ch = 0; ch < 3; ch++)
+					{
+						const float linear = std::max(0.0f, std::min(1.0f, to_inverse[ch][0] * xyz[0] + to_inverse[ch][1] * xyz[1] + to_inverse[ch][2] * xyz[2]));
+						const std::vector<float>& f = forward[ch];
+						const int k = std::max(1, std::min(samples - 1, (int)(std::lower_bound(f.begin(), f.end(), linear) - f.begin())));
+						const float span = f[k] - f[k - 1];
+						const float encoded = (k - 1 + (span > 0 ? std::max(0.0f, std::min(1.0f, (linear - f[k - 1]) / span)) : 0)) / (samples - 1);
+						node[ch] = (int16_t)lround(encoded * 255 * 128);
+					}
+					node[3] = 0;
+				}
+			}
+		}
+		return t;
+	}
+
+	// rgb through the lut, alpha left alone. the grid position of a byte is v * 32 / 255 in 8 bit
+	// fixed point. the cube around it splits into 6 tetrahedra by which of the fractions is biggest,
+	// the color is a mix of the 4 corners of the one it's in
+	void apply(uint8_t* pixels, const int count) const
+	{
+		if (lut.empty()) return;
+		const int16_t* nodes = lut.data();
+		const int step[3] = { 4, grid * 4, grid * grid * 4 };
+		// runs of the same color (flat fills, the paper) only get looked up once. no rgb is all ones
+		uint32_t last_in = ~0u, last_out = 0;
+		for (int i = 0; i < count; i++, pixels += 4)
+		{
+			uint32_t pixel;
+			memcpy(&pixel, pixels, 4);
+			const uint32_t in = pixel & 0xffffff;
+			if (in != last_in)
+			{
+				last_in = in;
+				last_out = lookup(nodes, step, in);
+			}
+			pixel = last_out | (pixel & 0xff000000);
+			memcpy(pixels, &pixel, 4);
+		}
+	}
+
+	// rgb packed like a little endian pixel, out the same way
+	static uint32_t lookup(const int16_t* nodes, const int step[3], const uint32_t in)
+	{
+		int base = 0, f[3], next[3];
+		for (int ch = 0; ch < 3; ch++)
+		{
+			const int pos = (in >> ch * 8 & 255) * (grid - 1) * 256 / 255;
+			f[ch] = pos & 255;
+			base += (pos >> 8) * step[ch];
+			next[ch] = (pos >> 8) < grid - 1 ? step[ch] : 0;
+		}
+		// the corners after the first are reached by stepping along the axes, biggest fraction first.
+		// picked with selects rather than branches, which of the 6 it is changes from pixel to pixel
+		const int f_max = std::max(f[0], std::max(f[1], f[2])), f_min = std::min(f[0], std::min(f[1], f[2]));
+		const int f_mid = f[0] + f[1] + f[2] - f_max - f_min;
+		const int next_max = f[0] == f_max ? next[0] : f[1] == f_max ? next[1] : next[2];
+		const int next_min = f[2] == f_min ? next[2] : f[1] == f_min ? next[1] : next[0];
+		const int16_t* c0 = nodes + base;
+		const int16_t* c1 = c0 + next_max;
+		const int16_t* c3 = c0 + next[0] + next[1] + next[2];
+		const int16_t* c2 = c3 - next_min;
+		const int w0 = 256 - f_max, w1 = f_max - f_mid, w2 = f_mid - f_min, w3 = f_min;
+#ifdef RKGK_SSE2
+		// corners interleaved in pairs so one madd is two corners times their weights for every channel
+		const __m128i a = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)c0), _mm_loadl_epi64((const __m128i*)c1));
+		const __m128i b = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)c2), _mm_loadl_epi64((const __m128i*)c3));
+		__m128i sum = _mm_add_epi32(_mm_madd_epi16(a, _mm_set1_epi32(w0 | w1 << 16)), _mm_madd_epi16(b, _mm_set1_epi32(w2 | w3 << 16)));
+		sum = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << 14)), 15);
+		sum = _mm_packs_epi32(sum, sum);
+		// the pad lane is 0
+		return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+#else
+		uint32_t out = 0;
+		for (int ch = 0; ch < 3; ch++)
+		{
+			out |= (uint32_t)((c0[ch] * w0 + c1[ch] * w1 + c2[ch] * w2 + c3[ch] * w3 + (1 << 14)) >> 15) << ch * 8;
+		}
+		return out;
+#endif
+	}
+};
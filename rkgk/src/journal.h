@@ -0,0 +1,316 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "brush.h"
+#include "color.h"
+#include "document.h"
+
+enum class journal_record : uint8_t
+{
+	stroke,
+	// something happened that can't be replayed (a fill, a filter, a new layer..), replaying stops here. the
+	// autosave after it has all of it
+	barrier
+};
+
+struct journal_sample
+{
+	float x, y, pressure;
+	float time; // seconds since the stroke started
+};
+
+// a stroke as the journal has it, enough to paint it again the same way
+struct journal_stroke
+{
+	uint64_t seq = 0;
+	journal_record type = journal_record::barrier;
+	int layer_id = 0;
+	uint32_t layers = 0; // layers_checksum when it was painted
+	color paint;
+	bool linear = false;
+	brush settings = brush(std::string());
+	std::vector<journal_sample> samples;
+};
+
+inline uint32_t journal_checksum(const uint8_t* data, const size_t size)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// the layers' settings and order, a stroke can only be painted again on the layers it was painted on
+inline uint32_t layers_checksum(const ImVector<layer>& layers)
+{
+	index_writer settings;
+	for (const layer& l : layers) write_layer_settings(settings, l);
+	return journal_checksum(settings.bytes.data(), settings.bytes.size());
+}
+
+inline void write_brush(index_writer& out, const brush& b)
+{
+	out.put(b.size);
+	out.put(b.min_size);
+	out.put((int32_t)b.opacity);
+	out.put((int32_t)b.min_opacity);
+	out.put((uint8_t)b.size_pressure);
+	out.put((uint8_t)b.opacity_pressure);
+	out.put(b.spacing);
+	out.put(b.aa);
+	out.put((uint8_t)b.mode);
+	out.put((uint8_t)b.falloff);
+	out.put(b.hardness);
+	for (const float point : b.curve) out.put(point);
+	out.put((int32_t)b.tip);
+	out.put((uint8_t)b.rotation);
+	out.put(b.angle);
+	out.put(b.smudge_length);
+}
+
+inline void read_brush(index_reader& in, brush& b)
+{
+	b.size = in.get<float>();
+	b.min_size = in.get<float>();
+	b.opacity = in.get<int32_t>();
+	b.min_opacity = in.get<int32_t>();
+	b.size_pressure = in.get<uint8_t>() != 0;
+	b.opacity_pressure = in.get<uint8_t>() != 0;
+	b.spacing = in.get<float>();
+	b.aa = in.get<float>();
+	b.mode = (blend_mode)std::min<uint8_t>(in.get<uint8_t>(), (uint8_t)blend_mode::blend);
+	b.falloff = (falloff_curve)std::min<uint8_t>(in.get<uint8_t>(), (uint8_t)falloff_curve::custom);
+	b.hardness = in.get<float>();
+	for (float& point : b.curve) point = in.get<float>();
+	b.tip = in.get<int32_t>();
+	b.rotation = (tip_rotation)std::min<uint8_t>(in.get<uint8_t>(), (uint8_t)tip_rotation::pressure);
+	b.angle = in.get<float>();
+	b.smudge_length = in.get<float>();
+}
+
+// everything in a journal file that made it to the disk whole, in order, and how many bytes of it that is. a
+// crash halfway through writing a record leaves it cut off or garbled, that and anything after it is ignored
+inline size_t read_journal(const std::string& path, std::vector<journal_stroke>& records)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr) return 0;
+	size_t valid = 0;
+	std::vector<uint8_t> payload;
+	uint32_t frame[2];
+	while (fread(frame, sizeof(frame), 1, file) == 1)
+	{
+		// a torn tail's length can be anything, it's not worth trying to allocate
+		if (frame[0] > (1u << 28)) break;
+		payload.resize(frame[0]);
+		if (fread(payload.data(), 1, payload.size(), file) != payload.size()
+			|| journal_checksum(payload.data(), payload.size()) != frame[1]) break;
+		index_reader in = { payload.data(), payload.data() + payload.size() };
+		journal_stroke record;
+		record.type = (journal_record)in.get<uint8_t>();
+		record.seq = in.get<uint64_t>();
+		if (record.type == journal_record::stroke)
+		{
+			record.layer_id = in.get<int32_t>();
+			record.layers = in.get<uint32_t>();
+			record.paint = in.get<color>();
+			record.linear = in.get<uint8_t>() != 0;
+			read_brush(in, record.settings);
+			const uint32_t count = in.get<uint32_t>();
+			if (!in.ok || (size_t)(in.end - in.pos) < (size_t)count * sizeof(journal_sample)) break;
+			record.samples.resize(count);
+			memcpy(record.samples.data(), in.pos, (size_t)count * sizeof(journal_sample));
+		}
+		else if (record.type != journal_record::barrier) break;
+		if (!in.ok) break;
+		records.push_back(std::move(record));
+		valid += sizeof(frame) + frame[0];
+	}
+	fclose(file);
+	return valid;
+}
+
+// cuts off what a crash left half written, so what's added after it can be read back
+inline void truncate_journal(const std::string& path)
+{
+	std::vector<journal_stroke> records;
+	const size_t valid = read_journal(path, records);
+	if (file_size(path) <= valid) return;
+#ifdef _WIN32
+	FILE* file = fopen(path.c_str(), "r+b");
+	if (file == nullptr) return;
+	_chsize_s(_fileno(file), (__int64)valid);
+	fclose(file);
+#else
+	if (truncate(path.c_str(), (off_t)valid) != 0) return;
+#endif
+}
+
+inline void remove_journal(const std::string& path)
+{
+	if (path.empty()) return;
+	remove(path.c_str());
+	remove((path + ".old").c_str());
+}
+
+// every stroke as it was painted (the brush, the color, the layer and the samples), appended to a file next to
+// the document so what happened since the last autosave can be painted again after a crash. a record is a
+// hundred bytes and some per sample, next to nothing compared to the pixels it changes. painting only ever
+// copies the record into a buffer, a thread writes what's piled up and syncs it a few times a second.
+// each autosave starts a new file and keeps the one before as .old, together they always reach back to the
+// last autosave that made it to the disk
+struct stroke_journal
+{
+	stroke_journal()
+	{
+		writer_ = std::thread([this] { write_loop(); });
+	}
+
+	stroke_journal(const stroke_journal&) = delete;
+	stroke_journal& operator=(const stroke_journal&) = delete;
+
+	~stroke_journal()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			quit_ = true;
+		}
+		wake_.notify_one();
+		writer_.join();
+	}
+
+	// the last record so far, what a snapshot taken now has in it
+	uint64_t last() const { return seq_; }
+
+	// where records go from now on. picks up numbering after whatever's already there. the file before is
+	// deleted, nothing's going to recover from it anymore
+	void set_path(const std::string& path)
+	{
+		if (path == path_) return;
+		path_ = path;
+		barrier_ = false;
+		std::vector<journal_stroke> records;
+		read_journal(path + ".old", records);
+		read_journal(path, records);
+		for (const journal_stroke& record : records)
+		{
+			seq_ = std::max(seq_, record.seq);
+		}
+		push(std::vector<uint8_t>(), false);
+	}
+
+	// an autosave with everything up to last() in it was just taken
+	void rotate()
+	{
+		push(std::vector<uint8_t>(), true);
+	}
+
+	void stroke(const int layer_id, const uint32_t layers, const brush& settings, const color paint, const bool linear,
+		const std::vector<journal_sample>& samples)
+	{
+		index_writer out;
+		out.put(journal_record::stroke);
+		out.put(++seq_);
+		out.put((int32_t)layer_id);
+		out.put(layers);
+		out.put(paint);
+		out.put((uint8_t)linear);
+		write_brush(out, settings);
+		out.put((uint32_t)samples.size());
+		out.bytes.insert(out.bytes.end(), (const uint8_t*)samples.data(), (const uint8_t*)(samples.data() + samples.size()));
+		push(std::move(out.bytes), false);
+		barrier_ = false;
+	}
+
+	// one's enough until the next stroke
+	void barrier()
+	{
+		if (barrier_) return;
+		barrier_ = true;
+		index_writer out;
+		out.put(journal_record::barrier);
+		out.put(++seq_);
+		push(std::move(out.bytes), false);
+	}
+
+private:
+	// what's waiting for the writer, in order. a batch starts when the file changes or starts over
+	struct batch
+	{
+		std::string path;
+		bool rotate = false;
+		std::vector<uint8_t> bytes;
+	};
+
+	std::string path_;
+	uint64_t seq_ = 0;
+	bool barrier_ = false;
+	std::thread writer_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::vector<batch> pending_;
+	bool quit_ = false;
+
+	void push(std::vector<uint8_t> payload, const bool rotate)
+	{
+		if (path_.empty()) return;
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (rotate || pending_.empty() || pending_.back().path != path_)
+		{
+			pending_.emplace_back();
+			pending_.back().path = path_;
+			pending_.back().rotate = rotate;
+		}
+		if (payload.empty()) return;
+		const uint32_t frame[2] = { (uint32_t)payload.size(), journal_checksum(payload.data(), payload.size()) };
+		std::vector<uint8_t>& bytes = pending_.back().bytes;
+		bytes.insert(bytes.end(), (const uint8_t*)frame, (const uint8_t*)(frame + 2));
+		bytes.insert(bytes.end(), payload.begin(), payload.end());
+	}
+
+	void write_loop()
+	{
+		FILE* file = nullptr;
+		std::string open_path;
+		std::vector<batch> batches;
+		for (;;)
+		{
+			bool quit;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				wake_.wait_for(lock, std::chrono::milliseconds(250), [this] { return quit_; });
+				batches.swap(pending_);
+				quit = quit_;
+			}
+			for (batch& b : batches)
+			{
+				if (b.rotate || b.path != open_path)
+				{
+					if (file != nullptr) fclose(file);
+					if (b.path != open_path) remove_journal(open_path);
+					if (b.rotate) replace_file(b.path, b.path + ".old");
+					open_path = b.path;
+					if (!b.rotate) truncate_journal(open_path);
+					file = fopen(open_path.c_str(), b.rotate ? "wb" : "ab");
+				}
+				if (file != nullptr && !b.bytes.empty()) fwrite(b.bytes.data(), 1, b.bytes.size(), file);
+			}
+			if (file != nullptr && !batches.empty()) flush_file(file);
+			batches.clear();
+			if (quit) break;
+		}
+		// closing normally, there's nothing to recover
+		if (file != nullptr) fclose(file);
+		remove_journal(open_path);
+	}
+};
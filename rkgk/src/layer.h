@@ -1,13 +1,92 @@
 ﻿#pragma once
 
+#include <atomic>
 #include <string>
+#include "adjust.h"
+#include "blend.h"
 #include "color.h"
 
+// how a layer (or a whole group) mixes with what's below it
+enum class layer_blend
+{
+	normal,
+	multiply,
+	screen,
+	add
+};
+
+// adjustment layers change what's below them instead of having pixels of their own
+enum class layer_adjust
+{
+	none,
+	curves,
+	hue_saturation,
+	blur
+};
+
+constexpr int adjust_curve_points = 8;
+
+// where a tile of a layer is in the document's file. either one color all over (size 0, the pixel is in
+// offset, most of an empty layer) or size bytes of run length encoded pixels at offset
+struct tile_ref
+{
+	uint64_t offset = 0;
+	uint32_t size = 0, reserved = 0;
+};
+
+// ids are never reused, so whoever keeps something per layer can tell a layer from one that replaced it. they're
+// saved with the document, opening one moves the count past its ids. layers get made on other threads too
+inline std::atomic<int>& last_layer_id()
+{
+	static std::atomic<int> last { 0 };
+	return last;
+}
+
+inline int next_layer_id()
+{
+	return ++last_layer_id();
+}
+
+inline void saw_layer_id(const int id)
+{
+	int last = last_layer_id();
+	while (last < id && !last_layer_id().compare_exchange_weak(last, id)) {}
+}
+
 struct layer
 {
 	std::string name;
+	int id = next_layer_id();
 	unsigned char opacity = 255;
 	unsigned char* pixels;
+	bool visible = true;
+	layer_blend blend = layer_blend::normal;
+	// a group holds the layers right below it that are nested deeper than it is, its pixels are
+	// those composited together and dirty says which tiles of that are out of date
+	bool group = false;
+	int depth = 0;
+	unsigned char* dirty = nullptr;
+	// 8-bit, one byte per pixel hiding (0) or showing (255) the layer, null for no mask
+	unsigned char* mask = nullptr;
+	// only shows where the nearest unclipped layer below it in the same group does
+	bool clip = false;
+	// alpha8 layers are one byte of coverage per pixel shown in the tint color, line art and sketches
+	// don't need more and take a quarter of the memory and bandwidth that way. rgba16 is for glazing
+	// and smooth gradients that 8 bits would band
+	pixel_format format = pixel_format::rgba8;
+	color tint;
+	// an adjustment's pixels are what's below it adjusted, cached and kept up to date a tile at a time
+	// through dirty like a group's
+	layer_adjust adjust = layer_adjust::none;
+	float curve[adjust_curve_points] = { 0, 1 / 7.0f, 2 / 7.0f, 3 / 7.0f, 4 / 7.0f, 5 / 7.0f, 6 / 7.0f, 1 };
+	color_lut lut; // the curve baked
+	hsl_shift hsl;
+	float radius = 10;
+	// where its pixel tiles and then its mask tiles are in the document's file as of the last save, and which
+	// tiles changed since that and since the last autosave (a byte each like dirty, see unsaved_document). null if
+	// it hasn't been saved as it is, then it all gets written
+	tile_ref* saved = nullptr;
+	unsigned char* unsaved = nullptr;
 
 	layer(const std::string& name, const int byte_count)
 	{
@@ -15,6 +94,8 @@ struct layer
 		pixels = new unsigned char[byte_count];
 	}
 	
+	int pixel_size() const { return ::pixel_size(format); }
+
 	void clear(const color color, const int byte_count) const
 	{
 		for (auto i = 0; i < byte_count; i += 4)
@@ -16,16 +16,150 @@
 #define EASYTAB_IMPLEMENTATION
 #include "easytab.h"
 
+#include "adjust.h"
 #include "canvas.h"
 #include "brush.h"
 #include "mathstuff.h"
 #include "gui.h"
+#include "bench.h"
 #include "portable-file-dialogs.h"
 
 canvas cur_canvas(1024, 1024, "foobar");
 ImVector<brush> brushes;
 int cur_brush = 0;
+std::vector<dab_benchmark_row> dab_benchmark;
+int feather_radius = 8;
 float* cur_color = new float[3] {0, 0, 0};
+// the filter window that's open, if any, and the settings of all of them
+enum class filter_window { none, blur, levels, curves, hue_saturation, posterize } open_filter = filter_window::none;
+const char* filter_titles[] = { "", "Gaussian blur", "Levels", "Curves", "Hue/Saturation", "Posterize" };
+float blur_radius = 10;
+int levels_in[2] = { 0, 255 }, levels_out[2] = { 0, 255 };
+float levels_gamma = 1;
+constexpr int curve_point_count = 8;
+float curve_points[curve_point_count] = { 0, 1 / 7.0f, 2 / 7.0f, 3 / 7.0f, 4 / 7.0f, 5 / 7.0f, 6 / 7.0f, 1 };
+hsl_shift hue_saturation;
+int posterize_levels = 4;
+// file names of the color profiles in use, empty for plain srgb
+std::string display_profile, export_profile;
+
+// hands the open filter with its current settings to the canvas to preview
+static void set_filter()
+{
+	switch (open_filter)
+	{
+	case filter_window::blur:
+		// filters also run on the downscaled preview, sizes in pixels have to shrink along with it
+		cur_canvas.set_filter([radius = blur_radius](const uint8_t* src, uint8_t* dst, const int w, const int h, const int scale)
+		{
+			gaussian_blur(src, dst, w, h, radius / scale);
+		});
+		break;
+	case filter_window::levels:
+	case filter_window::curves:
+	case filter_window::posterize:
+	{
+		const color_lut lut = open_filter == filter_window::levels ? color_lut::levels(levels_in[0], levels_in[1], levels_gamma, levels_out[0], levels_out[1])
+			: open_filter == filter_window::curves ? color_lut::curves(curve_points, curve_point_count)
+			: color_lut::posterize(posterize_levels);
+		cur_canvas.set_point_filter([lut](uint8_t* pixels, const int count) { lut.apply(pixels, count); });
+		break;
+	}
+	case filter_window::hue_saturation:
+		cur_canvas.set_point_filter([shift = hue_saturation](uint8_t* pixels, const int count) { hsl_span(pixels, count, shift); });
+		break;
+	default:
+		break;
+	}
+}
+
+static void open_filter_window(const filter_window window)
+{
+	cur_canvas.apply_transform();
+	if (!cur_canvas.begin_filter()) return;
+	open_filter = window;
+	set_filter();
+}
+
+// asks for an icc profile and hands it to set, which says whether it could be used
+template <typename Fn>
+static void pick_profile(std::string& name, const Fn& set)
+{
+	auto dialog = pfd::open_file("Select a color profile", ".", { "Color Profiles", "*.icc *.icm" });
+	if (dialog.result().empty()) return;
+	const std::string path = dialog.result()[0];
+	if (!set(path))
+	{
+		pfd::message("Problem", "Only RGB matrix/TRC profiles (what monitor calibration makes) are supported", pfd::choice::ok, pfd::icon::error);
+		return;
+	}
+	name = path.substr(path.find_last_of("/\\") + 1);
+}
+
+// saves where the document was last saved or opened from, asking where the first time (and always for save as)
+static void save_document(const bool save_as)
+{
+	if (cur_canvas.filtering()) return;
+	cur_canvas.apply_transform();
+	std::string path = cur_canvas.document_path();
+	if (save_as || path.empty())
+	{
+		path = pfd::save_file("Save document", "untitled.rkgk", { "Documents", "*.rkgk" }).result();
+		if (path.empty()) return;
+		if (path.find('.', path.find_last_of("/\\") + 1) == std::string::npos) path += ".rkgk";
+	}
+	if (!cur_canvas.save_document(path))
+	{
+		pfd::message("Problem", "The document couldn't be saved", pfd::choice::ok, pfd::icon::error);
+	}
+}
+
+static void export_png()
+{
+	if (cur_canvas.filtering()) return;
+	cur_canvas.apply_transform();
+	std::string path = pfd::save_file("Export", "untitled.png", { "PNG Images", "*.png" }).result();
+	if (path.empty()) return;
+	if (path.find('.', path.find_last_of("/\\") + 1) == std::string::npos) path += ".png";
+	if (!cur_canvas.export_png(path))
+	{
+		pfd::message("Problem", "The image couldn't be exported", pfd::choice::ok, pfd::icon::error);
+	}
+}
+
+// asks whether to recover what a crash left behind for the document at path (empty for an untitled one), true if
+// it was
+static bool offer_recovery(const std::string& path)
+{
+	if (!canvas::can_recover(path)) return false;
+	const bool yes = pfd::message("Recover", "rkgk didn't close properly while this was open. Recover what was painted?",
+		pfd::choice::yes_no, pfd::icon::question).result() == pfd::button::yes;
+	if (yes && cur_canvas.recover(path)) return true;
+	if (yes) pfd::message("Problem", "Nothing could be recovered", pfd::choice::ok, pfd::icon::error);
+	canvas::discard_recovery(path);
+	return false;
+}
+
+static void open_file()
+{
+	if (cur_canvas.filtering()) return;
+	auto dialog = pfd::open_file("Select a file", ".",
+		{ "Documents and Images", "*.rkgk *.png *.jpg *.jpeg *.bmp", "Documents", "*.rkgk", "Image Files", "*.png *.jpg *.jpeg *.bmp" });
+	if (dialog.result().empty()) return;
+	const std::string path = dialog.result()[0];
+	if (path.size() < 5 || path.compare(path.size() - 5, 5, ".rkgk") != 0)
+	{
+		cur_canvas.cancel_transform();
+		if (!cur_canvas.open(path)) pfd::message("Problem", "The image couldn't be opened", pfd::choice::ok, pfd::icon::error);
+		return;
+	}
+	cur_canvas.cancel_transform();
+	if (path != cur_canvas.document_path() && offer_recovery(path)) return;
+	if (!cur_canvas.open_document(path))
+	{
+		pfd::message("Problem", "The document couldn't be opened", pfd::choice::ok, pfd::icon::error);
+	}
+}
 
 static void glfw_error_callback(const int error, const char* description)
 {
@@ -75,8 +209,18 @@ int main()
 
 
 	brushes.push_back(brush("hard round"));
+	brush eraser("eraser");
+	eraser.size = 20;
+	eraser.mode = blend_mode::erase;
+	brushes.push_back(eraser);
+	brush smudge("smudge");
+	smudge.size = 30;
+	smudge.mode = blend_mode::smudge;
+	smudge.falloff = falloff_curve::gaussian;
+	brushes.push_back(smudge);
 
 	setup_gui_style(io);
+	offer_recovery(std::string());
 
 	while (!glfwWindowShouldClose(window))
 	{
@@ -99,8 +243,9 @@ int main()
 		ImGui_ImplOpenGL3_NewFrame();
 		ImGui_ImplGlfw_NewFrame();
 		ImGui::NewFrame();
+		cur_canvas.poll_document();
 
-		if (!io.WantCaptureMouse && ImGui::IsMousePosValid())
+		if (!io.WantCaptureMouse && ImGui::IsMousePosValid() && !cur_canvas.filtering())
 		{
 			// if the mouse button is down but pressure is 0, we are likely using the mouse
 			cur_canvas.handle_inputs(io, io.MouseDown[0] && pressure <= 0.0f ? 1 : pressure, color( cur_color[0]*255, cur_color[1]*255, cur_color[2]*255, 255), brushes[cur_brush]);
@@ -114,10 +259,37 @@ int main()
 		{
 			brushes[cur_brush].size++;
 		}
+		else if (io.KeyCtrl && ImGui::IsKeyPressed(ImGuiKey_S))
+		{
+			save_document(io.KeyShift);
+		}
+		else if (io.KeyCtrl && ImGui::IsKeyPressed(ImGuiKey_O))
+		{
+			open_file();
+		}
+		else if (io.KeyCtrl && ImGui::IsKeyPressed(ImGuiKey_A))
+		{
+			cur_canvas.sel.select_all();
+		}
+		else if (io.KeyCtrl && ImGui::IsKeyPressed(ImGuiKey_D))
+		{
+			cur_canvas.sel.deselect();
+		}
+		else if (io.KeyCtrl && io.KeyShift && ImGui::IsKeyPressed(ImGuiKey_I))
+		{
+			cur_canvas.sel.invert();
+		}
+		else if (cur_canvas.transforming() && ImGui::IsKeyPressed(ImGuiKey_Enter))
+		{
+			cur_canvas.apply_transform();
+		}
+		else if (cur_canvas.transforming() && ImGui::IsKeyPressed(ImGuiKey_Escape))
+		{
+			cur_canvas.cancel_transform();
+		}
 		else if (ImGui::IsKeyPressed(ImGuiKey_Delete))
 		{
-			cur_canvas.layers[0].clear(color_white, cur_canvas.byte_count());
-			cur_canvas.invalidate_opengl_texture();
+			cur_canvas.clear_layer();
 		}
 
 		ImGui::ShowDemoWindow();
@@ -126,15 +298,25 @@ int main()
 		{
 			if (ImGui::BeginMenu("File"))
 			{
-				if (ImGui::MenuItem("Open", "CTRL+O"))
+				if (ImGui::MenuItem("Open", "CTRL+O")) open_file();
+				if (ImGui::MenuItem("Save", "CTRL+S")) save_document(false);
+				if (ImGui::MenuItem("Save as...", "CTRL+SHIFT+S")) save_document(true);
+				ImGui::MenuItem("Autosave", nullptr, &cur_canvas.autosave.enabled);
+				if (cur_canvas.autosave.enabled)
 				{
-					auto dialog = pfd::open_file("Select a file", ".",
-						{ "Image Files", "*.png *.jpg *.jpeg *.bmp" });
-
-					if (!dialog.result().empty())
-					{
-						cur_canvas.open(dialog.result()[0]);
-					}
+					int minutes = cur_canvas.autosave.interval / 60;
+					if (ImGui::SliderInt("Every (minutes)", &minutes, 1, 30)) cur_canvas.autosave.interval = minutes * 60;
+				}
+				ImGui::Separator();
+				if (ImGui::MenuItem("Export PNG...")) export_png();
+				if (ImGui::MenuItem("Export profile...", export_profile.empty() ? "sRGB" : export_profile.c_str()))
+				{
+					pick_profile(export_profile, [](const std::string& path) { return cur_canvas.set_export_profile(path); });
+				}
+				if (ImGui::MenuItem("Export as sRGB", nullptr, false, !export_profile.empty()))
+				{
+					cur_canvas.set_export_profile("");
+					export_profile.clear();
 				}
 				ImGui::EndMenu();
 			}
@@ -148,6 +330,45 @@ int main()
 				if (ImGui::MenuItem("Paste", "CTRL+V")) {}
 				ImGui::EndMenu();
 			}
+			if (ImGui::BeginMenu("View"))
+			{
+				composite_options options = cur_canvas.options();
+				bool changed = ImGui::MenuItem("Dither 16-bit layers", nullptr, &options.dither);
+				changed |= ImGui::MenuItem("Blend in linear light", nullptr, &options.linear);
+				if (changed) cur_canvas.set_options(options);
+				ImGui::Separator();
+				if (ImGui::MenuItem("Display profile...", display_profile.empty() ? "sRGB" : display_profile.c_str()))
+				{
+					pick_profile(display_profile, [](const std::string& path) { return cur_canvas.set_display_profile(path); });
+				}
+				if (ImGui::MenuItem("Display as sRGB", nullptr, false, !display_profile.empty()))
+				{
+					cur_canvas.set_display_profile("");
+					display_profile.clear();
+				}
+				ImGui::EndMenu();
+			}
+			if (ImGui::BeginMenu("Filter"))
+			{
+				const bool idle = !cur_canvas.filtering();
+				if (ImGui::MenuItem("Gaussian blur...", nullptr, false, idle)) open_filter_window(filter_window::blur);
+				ImGui::Separator();
+				if (ImGui::MenuItem("Levels...", nullptr, false, idle)) open_filter_window(filter_window::levels);
+				if (ImGui::MenuItem("Curves...", nullptr, false, idle)) open_filter_window(filter_window::curves);
+				if (ImGui::MenuItem("Hue/Saturation...", nullptr, false, idle)) open_filter_window(filter_window::hue_saturation);
+				if (ImGui::MenuItem("Posterize...", nullptr, false, idle)) open_filter_window(filter_window::posterize);
+				if (ImGui::MenuItem("Invert", nullptr, false, idle))
+				{
+					cur_canvas.apply_transform();
+					if (cur_canvas.begin_filter())
+					{
+						const color_lut lut = color_lut::invert();
+						cur_canvas.set_point_filter([lut](uint8_t* pixels, const int count) { lut.apply(pixels, count); });
+						cur_canvas.apply_filter();
+					}
+				}
+				ImGui::EndMenu();
+			}
 			ImGui::EndMainMenuBar();
 		}
 
@@ -170,6 +391,12 @@ int main()
 		ImGui::DragFloat("p5", &cur_canvas.p5, 0.01f, -5, 5);
 		ImGui::DragInt("p6", &cur_canvas.p6, 0.1f, -100, 100);
 
+		ImGui::Checkbox("Stroke prediction", &cur_canvas.predictor.enabled);
+		if (cur_canvas.predictor.enabled)
+		{
+			ImGui::SliderFloat("Lookahead (ms)", &cur_canvas.predictor.lookahead_ms, 1, 50);
+		}
+
 
 		if (ImGui::Button("Reset canvas view"))
 		{
@@ -180,17 +407,47 @@ int main()
 		}
 		if (ImGui::Button("Regen img"))
 		{
-			cur_canvas.layers[0].clear(color_white, cur_canvas.byte_count());
-			cur_canvas.invalidate_opengl_texture();
+			cur_canvas.clear_layer();
 		}
 		if (ImGui::Button("Save"))
 		{
-			cur_canvas.save();
+			export_png();
+		}
+
+		if (ImGui::Button("Benchmark dabs"))
+		{
+			dab_benchmark = run_dab_benchmark();
+		}
+		if (!dab_benchmark.empty() && ImGui::BeginTable("dab benchmark", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+		{
+			ImGui::TableSetupColumn("Config");
+			ImGui::TableSetupColumn("Generic (ms)");
+			ImGui::TableSetupColumn("Kernel (ms)");
+			ImGui::TableSetupColumn("Speedup");
+			ImGui::TableSetupColumn("Linear (ms)");
+			ImGui::TableHeadersRow();
+			for (const auto& row : dab_benchmark)
+			{
+				ImGui::TableNextRow();
+				ImGui::TableNextColumn();
+				ImGui::TextUnformatted(row.config.c_str());
+				ImGui::TableNextColumn();
+				ImGui::Text("%.2f", row.generic_ms);
+				ImGui::TableNextColumn();
+				ImGui::Text("%.2f", row.kernel_ms);
+				ImGui::TableNextColumn();
+				ImGui::Text("%.2fx", row.generic_ms / row.kernel_ms);
+				ImGui::TableNextColumn();
+				ImGui::Text("%.2f", row.linear_ms);
+			}
+			ImGui::EndTable();
 		}
 		ImGui::End();
 
 
 		ImGui::Begin("Layers");
+		// transforms and filters hold on to the current layer until they're done
+		ImGui::BeginDisabled(cur_canvas.transforming() || cur_canvas.filtering());
 		if (ImGui::Button("+"))
 		{
 			cur_canvas.add_layer();
@@ -200,36 +457,299 @@ int main()
 		{
 			cur_canvas.remove_layer(cur_canvas.cur_layer);
 		}
+		ImGui::SameLine();
+		if (ImGui::Button("Group"))
+		{
+			cur_canvas.add_group();
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Adjust")) ImGui::OpenPopup("adjustments");
+		if (ImGui::BeginPopup("adjustments"))
+		{
+			if (ImGui::MenuItem("Curves")) cur_canvas.add_adjustment(layer_adjust::curves);
+			if (ImGui::MenuItem("Hue/Saturation")) cur_canvas.add_adjustment(layer_adjust::hue_saturation);
+			if (ImGui::MenuItem("Blur")) cur_canvas.add_adjustment(layer_adjust::blur);
+			ImGui::EndPopup();
+		}
+		if (cur_canvas.cur_layer >= 0 && cur_canvas.layers[cur_canvas.cur_layer].group)
+		{
+			ImGui::SameLine();
+			if (ImGui::Button("Ungroup")) cur_canvas.ungroup(cur_canvas.cur_layer);
+		}
+		if (cur_canvas.cur_layer >= 0)
+		{
+			auto& layer = cur_canvas.layers[cur_canvas.cur_layer];
+			int opacity = layer.opacity;
+			if (ImGui::SliderInt("Opacity", &opacity, 0, 255))
+			{
+				layer.opacity = (unsigned char)opacity;
+				cur_canvas.invalidate_layer(cur_canvas.cur_layer);
+			}
+			int blend = (int)layer.blend;
+			if (layer.adjust == layer_adjust::none && ImGui::Combo("Blend", &blend, "Normal\0Multiply\0Screen\0Add\0"))
+			{
+				layer.blend = (layer_blend)blend;
+				cur_canvas.invalidate_layer(cur_canvas.cur_layer);
+			}
+			bool adjusted = false;
+			switch (layer.adjust)
+			{
+			case layer_adjust::curves:
+				adjusted |= curve_editor("Curve", layer.curve, adjust_curve_points,
+					[&](const float u) { return curve_at(layer.curve, adjust_curve_points, u); });
+				break;
+			case layer_adjust::hue_saturation:
+				adjusted |= ImGui::SliderFloat("Hue", &layer.hsl.hue, -180, 180, "%.0f deg");
+				adjusted |= ImGui::SliderFloat("Saturation", &layer.hsl.saturation, -1, 1);
+				adjusted |= ImGui::SliderFloat("Lightness", &layer.hsl.lightness, -1, 1);
+				break;
+			case layer_adjust::blur:
+				// redoing a big blur every frame of the drag is too slow, it's redone once it's let go
+				ImGui::SliderFloat("Radius", &layer.radius, 1, 300, "%.0f px", ImGuiSliderFlags_Logarithmic);
+				adjusted |= ImGui::IsItemDeactivatedAfterEdit();
+				break;
+			default:
+				break;
+			}
+			if (adjusted) cur_canvas.adjustment_changed(cur_canvas.cur_layer);
+			if (ImGui::Checkbox("Clip to below", &layer.clip))
+			{
+				cur_canvas.invalidate_layer(cur_canvas.cur_layer);
+			}
+			if (!layer.group && layer.adjust == layer_adjust::none)
+			{
+				const char* formats[] = { "8-bit color", "Alpha only", "16-bit color" };
+				int format = (int)layer.format;
+				if (ImGui::Combo("Pixels", &format, formats, IM_ARRAYSIZE(formats))) cur_canvas.convert_layer((pixel_format)format);
+				if (ImGui::IsItemHovered()) ImGui::SetTooltip("Alpha only is one channel of coverage shown in a single color, for line art and sketches.\n16-bit is for glazing and gradients, smudge and blend brushes don't work on it");
+			}
+			if (layer.format == pixel_format::alpha8)
+			{
+				float tint[3] = { layer.tint.r / 255.0f, layer.tint.g / 255.0f, layer.tint.b / 255.0f };
+				if (ImGui::ColorEdit3("Tint", tint))
+				{
+					layer.tint = color((uint8_t)(tint[0] * 255), (uint8_t)(tint[1] * 255), (uint8_t)(tint[2] * 255), 255);
+					cur_canvas.invalidate_layer(cur_canvas.cur_layer);
+				}
+			}
+			if (layer.mask == nullptr)
+			{
+				if (ImGui::Button("Add mask")) cur_canvas.add_mask();
+				if (ImGui::IsItemHovered()) ImGui::SetTooltip("Shows what's selected, or everything");
+			}
+			else
+			{
+				if (ImGui::Button("Invert mask")) cur_canvas.invert_mask();
+				ImGui::SameLine();
+				const bool paintable = !layer.group && layer.adjust == layer_adjust::none;
+				if (paintable && ImGui::Button("Apply mask")) cur_canvas.remove_mask(true);
+				if (paintable) ImGui::SameLine();
+				if (ImGui::Button("Delete mask")) cur_canvas.remove_mask(false);
+			}
+		}
 		for (int i = cur_canvas.layers.size(); i-- > 0;)
 		{
 			auto& layer = cur_canvas.layers[i];
-			if (ImGui::Selectable(layer.name.c_str(), cur_canvas.cur_layer == i))
+			ImGui::PushID(i);
+			if (ImGui::Checkbox("##visible", &layer.visible))
+			{
+				cur_canvas.invalidate_layer(i);
+			}
+			ImGui::SameLine(0, 4.0f + layer.depth * 16);
+			const std::string label = (layer.group ? "> " : layer.adjust != layer_adjust::none ? "* " : "") + std::string(layer.clip ? "| " : "") + layer.name + (layer.mask ? " [mask]" : "");
+			if (ImGui::Selectable(label.c_str(), cur_canvas.cur_layer == i))
 			{
 				cur_canvas.cur_layer = i;
 			}
+			ImGui::PopID();
+		}
+		ImGui::EndDisabled();
+		ImGui::End();
+
+		ImGui::Begin("Tools");
+		int tool_index = (int)cur_canvas.cur_tool;
+		const char* tool_names[] = { "Brush", "Fill", "Rectangle", "Ellipse", "Lasso", "Magic wand", "Transform" };
+		for (int i = 0; i < IM_ARRAYSIZE(tool_names); i++)
+		{
+			if (i % 2) ImGui::SameLine();
+			ImGui::RadioButton(tool_names[i], &tool_index, i);
+		}
+		cur_canvas.cur_tool = (tool)tool_index;
+		// switching tools keeps whatever was transformed
+		if (cur_canvas.cur_tool != tool::transform) cur_canvas.apply_transform();
+		if (cur_canvas.cur_tool == tool::fill || cur_canvas.cur_tool == tool::magic_wand)
+		{
+			ImGui::SliderInt("Tolerance", &cur_canvas.fill.tolerance, 0, 255);
+			ImGui::Checkbox("Sample merged", &cur_canvas.fill.sample_merged);
+		}
+		if (cur_canvas.cur_tool == tool::fill)
+		{
+			ImGui::SliderInt("Close gaps", &cur_canvas.fill.gap, 0, 16);
+		}
+		if (cur_canvas.cur_tool == tool::transform)
+		{
+			int filter = (int)cur_canvas.transform_filter;
+			if (ImGui::Combo("Filter", &filter, "Bilinear\0Bicubic\0"))
+			{
+				cur_canvas.transform_filter = (resample_filter)filter;
+			}
+			ImGui::Checkbox("Selection only", &cur_canvas.transform_selection_only);
+			ImGui::TextDisabled("drag: move, ctrl: rotate, shift: scale");
+			if (cur_canvas.transforming())
+			{
+				if (ImGui::Button("Apply")) cur_canvas.apply_transform();
+				ImGui::SameLine();
+				if (ImGui::Button("Cancel")) cur_canvas.cancel_transform();
+			}
+		}
+		else if (cur_canvas.cur_tool != tool::brush && cur_canvas.cur_tool != tool::fill)
+		{
+			int op = (int)cur_canvas.select_op;
+			if (ImGui::Combo("Mode", &op, "Replace\0Add (shift)\0Subtract (alt)\0Intersect\0"))
+			{
+				cur_canvas.select_op = (selection_op)op;
+			}
 		}
+
+		ImGui::Separator();
+		ImGui::Text("Selection");
+		if (ImGui::Button("All")) cur_canvas.sel.select_all();
+		ImGui::SameLine();
+		if (ImGui::Button("None")) cur_canvas.sel.deselect();
+		ImGui::SameLine();
+		if (ImGui::Button("Invert")) cur_canvas.sel.invert();
+		ImGui::SliderInt("##feather", &feather_radius, 1, 100, "%d px");
+		ImGui::SameLine();
+		if (ImGui::Button("Feather")) cur_canvas.sel.feather(feather_radius);
 		ImGui::End();
 
+		if (open_filter != filter_window::none)
+		{
+			ImGui::Begin(filter_titles[(int)open_filter], nullptr, ImGuiWindowFlags_AlwaysAutoResize);
+			bool changed = false;
+			switch (open_filter)
+			{
+			case filter_window::blur:
+				changed |= ImGui::SliderFloat("Radius", &blur_radius, 1, 300, "%.0f px", ImGuiSliderFlags_Logarithmic);
+				break;
+			case filter_window::levels:
+				changed |= ImGui::SliderInt2("Input", levels_in, 0, 255);
+				changed |= ImGui::SliderFloat("Gamma", &levels_gamma, .1f, 10, "%.2f", ImGuiSliderFlags_Logarithmic);
+				changed |= ImGui::SliderInt2("Output", levels_out, 0, 255);
+				break;
+			case filter_window::curves:
+				changed |= curve_editor("Curve", curve_points, curve_point_count,
+					[](const float u) { return curve_at(curve_points, curve_point_count, u); });
+				break;
+			case filter_window::hue_saturation:
+				changed |= ImGui::SliderFloat("Hue", &hue_saturation.hue, -180, 180, "%.0f deg");
+				changed |= ImGui::SliderFloat("Saturation", &hue_saturation.saturation, -1, 1);
+				changed |= ImGui::SliderFloat("Lightness", &hue_saturation.lightness, -1, 1);
+				break;
+			case filter_window::posterize:
+				changed |= ImGui::SliderInt("Levels", &posterize_levels, 2, 32);
+				break;
+			default:
+				break;
+			}
+			if (changed) set_filter();
+			// the quick preview while dragging, the real thing once it's let go
+			cur_canvas.update_filter(ImGui::IsAnyItemActive());
+			if (ImGui::Button("Apply"))
+			{
+				cur_canvas.apply_filter();
+				open_filter = filter_window::none;
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Cancel"))
+			{
+				cur_canvas.cancel_filter();
+				open_filter = filter_window::none;
+			}
+			ImGui::End();
+		}
+
 		ImGui::Begin("Brushes");
 		for (int i = 0; i < brushes.size(); i++)
 		{
 			auto& brush = brushes[i];
 			if (ImGui::Selectable(brush.name.c_str(), cur_brush == i))
 			{
-				cur_canvas.cur_layer = i;
+				cur_brush = i;
 			}
 		}
 		auto& brush = brushes[cur_brush];
-		ImGui::DragFloat("Size", &brush.size, 0.1f, 0.1f, 100);
+		ImGui::DragFloat("Size", &brush.size, 0.1f, 0.1f, 5000, "%.1f", ImGuiSliderFlags_Logarithmic);
 		ImGui::Checkbox("Size pressure", &brush.size_pressure);
 		if (brush.size_pressure)
 		{
-			ImGui::SliderFloat("Min size", &brush.min_size, 0.0f, 100);
+			ImGui::SliderFloat("Min size", &brush.min_size, 0.0f, brush.size);
 		}
 		ImGui::SliderInt("Opacity", &brush.opacity, 1, 255);
 		ImGui::Checkbox("Opacity pressure", &brush.opacity_pressure);
 		ImGui::SliderFloat("Spacing", &brush.spacing, 0.01f, 1.0f);
 		ImGui::SliderFloat("Anti-aliasing", &brush.aa, 0.1f, 1.0f);
+		int mode = (int)brush.mode;
+		if (ImGui::Combo("Blend mode", &mode, "Normal\0Erase\0Smudge\0Blend\0"))
+		{
+			brush.mode = (blend_mode)mode;
+		}
+		if (brush.mode == blend_mode::smudge || brush.mode == blend_mode::blend)
+		{
+			ImGui::SliderFloat("Smudge length", &brush.smudge_length, 0.0f, 1.0f);
+		}
+		int falloff = (int)brush.falloff;
+		if (ImGui::Combo("Falloff", &falloff, "Hard\0Hardness\0Gaussian\0Custom\0"))
+		{
+			brush.falloff = (falloff_curve)falloff;
+		}
+		if (brush.falloff == falloff_curve::hardness)
+		{
+			ImGui::SliderFloat("Hardness", &brush.hardness, 0.0f, 0.99f);
+		}
+		const char* tip_name = brush.tip >= 0 ? brush_tips[brush.tip].name.c_str() : "Round";
+		if (ImGui::BeginCombo("Tip", tip_name))
+		{
+			if (ImGui::Selectable("Round", brush.tip < 0))
+			{
+				brush.tip = -1;
+			}
+			for (int i = 0; i < (int)brush_tips.size(); i++)
+			{
+				if (ImGui::Selectable(brush_tips[i].name.c_str(), brush.tip == i))
+				{
+					brush.tip = i;
+				}
+			}
+			if (ImGui::Selectable("Load image..."))
+			{
+				auto dialog = pfd::open_file("Select a brush tip", ".",
+					{ "Image Files", "*.png *.jpg *.jpeg *.bmp" });
+
+				brush_tip tip;
+				if (!dialog.result().empty() && tip.load(dialog.result()[0]))
+				{
+					brush_tips.push_back(std::move(tip));
+					brush.tip = (int)brush_tips.size() - 1;
+				}
+			}
+			ImGui::EndCombo();
+		}
+		if (brush.tip >= 0)
+		{
+			int rotation = (int)brush.rotation;
+			if (ImGui::Combo("Rotation", &rotation, "Fixed\0Stroke direction\0Pressure\0"))
+			{
+				brush.rotation = (tip_rotation)rotation;
+			}
+			ImGui::SliderFloat("Angle", &brush.angle, -180, 180, "%.0f deg");
+		}
+		else if (brush.falloff != falloff_curve::hard)
+		{
+			const bool editable = brush.falloff == falloff_curve::custom;
+			curve_editor("Falloff curve", brush.curve, editable ? brush::curve_points : 0,
+				[&](const float u) { return brush.falloff_at(u); });
+		}
 		ImGui::End();
 
 		ImGui::Begin("Color");
@@ -240,7 +760,10 @@ int main()
 
 		cur_canvas.render(drawlist);
 
-		drawlist->AddCircle(io.MousePos, brushes[cur_brush].size * cur_canvas.matrix.m11, IM_COL32(0, 0, 0, 255));
+		if (cur_canvas.cur_tool == tool::brush)
+		{
+			drawlist->AddCircle(io.MousePos, brushes[cur_brush].size * cur_canvas.matrix.m11, IM_COL32(0, 0, 0, 255));
+		}
 		
 		// Rendering
 		ImGui::Render();
@@ -1,4 +1,5 @@
 ﻿#pragma once
+#include <algorithm>
 #include <cmath>
 
 inline float distance(const ImVec2 p1, const ImVec2 p2)
@@ -13,6 +14,17 @@ inline float lerp(const float a, const float b, const float f)
 	return a + f * (b - a);
 }
 
+// catmull-rom through count evenly spaced values over [0, 1], clamped to [0, 1]
+inline float curve_at(const float* points, const int count, const float u)
+{
+	const float f = std::min(1.0f, std::max(0.0f, u)) * (count - 1);
+	const int i = std::min(count - 2, (int)f);
+	const float t = f - i;
+	const float p0 = points[std::max(0, i - 1)], p1 = points[i], p2 = points[i + 1], p3 = points[std::min(count - 1, i + 2)];
+	const float v = .5f * (2 * p1 + (p2 - p0) * t + (2 * p0 - 5 * p1 + 4 * p2 - p3) * t * t + (3 * p1 - p0 - 3 * p2 + p3) * t * t * t);
+	return std::min(1.0f, std::max(0.0f, v));
+}
+
 class matrix3x2 {
 public:
 	matrix3x2() : m11(1), m12(0), m21(0), m22(1), m31(0), m32(0) {}
@@ -0,0 +1,39 @@
+#pragma once
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// splits [0, count) into one contiguous chunk per core and runs fn(begin, end) on each of them,
+// the calling thread takes the first chunk
+template <typename Fn>
+void parallel_for(const int count, const Fn& fn)
+{
+	const int threads = std::max(1, std::min(count, (int)std::thread::hardware_concurrency()));
+	const int chunk = (count + threads - 1) / threads;
+	if (threads <= 1 || chunk >= count)
+	{
+		fn(0, count);
+		return;
+	}
+
+	std::vector<std::thread> workers;
+	for (int begin = chunk; begin < count; begin += chunk)
+	{
+		workers.emplace_back([&fn, begin, end = std::min(count, begin + chunk)] { fn(begin, end); });
+	}
+	fn(0, chunk);
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+// same, over bands of rows so each thread works on whole tiles worth of rows
+template <typename Fn>
+void parallel_for_rows(const int height, const int band, const Fn& fn)
+{
+	parallel_for((height + band - 1) / band, [&](const int first, const int last)
+	{
+		fn(first * band, std::min(height, last * band));
+	});
+}
@@ -0,0 +1,781 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+
+// png export that never holds more than a few strips of rows. each strip is filtered and deflated on its own
+// core into a deflate block that ends on a byte boundary (an empty stored block after it, the way zlib's sync
+// flush does), so the strips' blocks put one after another are a single deflate stream. they go in their own
+// IDAT chunk each, the zlib header in the first and the final block and checksum in the last. codes are the
+// fixed huffman ones like stb_image_write's, a strip doesn't look back into the one before
+
+inline uint32_t png_crc32(uint32_t crc, const uint8_t* data, const size_t size)
+{
+	static const std::vector<uint32_t> table = []
+	{
+		std::vector<uint32_t> t(256);
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+inline uint32_t adler32(const uint8_t* data, size_t size)
+{
+	uint32_t a = 1, b = 0;
+	while (size > 0)
+	{
+		// as many as fit before b could overflow
+		const size_t n = std::min<size_t>(size, 5552);
+		for (size_t i = 0; i < n; i++)
+		{
+			a += data[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		data += n;
+		size -= n;
+	}
+	return (b << 16) | a;
+}
+
+// the adler32 of two runs of bytes one after the other, from each of theirs and the second's length
+inline uint32_t adler32_combine(const uint32_t first, const uint32_t second, const size_t second_size)
+{
+	constexpr uint32_t base = 65521;
+	const uint32_t rem = (uint32_t)(second_size % base);
+	uint32_t a = first & 0xffff;
+	uint32_t b = (uint32_t)((uint64_t)rem * a % base);
+	a += (second & 0xffff) + base - 1;
+	b += (first >> 16) + (second >> 16) + base - rem;
+	if (a >= base) a -= base;
+	if (a >= base) a -= base;
+	if (b >= base * 2) b -= base * 2;
+	if (b >= base) b -= base;
+	return (b << 16) | a;
+}
+
+struct deflate_bits
+{
+	std::vector<uint8_t>& out;
+	uint64_t bits = 0;
+	int count = 0;
+
+	void put(const uint32_t value, const int n)
+	{
+		bits |= (uint64_t)value << count;
+		count += n;
+		while (count >= 8)
+		{
+			out.push_back((uint8_t)bits);
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	// huffman codes go in most significant bit first
+	void put_code(const uint32_t code, const int n)
+	{
+		uint32_t reversed = 0;
+		for (int i = 0; i < n; i++) reversed |= ((code >> i) & 1) << (n - 1 - i);
+		put(reversed, n);
+	}
+
+	void align()
+	{
+		if (count > 0) put(0, 8 - count);
+	}
+};
+
+// the fixed literal/length codes
+inline void put_fixed_symbol(deflate_bits& out, const int symbol)
+{
+	if (symbol < 144) out.put_code(0x30 + symbol, 8);
+	else if (symbol < 256) out.put_code(0x190 + symbol - 144, 9);
+	else if (symbol < 280) out.put_code(symbol - 256, 7);
+	else out.put_code(0xc0 + symbol - 280, 8);
+}
+
+inline void put_match(deflate_bits& out, const int length, const int distance)
+{
+	static const uint16_t length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const uint8_t length_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const uint16_t distance_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049,
+		3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	int code = 28;
+	while (length_base[code] > length) code--;
+	put_fixed_symbol(out, 257 + code);
+	if (length_extra[code]) out.put(length - length_base[code], length_extra[code]);
+	// two codes per power of two past the first four
+	int d = 0;
+	const int from_one = distance - 1;
+	if (from_one < 4) d = from_one;
+	else
+	{
+		int top = 1;
+		while ((from_one >> (top + 1)) != 0) top++;
+		d = top * 2 + ((from_one >> (top - 1)) & 1);
+	}
+	out.put_code(d, 5);
+	if (d >= 4) out.put(distance - distance_base[d], d / 2 - 1);
+}
+
+constexpr int deflate_window = 32768;
+
+// data as a deflate block that isn't the last one, followed by an empty stored block so it ends on a byte
+inline void deflate_strip(const uint8_t* data, const size_t size, std::vector<uint8_t>& out)
+{
+	constexpr int hash_bits = 15, max_chain = 24, max_length = 258;
+	std::vector<int32_t> head(1 << hash_bits, -1), prev(deflate_window, -1);
+	const auto hash = [data](const size_t at)
+	{
+		return ((data[at] << 10) ^ (data[at + 1] << 5) ^ data[at + 2]) & ((1 << hash_bits) - 1);
+	};
+	const auto insert = [&](const size_t at)
+	{
+		const int h = hash(at);
+		prev[at & (deflate_window - 1)] = head[h];
+		head[h] = (int32_t)at;
+	};
+
+	deflate_bits bits = { out };
+	bits.put(0, 1); // not the last block
+	bits.put(1, 2); // fixed codes
+	size_t i = 0;
+	while (i + 3 <= size)
+	{
+		const int longest = (int)std::min<size_t>(max_length, size - i);
+		int best = 0, best_distance = 0;
+		int32_t candidate = head[hash(i)];
+		for (int chain = 0; candidate >= 0 && chain < max_chain && i - candidate < deflate_window; chain++)
+		{
+			const uint8_t* a = data + candidate;
+			const uint8_t* b = data + i;
+			if (a[best] == b[best])
+			{
+				int length = 0;
+				while (length < longest && a[length] == b[length]) length++;
+				if (length > best)
+				{
+					best = length;
+					best_distance = (int)(i - candidate);
+					if (length == longest) break;
+				}
+			}
+			// the slot gets reused once the window moves past it, anything newer there isn't on this chain
+			const int32_t next = prev[candidate & (deflate_window - 1)];
+			if (next >= candidate) break;
+			candidate = next;
+		}
+		if (best >= 3)
+		{
+			put_match(bits, best, best_distance);
+			for (const size_t end = i + best; i < end; i++)
+			{
+				if (i + 3 <= size) insert(i);
+			}
+			continue;
+		}
+		put_fixed_symbol(bits, data[i]);
+		insert(i);
+		i++;
+	}
+	for (; i < size; i++) put_fixed_symbol(bits, data[i]);
+	put_fixed_symbol(bits, 256);
+	// empty stored block, not the last either
+	bits.put(0, 3);
+	bits.align();
+	const uint8_t stored[] = { 0, 0, 0xff, 0xff };
+	out.insert(out.end(), stored, stored + 4);
+}
+
+inline int png_paeth(const int a, const int b, const int c)
+{
+	const int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// one row through whichever of the five filters leaves the smallest numbers, the usual guess at what
+// compresses best. prior is the row above, zeros for the first
+inline void png_filter_row(const uint8_t* row, const uint8_t* prior, const int bytes, uint8_t* out, std::vector<uint8_t>& scratch)
+{
+	constexpr int bpp = 4;
+	scratch.resize(bytes);
+	int best_sum = -1;
+	for (int filter = 0; filter < 5; filter++)
+	{
+		int sum = 0;
+		for (int i = 0; i < bytes; i++)
+		{
+			const int left = i >= bpp ? row[i - bpp] : 0, up = prior[i], corner = i >= bpp ? prior[i - bpp] : 0;
+			const int predicted = filter == 0 ? 0 : filter == 1 ? left : filter == 2 ? up : filter == 3 ? (left + up) / 2 : png_paeth(left, up, corner);
+			scratch[i] = (uint8_t)(row[i] - predicted);
+			sum += abs((int8_t)scratch[i]);
+		}
+		if (best_sum >= 0 && sum >= best_sum) continue;
+		best_sum = sum;
+		out[0] = (uint8_t)filter;
+		memcpy(out + 1, scratch.data(), bytes);
+	}
+}
+
+inline void put_big_endian(std::vector<uint8_t>& out, const uint32_t value)
+{
+	const uint8_t bytes[] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value };
+	out.insert(out.end(), bytes, bytes + 4);
+}
+
+// a whole chunk, its length, type and crc around data
+inline void png_chunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, const size_t size)
+{
+	put_big_endian(out, (uint32_t)size);
+	const size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	put_big_endian(out, png_crc32(0, out.data() + start, size + 4));
+}
+
+struct png_strip
+{
+	std::vector<uint8_t> chunk;
+	uint32_t adler = 1;
+	size_t size = 0; // filtered bytes, what the adler is over
+};
+
+// rows [y0, y1) filtered, deflated and wrapped in an IDAT chunk. row(y, out) gives a row of rgba8
+template <typename Row>
+void encode_png_strip(const Row& row, const int width, const int y0, const int y1, png_strip& strip)
+{
+	const int bytes = width * 4;
+	std::vector<uint8_t> rows((size_t)(y1 - y0 + 1) * bytes, 0), filtered((size_t)(y1 - y0) * (bytes + 1)), scratch;
+	// the row above is filtered against too
+	if (y0 > 0) row(y0 - 1, rows.data());
+	for (int y = y0; y < y1; y++)
+	{
+		uint8_t* current = rows.data() + (size_t)(y - y0 + 1) * bytes;
+		row(y, current);
+		png_filter_row(current, current - bytes, bytes, filtered.data() + (size_t)(y - y0) * (bytes + 1), scratch);
+	}
+	strip.size = filtered.size();
+	strip.adler = adler32(filtered.data(), filtered.size());
+	std::vector<uint8_t> deflated;
+	deflated.reserve(filtered.size() / 2);
+	deflate_strip(filtered.data(), filtered.size(), deflated);
+	strip.chunk.clear();
+	png_chunk(strip.chunk, "IDAT", deflated.data(), deflated.size());
+}
+
+// an rgba8 png of width * height at path, false if it couldn't be written. prepare(y0, y1) runs on this thread
+// before the strips covering those rows are encoded, row(y, out) then copies a row out from every core. only a
+// couple of strips per core are held at a time
+template <typename Prepare, typename Row>
+bool write_png(const std::string& path, const int width, const int height, const Prepare& prepare, const Row& row)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr) return false;
+	const size_t stride = (size_t)width * 4;
+	// a megabyte or so each, so what goes around every strip doesn't add up to anything
+	const int strip_rows = (int)std::max<size_t>(1, std::min<size_t>(height, ((1 << 20) + stride - 1) / stride));
+	const int strips = (height + strip_rows - 1) / strip_rows;
+	const int batch = std::max(1, (int)std::thread::hardware_concurrency()) * 2;
+
+	std::vector<uint8_t> head = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	std::vector<uint8_t> header;
+	put_big_endian(header, width);
+	put_big_endian(header, height);
+	const uint8_t format[] = { 8, 6, 0, 0, 0 }; // 8 bits, rgba, deflate, adaptive filters, not interlaced
+	header.insert(header.end(), format, format + 5);
+	png_chunk(head, "IHDR", header.data(), header.size());
+	const uint8_t zlib_header[] = { 0x78, 0x01 };
+	png_chunk(head, "IDAT", zlib_header, 2);
+	bool ok = fwrite(head.data(), 1, head.size(), file) == head.size();
+
+	uint32_t adler = 1;
+	std::vector<png_strip> encoded(batch);
+	for (int first = 0; first < strips && ok; first += batch)
+	{
+		const int last = std::min(strips, first + batch);
+		prepare(first * strip_rows, std::min(height, last * strip_rows));
+		parallel_for(last - first, [&](const int begin, const int end)
+		{
+			for (int s = begin; s < end; s++)
+			{
+				const int y0 = (first + s) * strip_rows;
+				encode_png_strip(row, width, y0, std::min(height, y0 + strip_rows), encoded[s]);
+			}
+		});
+		for (int s = 0; s < last - first && ok; s++)
+		{
+			ok = fwrite(encoded[s].chunk.data(), 1, encoded[s].chunk.size(), file) == encoded[s].chunk.size();
+			adler = adler32_combine(adler, encoded[s].adler, encoded[s].size);
+		}
+	}
+
+	// the last block is an empty fixed one, then the checksum
+	std::vector<uint8_t> tail, end = { 0x03, 0x00 };
+	put_big_endian(end, adler);
+	png_chunk(tail, "IDAT", end.data(), end.size());
+	png_chunk(tail, "IEND", nullptr, 0);
+	ok = ok && fwrite(tail.data(), 1, tail.size(), file) == tail.size();
+	ok = fclose(file) == 0 && ok;
+	if (!ok) remove(path.c_str());
+	return ok;
+}
+
+// import the other way around, a png streamed out of the file a row at a time straight into where its pixels go.
+// only a row and the deflate window are ever held. interlaced ones can't be done a row at a time, stb_image
+// does those
+
+// the file a bit at a time, through a buffer
+struct png_file_reader
+{
+	FILE* file = nullptr;
+	std::vector<uint8_t> buffer = std::vector<uint8_t>(1 << 16);
+	size_t pos = 0, end = 0;
+
+	int byte()
+	{
+		if (pos == end)
+		{
+			pos = 0;
+			end = fread(buffer.data(), 1, buffer.size(), file);
+			if (end == 0) return -1;
+		}
+		return buffer[pos++];
+	}
+
+	bool read(uint8_t* out, const size_t size)
+	{
+		for (size_t i = 0; i < size; i++)
+		{
+			const int b = byte();
+			if (b < 0) return false;
+			out[i] = (uint8_t)b;
+		}
+		return true;
+	}
+
+	bool big_endian(uint32_t& value)
+	{
+		uint8_t bytes[4];
+		if (!read(bytes, 4)) return false;
+		value = (uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+		return true;
+	}
+
+	bool skip(size_t size)
+	{
+		for (; size > 0; size--)
+		{
+			if (byte() < 0) return false;
+		}
+		return true;
+	}
+};
+
+// the IDAT chunks' contents one after another, the zlib stream
+struct png_idat_reader
+{
+	png_file_reader& file;
+	uint32_t left = 0; // in the current chunk
+	bool done = false;
+
+	// -1 past the last one
+	int byte()
+	{
+		while (left == 0)
+		{
+			uint32_t size, type;
+			if (done || !file.skip(4) || !file.big_endian(size) || !file.big_endian(type) || type != 0x49444154)
+			{
+				done = true;
+				return -1;
+			}
+			left = size;
+		}
+		left--;
+		return file.byte();
+	}
+};
+
+struct inflate_bits
+{
+	png_idat_reader& in;
+	uint64_t buffer = 0;
+	int count = 0, past_end = 0;
+
+	void refill()
+	{
+		while (count <= 56)
+		{
+			int b = in.byte();
+			if (b < 0)
+			{
+				b = 0;
+				past_end++;
+			}
+			buffer |= (uint64_t)b << count;
+			count += 8;
+		}
+	}
+
+	uint32_t bits(const int n)
+	{
+		if (count < n) refill();
+		const uint32_t value = (uint32_t)(buffer & ((1ull << n) - 1));
+		buffer >>= n;
+		count -= n;
+		return value;
+	}
+
+	void align()
+	{
+		bits(count & 7);
+	}
+
+	// whether any of the zeros made up after the end of the data got used
+	bool overrun() const
+	{
+		return past_end * 8 > count;
+	}
+};
+
+struct inflate_huffman
+{
+	uint16_t count[16] = {}, symbol[288] = {};
+	// the next 9 bits to the symbol (shifted up 4) and the length of its code, 0 when the code's longer
+	uint16_t fast[512] = {};
+
+	bool build(const uint8_t* lengths, const int n)
+	{
+		memset(count, 0, sizeof(count));
+		memset(fast, 0, sizeof(fast));
+		for (int i = 0; i < n; i++) count[lengths[i]]++;
+		count[0] = 0;
+		int left = 1;
+		for (int length = 1; length < 16; length++)
+		{
+			left = left * 2 - count[length];
+			if (left < 0) return false;
+		}
+		uint16_t offset[16] = {}, code[16] = {};
+		for (int length = 1; length < 15; length++) offset[length + 1] = offset[length] + count[length];
+		for (int length = 1, next = 0; length < 16; length++)
+		{
+			next = (next + count[length - 1]) << 1;
+			code[length] = (uint16_t)next;
+		}
+		for (int i = 0; i < n; i++)
+		{
+			const int length = lengths[i];
+			if (length == 0) continue;
+			symbol[offset[length]++] = (uint16_t)i;
+			const int c = code[length]++;
+			if (length > 9) continue;
+			int reversed = 0;
+			for (int b = 0; b < length; b++) reversed |= ((c >> b) & 1) << (length - 1 - b);
+			for (int k = reversed; k < 512; k += 1 << length) fast[k] = (uint16_t)(i << 4 | length);
+		}
+		return true;
+	}
+
+	int decode(inflate_bits& in) const
+	{
+		if (in.count < 16) in.refill();
+		const uint16_t entry = fast[in.buffer & 511];
+		if (entry != 0)
+		{
+			in.bits(entry & 15);
+			return entry >> 4;
+		}
+		// a bit at a time through the canonical code
+		int code = 0, first = 0, index = 0;
+		for (int length = 1; length < 16; length++)
+		{
+			code |= (int)in.bits(1);
+			const int n = count[length];
+			if (code - n < first) return symbol[index + (code - first)];
+			index += n;
+			first = (first + n) << 1;
+			code <<= 1;
+		}
+		return -1;
+	}
+};
+
+// decodes a zlib stream, giving what comes out to sink(data, size) every 32k or so
+template <typename Sink>
+bool inflate_stream(png_idat_reader& source, const Sink& sink)
+{
+	static const uint16_t length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const uint8_t length_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const uint16_t distance_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049,
+		3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	static const uint8_t code_order[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	inflate_bits in = { source };
+	const uint32_t cmf = in.bits(8), flg = in.bits(8);
+	if ((cmf & 15) != 8 || (cmf * 256 + flg) % 31 != 0 || (flg & 32) != 0) return false;
+
+	// twice the window, one half fills up while the other is still there to copy from
+	std::vector<uint8_t> window(deflate_window * 2);
+	constexpr size_t mask = deflate_window * 2 - 1;
+	size_t total = 0, flushed = 0;
+	const auto put = [&](const uint8_t b)
+	{
+		window[total & mask] = b;
+		total++;
+		if ((total & (deflate_window - 1)) != 0) return;
+		sink(window.data() + (flushed & mask), total - flushed);
+		flushed = total;
+	};
+
+	inflate_huffman literals, distances;
+	uint8_t lengths[288 + 32];
+	bool last;
+	do
+	{
+		last = in.bits(1) != 0;
+		const uint32_t type = in.bits(2);
+		if (type == 0)
+		{
+			in.align();
+			const uint32_t length = in.bits(16), inverse = in.bits(16);
+			if (length != (~inverse & 0xffff)) return false;
+			for (uint32_t i = 0; i < length; i++) put((uint8_t)in.bits(8));
+			if (in.overrun()) return false;
+			continue;
+		}
+		if (type == 1)
+		{
+			memset(lengths, 8, 144);
+			memset(lengths + 144, 9, 112);
+			memset(lengths + 256, 7, 24);
+			memset(lengths + 280, 8, 8);
+			memset(lengths + 288, 5, 30);
+			literals.build(lengths, 288);
+			distances.build(lengths + 288, 30);
+		}
+		else if (type == 2)
+		{
+			const int literal_count = in.bits(5) + 257, distance_count = in.bits(5) + 1, code_count = in.bits(4) + 4;
+			uint8_t code_lengths[19] = {};
+			for (int i = 0; i < code_count; i++) code_lengths[code_order[i]] = (uint8_t)in.bits(3);
+			inflate_huffman codes;
+			if (literal_count > 286 || distance_count > 30 || !codes.build(code_lengths, 19)) return false;
+			for (int i = 0; i < literal_count + distance_count;)
+			{
+				const int symbol = codes.decode(in);
+				if (symbol < 0) return false;
+				if (symbol < 16)
+				{
+					lengths[i++] = (uint8_t)symbol;
+					continue;
+				}
+				int repeat = 0;
+				uint8_t value = 0;
+				if (symbol == 16)
+				{
+					if (i == 0) return false;
+					value = lengths[i - 1];
+					repeat = 3 + in.bits(2);
+				}
+				else repeat = symbol == 17 ? 3 + in.bits(3) : 11 + in.bits(7);
+				if (i + repeat > literal_count + distance_count) return false;
+				memset(lengths + i, value, repeat);
+				i += repeat;
+			}
+			if (lengths[256] == 0 || !literals.build(lengths, literal_count) || !distances.build(lengths + literal_count, distance_count)) return false;
+		}
+		else return false;
+
+		for (;;)
+		{
+			const int symbol = literals.decode(in);
+			if (symbol < 256)
+			{
+				if (symbol < 0) return false;
+				put((uint8_t)symbol);
+				continue;
+			}
+			if (symbol == 256) break;
+			if (symbol - 257 >= 29) return false;
+			const int length = length_base[symbol - 257] + in.bits(length_extra[symbol - 257]);
+			const int code = distances.decode(in);
+			if (code < 0 || code >= 30) return false;
+			const size_t distance = distance_base[code] + (code >= 4 ? in.bits(code / 2 - 1) : 0);
+			if (distance > total) return false;
+			for (int i = 0; i < length; i++) put(window[(total - distance) & mask]);
+			if (in.overrun()) return false;
+		}
+		if (in.overrun()) return false;
+	} while (!last);
+	if (total > flushed) sink(window.data() + (flushed & mask), total - flushed);
+	return true;
+}
+
+// reads the png at path. pixels(width, height) gets called once its size is known and returns where its rgba8
+// rows go, nullptr to give up. false if it isn't a png, is damaged or is interlaced
+template <typename Pixels>
+bool read_png(const std::string& path, const Pixels& pixels)
+{
+	png_file_reader file;
+	file.file = fopen(path.c_str(), "rb");
+	if (file.file == nullptr) return false;
+	struct closer
+	{
+		FILE* file;
+		~closer() { fclose(file); }
+	} close = { file.file };
+
+	static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	uint8_t head[8];
+	if (!file.read(head, 8) || memcmp(head, signature, 8) != 0) return false;
+
+	uint32_t width = 0, height = 0;
+	int depth = 0, type = -1, channels = 0;
+	uint8_t palette[256 * 4];
+	memset(palette, 255, sizeof(palette));
+	// the one color that's transparent, for gray and rgb
+	int key[3] = { -1, -1, -1 };
+	for (;;)
+	{
+		uint32_t size, chunk;
+		if (!file.big_endian(size) || !file.big_endian(chunk)) return false;
+		if (chunk == 0x49484452) // IHDR
+		{
+			uint8_t header[13];
+			if (size != 13 || !file.read(header, 13) || !file.skip(4)) return false;
+			width = (uint32_t)header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+			height = (uint32_t)header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7];
+			depth = header[8];
+			type = header[9];
+			channels = type == 0 || type == 3 ? 1 : type == 2 ? 3 : type == 4 ? 2 : type == 6 ? 4 : 0;
+			const bool low = depth == 1 || depth == 2 || depth == 4;
+			if (width == 0 || height == 0 || width > (1u << 24) || height > (1u << 24) || channels == 0 || header[10] != 0 || header[11] != 0
+				|| header[12] != 0 || !(depth == 8 || (depth == 16 && type != 3) || (low && (type == 0 || type == 3)))) return false;
+			continue;
+		}
+		if (chunk == 0x504c5445 && size <= 768 && size % 3 == 0) // PLTE
+		{
+			for (uint32_t i = 0; i < size / 3; i++)
+			{
+				if (!file.read(palette + i * 4, 3)) return false;
+			}
+			if (!file.skip(4)) return false;
+			continue;
+		}
+		if (chunk == 0x74524e53 && size <= 256) // tRNS
+		{
+			uint8_t values[256];
+			if (!file.read(values, size) || !file.skip(4)) return false;
+			if (type == 3)
+			{
+				for (uint32_t i = 0; i < size; i++) palette[i * 4 + 3] = values[i];
+			}
+			for (int i = 0; i < (type == 0 ? 1 : type == 2 ? 3 : 0) && (uint32_t)i * 2 + 1 < size; i++)
+			{
+				key[i] = values[i * 2] << 8 | values[i * 2 + 1];
+			}
+			continue;
+		}
+		if (chunk == 0x49444154) // IDAT
+		{
+			if (channels == 0) return false;
+			png_idat_reader idat = { file, size };
+			uint8_t* out = pixels((int)width, (int)height);
+			if (out == nullptr) return false;
+
+			const size_t row_bytes = ((size_t)width * channels * depth + 7) / 8;
+			const int bpp = std::max(1, channels * depth / 8);
+			std::vector<uint8_t> row(row_bytes + 1), prior(row_bytes + 1, 0);
+			size_t filled = 0;
+			uint32_t y = 0;
+			bool ok = true;
+			const auto decode_row = [&]()
+			{
+				uint8_t* cur = row.data() + 1;
+				const uint8_t* up = prior.data() + 1;
+				const uint8_t filter = row[0];
+				if (filter > 4)
+				{
+					ok = false;
+					return;
+				}
+				for (size_t i = 0; i < row_bytes && filter != 0; i++)
+				{
+					const int left = i >= (size_t)bpp ? cur[i - bpp] : 0, corner = i >= (size_t)bpp ? up[i - bpp] : 0;
+					cur[i] += (uint8_t)(filter == 1 ? left : filter == 2 ? up[i] : filter == 3 ? (left + up[i]) / 2 : png_paeth(left, up[i], corner));
+				}
+				uint8_t* to = out + (size_t)y * width * 4;
+				if (depth == 8 && type == 6) memcpy(to, cur, (size_t)width * 4);
+				else
+				{
+					const int max = (1 << depth) - 1;
+					// a sample as it is in the file, and as 8 bits
+					const auto raw = [&](const size_t i) -> int
+					{
+						if (depth == 16) return cur[i * 2] << 8 | cur[i * 2 + 1];
+						if (depth == 8) return cur[i];
+						return (cur[i * depth / 8] >> (8 - depth - i * depth % 8)) & max;
+					};
+					const auto eight = [&](const int v) { return (uint8_t)(depth == 16 ? v >> 8 : depth == 8 ? v : v * 255 / max); };
+					for (uint32_t x = 0; x < width; x++, to += 4)
+					{
+						const size_t s = (size_t)x * channels;
+						if (type == 3)
+						{
+							memcpy(to, palette + raw(s) * 4, 4);
+							continue;
+						}
+						const int first = raw(s);
+						if (type == 0 || type == 4)
+						{
+							to[0] = to[1] = to[2] = eight(first);
+							to[3] = type == 4 ? eight(raw(s + 1)) : first == key[0] ? 0 : 255;
+							continue;
+						}
+						const int second = raw(s + 1), third = raw(s + 2);
+						to[0] = eight(first);
+						to[1] = eight(second);
+						to[2] = eight(third);
+						to[3] = type == 6 ? eight(raw(s + 3)) : first == key[0] && second == key[1] && third == key[2] ? 0 : 255;
+					}
+				}
+				row.swap(prior);
+				y++;
+			};
+			ok = inflate_stream(idat, [&](const uint8_t* data, size_t size)
+			{
+				while (size > 0 && y < height && ok)
+				{
+					const size_t n = std::min(size, row.size() - filled);
+					memcpy(row.data() + filled, data, n);
+					filled += n;
+					data += n;
+					size -= n;
+					if (filled < row.size()) continue;
+					filled = 0;
+					decode_row();
+				}
+			}) && ok;
+			return ok && y == height;
+		}
+		if (chunk == 0x49454e44 || !file.skip((size_t)size + 4)) return false; // IEND before any IDAT
+	}
+}
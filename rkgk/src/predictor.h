@@ -0,0 +1,86 @@
+#pragma once
+#include <algorithm>
+
+#include "imgui/imgui.h"
+#include "mathstuff.h"
+
+struct stroke_sample
+{
+	ImVec2 pos;
+	float pressure = 0;
+	double time = 0; // seconds
+};
+
+// extrapolates where the pen will be a few ms from now, so we can draw ahead of the real samples
+struct stroke_predictor
+{
+	bool enabled = true;
+	float lookahead_ms = 12;
+
+	void reset()
+	{
+		count_ = 0;
+	}
+
+	void add_sample(const stroke_sample& sample)
+	{
+		// only samples newer than the last one are kept, two with the same time would make a velocity out
+		// of nothing
+		if (count_ > 0 && sample.time <= samples_[count_ - 1].time) return;
+
+		if (count_ == max_samples)
+		{
+			std::copy(samples_ + 1, samples_ + max_samples, samples_);
+			count_--;
+		}
+		samples_[count_++] = sample;
+	}
+
+	bool predict(stroke_sample& predicted) const
+	{
+		if (!enabled || lookahead_ms <= 0 || count_ < 2) return false;
+
+		const stroke_sample& s2 = samples_[count_ - 1];
+		const stroke_sample& s1 = samples_[count_ - 2];
+		const float dt1 = (float)(s2.time - s1.time);
+		// pen has been resting, whatever we'd predict is stale
+		if (dt1 > max_sample_gap) return false;
+
+		ImVec2 velocity((s2.pos.x - s1.pos.x) / dt1, (s2.pos.y - s1.pos.y) / dt1);
+		float pressure_rate = (s2.pressure - s1.pressure) / dt1;
+
+		// average in the previous velocity as well, single frame deltas are jittery
+		if (count_ >= 3)
+		{
+			const stroke_sample& s0 = samples_[count_ - 3];
+			const float dt0 = (float)(s1.time - s0.time);
+			if (dt0 <= max_sample_gap)
+			{
+				velocity.x = (velocity.x + (s1.pos.x - s0.pos.x) / dt0) * .5f;
+				velocity.y = (velocity.y + (s1.pos.y - s0.pos.y) / dt0) * .5f;
+				pressure_rate = (pressure_rate + (s1.pressure - s0.pressure) / dt0) * .5f;
+			}
+		}
+
+		const float dt = lookahead_ms / 1000.0f;
+		predicted.pos = ImVec2(s2.pos.x + velocity.x * dt, s2.pos.y + velocity.y * dt);
+		predicted.pressure = std::max(0.0f, std::min(1.0f, s2.pressure + pressure_rate * dt));
+		predicted.time = s2.time + dt;
+
+		// never guess further than the pen actually travelled last frame, overshoot looks worse than lag
+		const float max_travel = distance(s1.pos, s2.pos);
+		const float travel = distance(s2.pos, predicted.pos);
+		if (travel > max_travel && travel > 0)
+		{
+			const float f = max_travel / travel;
+			predicted.pos = ImVec2(lerp(s2.pos.x, predicted.pos.x, f), lerp(s2.pos.y, predicted.pos.y, f));
+		}
+		return travel > 0;
+	}
+
+private:
+	static constexpr int max_samples = 3;
+	static constexpr float max_sample_gap = .05f;
+	stroke_sample samples_[max_samples];
+	int count_ = 0;
+};
@@ -0,0 +1,451 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "imgui/imgui.h"
+#include "parallel.h"
+
+enum class selection_op
+{
+	replace,
+	add,
+	subtract,
+	intersect
+};
+
+// how much of a run of pixels is selected
+enum class coverage
+{
+	none,
+	all,
+	partial
+};
+
+// 8-bit selection mask split into tiles. tiles that are entirely selected or unselected (most of them)
+// only store that value and no pixels
+struct selection
+{
+	static constexpr int tile_size = 64;
+
+	void resize(const int width, const int height)
+	{
+		width_ = width;
+		height_ = height;
+		tiles_x_ = (width + tile_size - 1) / tile_size;
+		tiles_y_ = (height + tile_size - 1) / tile_size;
+		deselect();
+	}
+
+	// nothing selected means no restrictions at all, not that nothing can be painted
+	bool active() const { return active_; }
+	// bumped on every change so whoever displays the selection knows when to redraw it
+	int version() const { return version_; }
+
+	void deselect()
+	{
+		set_all(0);
+		active_ = false;
+	}
+
+	void select_all()
+	{
+		set_all(255);
+		active_ = true;
+	}
+
+	void invert()
+	{
+		if (!active_) set_all(0);
+		parallel_for((int)tiles_.size(), [&](const int first, const int last)
+		{
+			for (int t = first; t < last; t++)
+			{
+				uniform_[t] = 255 - uniform_[t];
+				for (auto& v : tiles_[t])
+				{
+					v = 255 - v;
+				}
+			}
+		});
+		active_ = true;
+		version_++;
+	}
+
+	uint8_t at(const int x, const int y) const
+	{
+		const int t = (y / tile_size) * tiles_x_ + x / tile_size;
+		if (tiles_[t].empty()) return uniform_[t];
+		return tiles_[t][(y % tile_size) * tile_size + x % tile_size];
+	}
+
+	// copies the mask of [x, x + count) on row y to out, unless the whole run is selected or not selected
+	// at all, which is what painting mostly runs into and lets it skip the mask entirely
+	coverage row(const int y, const int x, const int count, uint8_t* out) const
+	{
+		const int ty = y / tile_size;
+		const int t0 = x / tile_size, t1 = (x + count - 1) / tile_size;
+		bool any_selected = false, any_unselected = false;
+		for (int t = t0; t <= t1; t++)
+		{
+			const int i = ty * tiles_x_ + t;
+			if (!tiles_[i].empty()) return copy_row(y, x, count, out);
+			(uniform_[i] ? any_selected : any_unselected) = true;
+		}
+		if (any_selected && any_unselected) return copy_row(y, x, count, out);
+		return any_selected ? coverage::all : coverage::none;
+	}
+
+	// box [x0, x1) * [y0, y1) around the tiles with anything selected in them, false if there are none
+	bool bounds(int& x0, int& y0, int& x1, int& y1) const
+	{
+		x0 = width_;
+		y0 = height_;
+		x1 = y1 = 0;
+		for (int ty = 0; ty < tiles_y_; ty++)
+		{
+			for (int tx = 0; tx < tiles_x_; tx++)
+			{
+				const int t = ty * tiles_x_ + tx;
+				if (tiles_[t].empty() && uniform_[t] == 0) continue;
+				x0 = std::min(x0, tx * tile_size);
+				y0 = std::min(y0, ty * tile_size);
+				x1 = std::max(x1, std::min(width_, (tx + 1) * tile_size));
+				y1 = std::max(y1, std::min(height_, (ty + 1) * tile_size));
+			}
+		}
+		return x0 < x1;
+	}
+
+	// the mask over a box of the canvas as plain bytes, w * h of them
+	void read(const int x, const int y, const int w, const int h, uint8_t* out) const
+	{
+		for (int row_y = 0; row_y < h; row_y++)
+		{
+			uint8_t* dst = out + (size_t)row_y * w;
+			const coverage c = row(y + row_y, x, w, dst);
+			if (c != coverage::partial) memset(dst, c == coverage::all ? 255 : 0, w);
+		}
+	}
+
+	void rect(const selection_op op, float x0, float y0, float x1, float y1)
+	{
+		if (x0 > x1) std::swap(x0, x1);
+		if (y0 > y1) std::swap(y0, y1);
+		shape_begin(x0, y0, x1, y1);
+		// pixels whose centers are inside
+		const int left = (int)lround(x0), top = (int)lround(y0), right = (int)lround(x1), bottom = (int)lround(y1);
+		for (int y = std::max(top, shape_y_); y < std::min(bottom, shape_y_ + shape_h_); y++)
+		{
+			for (int x = std::max(left, shape_x_); x < std::min(right, shape_x_ + shape_w_); x++)
+			{
+				shape_[(size_t)(y - shape_y_) * shape_w_ + x - shape_x_] = 255;
+			}
+		}
+		combine(op);
+	}
+
+	void ellipse(const selection_op op, float x0, float y0, float x1, float y1)
+	{
+		if (x0 > x1) std::swap(x0, x1);
+		if (y0 > y1) std::swap(y0, y1);
+		shape_begin(x0, y0, x1, y1);
+		const float cx = (x0 + x1) / 2, cy = (y0 + y1) / 2;
+		const float rx = std::max(.5f, (x1 - x0) / 2), ry = std::max(.5f, (y1 - y0) / 2);
+		const float r_min = std::min(rx, ry);
+		for (int y = 0; y < shape_h_; y++)
+		{
+			const float dy = (shape_y_ + y + .5f - cy) / ry;
+			for (int x = 0; x < shape_w_; x++)
+			{
+				const float dx = (shape_x_ + x + .5f - cx) / rx;
+				// distance to the edge in pixels, close enough for a one pixel anti-aliased edge
+				const float edge = (1 - std::sqrt(dx * dx + dy * dy)) * r_min + .5f;
+				shape_[(size_t)y * shape_w_ + x] = (uint8_t)(std::max(0.0f, std::min(1.0f, edge)) * 255);
+			}
+		}
+		combine(op);
+	}
+
+	void lasso(const selection_op op, const std::vector<ImVec2>& points)
+	{
+		if (points.size() < 3) return;
+		float x0 = points[0].x, y0 = points[0].y, x1 = x0, y1 = y0;
+		for (const auto& p : points)
+		{
+			x0 = std::min(x0, p.x);
+			y0 = std::min(y0, p.y);
+			x1 = std::max(x1, p.x);
+			y1 = std::max(y1, p.y);
+		}
+		shape_begin(x0, y0, x1, y1);
+
+		// even-odd scanline fill through the pixel centers
+		std::vector<float> crossings;
+		for (int y = 0; y < shape_h_; y++)
+		{
+			const float py = shape_y_ + y + .5f;
+			crossings.clear();
+			for (size_t i = 0; i < points.size(); i++)
+			{
+				const ImVec2 a = points[i], b = points[(i + 1) % points.size()];
+				if ((a.y <= py) == (b.y <= py)) continue;
+				crossings.push_back(a.x + (py - a.y) / (b.y - a.y) * (b.x - a.x));
+			}
+			std::sort(crossings.begin(), crossings.end());
+			for (size_t i = 0; i + 1 < crossings.size(); i += 2)
+			{
+				const int from = std::max(0, (int)lround(crossings[i]) - shape_x_);
+				const int to = std::min(shape_w_, (int)lround(crossings[i + 1]) - shape_x_);
+				if (from < to) memset(shape_.data() + (size_t)y * shape_w_ + from, 255, to - from);
+			}
+		}
+		combine(op);
+	}
+
+	// combines any mask given over a box of the canvas
+	void mask(const selection_op op, const uint8_t* values, const int x, const int y, const int w, const int h)
+	{
+		shape_begin((float)x, (float)y, (float)(x + w - 1), (float)(y + h - 1));
+		for (int row_y = 0; row_y < shape_h_; row_y++)
+		{
+			memcpy(shape_.data() + (size_t)row_y * shape_w_, values + (size_t)(shape_y_ - y + row_y) * w + shape_x_ - x, shape_w_);
+		}
+		combine(op);
+	}
+
+	// softens the edge with three box blurs, which comes out close to a gaussian reaching radius pixels
+	void feather(const int radius)
+	{
+		if (!active_ || radius <= 0) return;
+
+		// everything selected plus as far as the blur spreads it
+		const int box = std::max(1, (radius + 2) / 3);
+		int x0, y0, x1, y1;
+		if (!bounds(x0, y0, x1, y1)) return;
+		x0 = std::max(0, x0 - box * 3);
+		y0 = std::max(0, y0 - box * 3);
+		x1 = std::min(width_, x1 + box * 3);
+		y1 = std::min(height_, y1 + box * 3);
+
+		shape_x_ = x0;
+		shape_y_ = y0;
+		shape_w_ = x1 - x0;
+		shape_h_ = y1 - y0;
+		shape_.resize((size_t)shape_w_ * shape_h_);
+		parallel_for(shape_h_, [&](const int first, const int last)
+		{
+			for (int y = first; y < last; y++)
+			{
+				uint8_t* dst = shape_.data() + (size_t)y * shape_w_;
+				const coverage c = row(shape_y_ + y, shape_x_, shape_w_, dst);
+				if (c != coverage::partial) memset(dst, c == coverage::all ? 255 : 0, shape_w_);
+			}
+		});
+
+		for (int pass = 0; pass < 3; pass++)
+		{
+			blur_rows(shape_.data(), shape_w_, shape_h_, box);
+			blur_columns(shape_.data(), shape_w_, shape_h_, box);
+		}
+		combine(selection_op::replace, false);
+	}
+
+private:
+	int width_ = 0, height_ = 0, tiles_x_ = 0, tiles_y_ = 0;
+	bool active_ = false;
+	int version_ = 0;
+	// pixels of the tiles that aren't uniform, and the value of the ones that are
+	std::vector<std::vector<uint8_t>> tiles_;
+	std::vector<uint8_t> uniform_;
+	// the shape being combined with the selection, over its bounding box
+	std::vector<uint8_t> shape_;
+	int shape_x_ = 0, shape_y_ = 0, shape_w_ = 0, shape_h_ = 0;
+
+	void set_all(const uint8_t value)
+	{
+		tiles_.assign((size_t)tiles_x_ * tiles_y_, {});
+		uniform_.assign((size_t)tiles_x_ * tiles_y_, value);
+		version_++;
+	}
+
+	coverage copy_row(const int y, const int x, const int count, uint8_t* out) const
+	{
+		const int ty = y / tile_size, in_tile_y = y % tile_size;
+		for (int i = 0; i < count;)
+		{
+			const int px = x + i;
+			const int t = ty * tiles_x_ + px / tile_size;
+			const int n = std::min(count - i, tile_size - px % tile_size);
+			if (tiles_[t].empty())
+			{
+				memset(out + i, uniform_[t], n);
+			}
+			else
+			{
+				memcpy(out + i, tiles_[t].data() + in_tile_y * tile_size + px % tile_size, n);
+			}
+			i += n;
+		}
+		return coverage::partial;
+	}
+
+	void shape_begin(const float x0, const float y0, const float x1, const float y1)
+	{
+		shape_x_ = std::max(0, (int)floor(x0));
+		shape_y_ = std::max(0, (int)floor(y0));
+		shape_w_ = std::max(0, std::min(width_, (int)ceil(x1) + 1) - shape_x_);
+		shape_h_ = std::max(0, std::min(height_, (int)ceil(y1) + 1) - shape_y_);
+		shape_.assign((size_t)shape_w_ * shape_h_, 0);
+	}
+
+	// merges shape_ into the selection, every tile on its own
+	void combine(const selection_op op, const bool clear_first = true)
+	{
+		// no selection is the same as everything selected: taking from it would need a mask of
+		// everything but the shape, so that does nothing, and intersecting starts from all of it
+		if (!active_ && op == selection_op::subtract) return;
+		if (!active_) set_all(op == selection_op::intersect ? 255 : 0);
+		else if (op == selection_op::replace && clear_first) set_all(0);
+		active_ = true;
+		version_++;
+
+		const int tx0 = shape_x_ / tile_size, ty0 = shape_y_ / tile_size;
+		const int tx1 = shape_w_ > 0 ? (shape_x_ + shape_w_ - 1) / tile_size : tx0 - 1;
+		const int ty1 = shape_h_ > 0 ? (shape_y_ + shape_h_ - 1) / tile_size : ty0 - 1;
+		if (op == selection_op::intersect)
+		{
+			// everything outside of the shape goes
+			for (int ty = 0; ty < tiles_y_; ty++)
+			{
+				for (int tx = 0; tx < tiles_x_; tx++)
+				{
+					if (tx >= tx0 && tx <= tx1 && ty >= ty0 && ty <= ty1) continue;
+					tiles_[ty * tiles_x_ + tx].clear();
+					uniform_[ty * tiles_x_ + tx] = 0;
+				}
+			}
+		}
+		if (tx1 < tx0 || ty1 < ty0) return;
+
+		const int columns = tx1 - tx0 + 1;
+		parallel_for(columns * (ty1 - ty0 + 1), [&](const int first, const int last)
+		{
+			for (int i = first; i < last; i++)
+			{
+				combine_tile(op, tx0 + i % columns, ty0 + i / columns);
+			}
+		});
+	}
+
+	void combine_tile(const selection_op op, const int tx, const int ty)
+	{
+		const int t = ty * tiles_x_ + tx;
+		auto& tile = tiles_[t];
+		if (tile.empty()) tile.assign(tile_size * tile_size, uniform_[t]);
+
+		// the part of the tile that's on the canvas
+		const int x0 = tx * tile_size, y0 = ty * tile_size;
+		const int w = std::min(tile_size, width_ - x0), h = std::min(tile_size, height_ - y0);
+		for (int y = 0; y < h; y++)
+		{
+			const int sy = y0 + y - shape_y_;
+			const bool row_in_shape = sy >= 0 && sy < shape_h_;
+			uint8_t* dst = tile.data() + y * tile_size;
+			for (int x = 0; x < w; x++)
+			{
+				const int sx = x0 + x - shape_x_;
+				const int s = row_in_shape && sx >= 0 && sx < shape_w_ ? shape_[(size_t)sy * shape_w_ + sx] : 0;
+				switch (op)
+				{
+				case selection_op::replace:
+					// only the feathering replaces without clearing first, and it covers every tile it touches
+					dst[x] = (uint8_t)s;
+					break;
+				case selection_op::add:
+					dst[x] = (uint8_t)std::max<int>(dst[x], s);
+					break;
+				case selection_op::subtract:
+					dst[x] = (uint8_t)(dst[x] * (255 - s) / 255);
+					break;
+				case selection_op::intersect:
+					dst[x] = (uint8_t)(dst[x] * s / 255);
+					break;
+				}
+			}
+		}
+
+		// drop the pixels again if they all ended up the same
+		const uint8_t first = tile[0];
+		for (int y = 0; y < h; y++)
+		{
+			const uint8_t* row = tile.data() + y * tile_size;
+			for (int x = 0; x < w; x++)
+			{
+				if (row[x] != first || (first != 0 && first != 255)) return;
+			}
+		}
+		tile.clear();
+		tile.shrink_to_fit();
+		uniform_[t] = first;
+	}
+
+	// running sum box blurs, edges repeat the outermost pixel
+	static void blur_rows(uint8_t* data, const int width, const int height, const int radius)
+	{
+		const int window = radius * 2 + 1;
+		parallel_for(height, [&](const int first, const int last)
+		{
+			std::vector<uint8_t> line(width);
+			for (int y = first; y < last; y++)
+			{
+				uint8_t* p = data + (size_t)y * width;
+				memcpy(line.data(), p, width);
+				int sum = 0;
+				for (int i = -radius; i <= radius; i++)
+				{
+					sum += line[std::max(0, std::min(width - 1, i))];
+				}
+				for (int i = 0; i < width; i++)
+				{
+					p[i] = (uint8_t)((sum + window / 2) / window);
+					sum += line[std::min(width - 1, i + radius + 1)] - line[std::max(0, i - radius)];
+				}
+			}
+		});
+	}
+
+	// down the columns a band at a time, so it's still walking along rows in memory
+	static void blur_columns(uint8_t* data, const int width, const int height, const int radius)
+	{
+		const int window = radius * 2 + 1;
+		const std::vector<uint8_t> src(data, data + (size_t)width * height);
+		const auto at = [&](const int y) { return src.data() + (size_t)std::max(0, std::min(height - 1, y)) * width; };
+		parallel_for_rows(width, tile_size, [&](const int x0, const int x1)
+		{
+			std::vector<int> sums(x1 - x0);
+			for (int i = -radius; i <= radius; i++)
+			{
+				const uint8_t* row = at(i);
+				for (int x = x0; x < x1; x++)
+				{
+					sums[x - x0] += row[x];
+				}
+			}
+			for (int y = 0; y < height; y++)
+			{
+				uint8_t* dst = data + (size_t)y * width;
+				const uint8_t* add = at(y + radius + 1);
+				const uint8_t* sub = at(y - radius);
+				for (int x = x0; x < x1; x++)
+				{
+					int& sum = sums[x - x0];
+					dst[x] = (uint8_t)((sum + window / 2) / window);
+					sum += add[x] - sub[x];
+				}
+			}
+		});
+	}
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// srgb bytes to linear light and back. linear values are 16-bit, 0 to 65535, and going back only looks
+// at the top 12 bits of them, which is still enough for every byte to come back as itself
+struct srgb_tables
+{
+	uint16_t to_linear[256];
+	uint8_t from_linear[4096];
+
+	srgb_tables()
+	{
+		for (int v = 0; v < 256; v++)
+		{
+			to_linear[v] = (uint16_t)lround(decode(v / 255.0f) * 65535);
+		}
+		for (int i = 0; i < 4096; i++)
+		{
+			from_linear[i] = (uint8_t)lround(encode((i * 16 + 8) / 65535.0f) * 255);
+		}
+		// near black a byte's linear value can land in a bucket that rounds to its neighbor
+		for (int v = 0; v < 256; v++)
+		{
+			from_linear[to_linear[v] >> 4] = (uint8_t)v;
+		}
+	}
+
+	static float decode(const float v)
+	{
+		return v <= .04045f ? v / 12.92f : std::pow((v + .055f) / 1.055f, 2.4f);
+	}
+
+	static float encode(const float v)
+	{
+		return v <= .0031308f ? v * 12.92f : 1.055f * std::pow(std::min(1.0f, v), 1 / 2.4f) - .055f;
+	}
+};
+
+inline const srgb_tables& srgb()
+{
+	static const srgb_tables tables;
+	return tables;
+}
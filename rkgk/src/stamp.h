@@ -0,0 +1,178 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "imgui/imgui.h"
+#include "mathstuff.h"
+#include "stb_image.h"
+
+// a brush tip mask scaled and rotated for one size/angle bucket, ready to be blended as is
+struct stamp
+{
+	int width = 0, height = 0;
+	std::vector<uint8_t> mask;
+	uint64_t last_used = 0;
+};
+
+// image brush tip, dark and opaque pixels of the image paint
+struct brush_tip
+{
+	std::string name;
+	// mip chain of the coverage mask, [0] is the image at full size
+	struct mip
+	{
+		int width, height;
+		std::vector<uint8_t> mask;
+	};
+	std::vector<mip> mips;
+
+	static constexpr int angle_steps = 128;
+	static constexpr size_t cache_budget = 32 * 1024 * 1024;
+
+	bool load(const std::string& path)
+	{
+		int w, h, channels;
+		unsigned char* data = stbi_load(path.c_str(), &w, &h, &channels, 4);
+		if (data == nullptr) return false;
+
+		mip base{ w, h, std::vector<uint8_t>((size_t)w * h) };
+		for (int i = 0; i < w * h; i++)
+		{
+			const unsigned char* p = data + i * 4;
+			const int luminance = (p[0] * 54 + p[1] * 183 + p[2] * 19) >> 8;
+			base.mask[i] = (uint8_t)((255 - luminance) * p[3] / 255);
+		}
+		stbi_image_free(data);
+
+		const size_t slash = path.find_last_of("/\\");
+		name = slash == std::string::npos ? path : path.substr(slash + 1);
+		mips.clear();
+		mips.push_back(std::move(base));
+		// box filtered halvings, a stamp is always resampled from a level at most twice its size
+		while (mips.back().width > 1 || mips.back().height > 1)
+		{
+			const mip& src = mips.back();
+			mip half{ std::max(1, src.width / 2), std::max(1, src.height / 2), {} };
+			half.mask.resize((size_t)half.width * half.height);
+			for (int y = 0; y < half.height; y++)
+			{
+				const int sy0 = std::min(src.height - 1, y * 2), sy1 = std::min(src.height - 1, y * 2 + 1);
+				for (int x = 0; x < half.width; x++)
+				{
+					const int sx0 = std::min(src.width - 1, x * 2), sx1 = std::min(src.width - 1, x * 2 + 1);
+					half.mask[y * half.width + x] = (uint8_t)((src.mask[sy0 * src.width + sx0] + src.mask[sy0 * src.width + sx1]
+						+ src.mask[sy1 * src.width + sx0] + src.mask[sy1 * src.width + sx1] + 2) / 4);
+				}
+			}
+			mips.push_back(std::move(half));
+		}
+		cache_.clear();
+		cache_bytes_ = 0;
+		return true;
+	}
+
+	// the stamp for a dab of this size (longest side, in pixels) and angle (radians)
+	const stamp& get(const float size, const float angle)
+	{
+		const int size_bucket = size_to_bucket(size);
+		float turns = angle / 6.2831853f;
+		turns -= floor(turns);
+		const int angle_bucket = (int)lround(turns * angle_steps) % angle_steps;
+		const uint32_t key = (uint32_t)size_bucket * angle_steps + angle_bucket;
+
+		auto it = cache_.find(key);
+		if (it == cache_.end())
+		{
+			evict();
+			it = cache_.emplace(key, build(bucket_to_size(size_bucket), angle_bucket * 6.2831853f / angle_steps)).first;
+			cache_bytes_ += it->second.mask.size();
+		}
+		it->second.last_used = ++use_counter_;
+		return it->second;
+	}
+
+private:
+	std::unordered_map<uint32_t, stamp> cache_;
+	size_t cache_bytes_ = 0;
+	uint64_t use_counter_ = 0;
+
+	// whole pixels for small sizes, then 32 steps per doubling (about 2%)
+	static int size_to_bucket(const float size)
+	{
+		if (size <= 32) return std::max(1, (int)lround(size));
+		return 32 + (int)lround(std::log2(size / 32) * 32);
+	}
+
+	static float bucket_to_size(const int bucket)
+	{
+		if (bucket <= 32) return (float)bucket;
+		return 32 * std::exp2((bucket - 32) / 32.0f);
+	}
+
+	void evict()
+	{
+		while (cache_bytes_ > cache_budget && !cache_.empty())
+		{
+			auto oldest = cache_.begin();
+			for (auto it = cache_.begin(); it != cache_.end(); ++it)
+			{
+				if (it->second.last_used < oldest->second.last_used) oldest = it;
+			}
+			cache_bytes_ -= oldest->second.mask.size();
+			cache_.erase(oldest);
+		}
+	}
+
+	stamp build(const float size, const float angle) const
+	{
+		const mip& full = mips[0];
+		const float scale = size / std::max(full.width, full.height);
+
+		// smallest level that's still at least as big as the stamp
+		int level = 0;
+		while (level + 1 < (int)mips.size() && std::max(mips[level + 1].width, mips[level + 1].height) >= size) level++;
+		const mip& src = mips[level];
+		const float src_scale = (float)src.width / full.width;
+
+		const float c = std::cos(angle), s = std::sin(angle);
+		const float w = full.width * scale, h = full.height * scale;
+		stamp out;
+		out.width = std::max(1, (int)ceil(std::abs(w * c) + std::abs(h * s)));
+		out.height = std::max(1, (int)ceil(std::abs(w * s) + std::abs(h * c)));
+		out.mask.resize((size_t)out.width * out.height);
+
+		// walk the stamp and rotate back into the source level, bilinear is fine as the level is at most 2x the stamp
+		const float to_src = src_scale / scale;
+		for (int y = 0; y < out.height; y++)
+		{
+			for (int x = 0; x < out.width; x++)
+			{
+				const float dx = x + .5f - out.width * .5f, dy = y + .5f - out.height * .5f;
+				const float u = (dx * c + dy * s) * to_src + src.width * .5f - .5f;
+				const float v = (-dx * s + dy * c) * to_src + src.height * .5f - .5f;
+				out.mask[(size_t)y * out.width + x] = sample(src, u, v);
+			}
+		}
+		return out;
+	}
+
+	static uint8_t sample(const mip& src, const float u, const float v)
+	{
+		const int x0 = (int)floor(u), y0 = (int)floor(v);
+		const float fx = u - x0, fy = v - y0;
+		const auto at = [&](const int x, const int y) -> float
+		{
+			if (x < 0 || y < 0 || x >= src.width || y >= src.height) return 0;
+			return src.mask[(size_t)y * src.width + x];
+		};
+		const float top = lerp(at(x0, y0), at(x0 + 1, y0), fx);
+		const float bottom = lerp(at(x0, y0 + 1), at(x0 + 1, y0 + 1), fx);
+		return (uint8_t)lround(lerp(top, bottom, fy));
+	}
+};
+
+std::vector<brush_tip> brush_tips;
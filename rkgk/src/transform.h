@@ -0,0 +1,183 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "blend.h"
+#include "mathstuff.h"
+#include "parallel.h"
+
+enum class resample_filter
+{
+	bilinear,
+	bicubic
+};
+
+constexpr int resample_band = 32;
+
+// catmull-rom weights of the four taps around a sample at fraction t past the second one
+inline void cubic_weights(const float t, float w[4])
+{
+	const float t2 = t * t, t3 = t2 * t;
+	w[0] = .5f * (-t3 + 2 * t2 - t);
+	w[1] = .5f * (3 * t3 - 5 * t2 + 2);
+	w[2] = .5f * (-3 * t3 + 4 * t2 + t);
+	w[3] = .5f * (t3 - t2);
+}
+
+#ifdef RKGK_SSE2
+// one pixel as premultiplied floats, transparent outside of the image
+inline __m128 resample_texel_sse2(const uint8_t* src, const int width, const int height, const int x, const int y)
+{
+	if ((unsigned)x >= (unsigned)width || (unsigned)y >= (unsigned)height) return _mm_setzero_ps();
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i p = _mm_cvtsi32_si128(*(const int*)(src + ((size_t)y * width + x) * 4));
+	const __m128 f = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(p, zero), zero));
+	// rgb times alpha / 255, alpha times 1
+	const __m128 alpha = _mm_shuffle_ps(f, f, _MM_SHUFFLE(3, 3, 3, 3));
+	const __m128 alpha_lane = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+	const __m128 scale = _mm_or_ps(_mm_andnot_ps(alpha_lane, _mm_mul_ps(alpha, _mm_set1_ps(1 / 255.0f))), _mm_and_ps(alpha_lane, _mm_set1_ps(1)));
+	return _mm_mul_ps(f, scale);
+}
+
+// clamps the filtered premultiplied color back into range and stores it straight
+inline void resample_store_sse2(uint8_t* dst, __m128 v)
+{
+	float px[4];
+	_mm_storeu_ps(px, v);
+	const float a = std::max(0.0f, std::min(255.0f, px[3]));
+	if (a < .5f)
+	{
+		*(uint32_t*)dst = 0;
+		return;
+	}
+	const __m128 limit = _mm_set_ps(255, a, a, a);
+	v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), limit);
+	v = _mm_mul_ps(v, _mm_set_ps(1, 255 / a, 255 / a, 255 / a));
+	const __m128i i = _mm_cvtps_epi32(v);
+	const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(i, i), _mm_setzero_si128());
+	*(int*)dst = _mm_cvtsi128_si32(packed);
+}
+#endif
+
+// one pixel as premultiplied floats, transparent outside of the image
+inline void resample_texel(const uint8_t* src, const int width, const int height, const int x, const int y, float out[4])
+{
+	if (x < 0 || y < 0 || x >= width || y >= height)
+	{
+		out[0] = out[1] = out[2] = out[3] = 0;
+		return;
+	}
+	const uint8_t* p = src + ((size_t)y * width + x) * 4;
+	const float a = p[3] / 255.0f;
+	out[0] = p[0] * a;
+	out[1] = p[1] * a;
+	out[2] = p[2] * a;
+	out[3] = p[3];
+}
+
+inline void resample_store(uint8_t* dst, const float px[4])
+{
+	const float a = std::max(0.0f, std::min(255.0f, px[3]));
+	if (a < .5f)
+	{
+		dst[0] = dst[1] = dst[2] = dst[3] = 0;
+		return;
+	}
+	for (int c = 0; c < 3; c++)
+	{
+		dst[c] = (uint8_t)lround(std::max(0.0f, std::min(a, px[c])) * 255 / a);
+	}
+	dst[3] = (uint8_t)lround(a);
+}
+
+// fills the w*h box at (x0, y0) of the destination with the source image seen through dst_to_src,
+// which maps destination positions to source positions (pixel centers at .5). filtering happens on
+// premultiplied colors so transparent pixels don't bleed their color into the edges
+inline void resample(const uint8_t* src, const int src_width, const int src_height,
+	uint8_t* dst, const int x0, const int y0, const int w, const int h,
+	const matrix3x2& dst_to_src, const resample_filter filter)
+{
+	parallel_for_rows(h, resample_band, [&](const int first, const int last)
+	{
+		for (int y = first; y < last; y++)
+		{
+			uint8_t* out = dst + (size_t)y * w * 4;
+			// walk the row in source space, minus the half pixel so the taps land on whole indices
+			const ImVec2 start = dst_to_src.transform_vector(ImVec2(x0 + .5f, y0 + y + .5f));
+			float u = start.x - .5f, v = start.y - .5f;
+			const float du = dst_to_src.m11, dv = dst_to_src.m12;
+			for (int x = 0; x < w; x++, u += du, v += dv, out += 4)
+			{
+				const int ix = (int)floor(u), iy = (int)floor(v);
+				// nowhere near the source, the common case for a rotated image's bounding box
+				if (ix < -2 || iy < -2 || ix > src_width || iy > src_height)
+				{
+					*(uint32_t*)out = 0;
+					continue;
+				}
+				const float fx = u - ix, fy = v - iy;
+#ifdef RKGK_SSE2
+				__m128 sum;
+				if (filter == resample_filter::bilinear)
+				{
+					const __m128 top = _mm_add_ps(_mm_mul_ps(resample_texel_sse2(src, src_width, src_height, ix, iy), _mm_set1_ps(1 - fx)),
+						_mm_mul_ps(resample_texel_sse2(src, src_width, src_height, ix + 1, iy), _mm_set1_ps(fx)));
+					const __m128 bottom = _mm_add_ps(_mm_mul_ps(resample_texel_sse2(src, src_width, src_height, ix, iy + 1), _mm_set1_ps(1 - fx)),
+						_mm_mul_ps(resample_texel_sse2(src, src_width, src_height, ix + 1, iy + 1), _mm_set1_ps(fx)));
+					sum = _mm_add_ps(_mm_mul_ps(top, _mm_set1_ps(1 - fy)), _mm_mul_ps(bottom, _mm_set1_ps(fy)));
+				}
+				else
+				{
+					float wx[4], wy[4];
+					cubic_weights(fx, wx);
+					cubic_weights(fy, wy);
+					sum = _mm_setzero_ps();
+					for (int j = 0; j < 4; j++)
+					{
+						__m128 row = _mm_setzero_ps();
+						for (int i = 0; i < 4; i++)
+						{
+							row = _mm_add_ps(row, _mm_mul_ps(resample_texel_sse2(src, src_width, src_height, ix - 1 + i, iy - 1 + j), _mm_set1_ps(wx[i])));
+						}
+						sum = _mm_add_ps(sum, _mm_mul_ps(row, _mm_set1_ps(wy[j])));
+					}
+				}
+				resample_store_sse2(out, sum);
+#else
+				float sum[4] = {}, texel[4];
+				if (filter == resample_filter::bilinear)
+				{
+					const float weights[4] = { (1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy };
+					for (int i = 0; i < 4; i++)
+					{
+						resample_texel(src, src_width, src_height, ix + (i & 1), iy + (i >> 1), texel);
+						for (int c = 0; c < 4; c++)
+						{
+							sum[c] += texel[c] * weights[i];
+						}
+					}
+				}
+				else
+				{
+					float wx[4], wy[4];
+					cubic_weights(fx, wx);
+					cubic_weights(fy, wy);
+					for (int j = 0; j < 4; j++)
+					{
+						for (int i = 0; i < 4; i++)
+						{
+							resample_texel(src, src_width, src_height, ix - 1 + i, iy - 1 + j, texel);
+							for (int c = 0; c < 4; c++)
+							{
+								sum[c] += texel[c] * wx[i] * wy[j];
+							}
+						}
+					}
+				}
+				resample_store(out, sum);
+#endif
+			}
+		}
+	});
+}